@@ -0,0 +1,551 @@
+
+/*
+ *  h26x_sps_dec.c / mp4_demux.c 中解析函数的微基准
+ *      Ue/u                       : 随机生成的指数哥伦布/定长码流, 旧接口每次调用都重建读取器
+ *      bs_ue/bs_u                 : 同样的码流, SPS 解析实际用的 BitReader_Struct 连续读
+ *      de_emulation_prevention    : test.h264 的数据和每16字节一个 00 00 03 的数据
+ *      h264/h265_decode_sps       : test.h264 的SPS 和内置的 1280x720 Main SPS
+ *      起始码扫描/nal_iter_next   : test.h264 重复拼接到 64MB
+ *      mp4_read_frame             : 用 fmp4_mux 把 test.h264 生成的 mp4
+ *
+ *  方法: 绑定到一个CPU, 每项先预热, 再计时重复 reps 轮, 报告每轮 ns/op 的中位数/最小/最大 和中位数对应的 GB/s
+ *
+ *  用法: bench_h26x [-f test.h264] [-r reps] [-cpu n] [-only name] [-json out.json]
+ *        bench_h26x [file.h264] [reps] (旧用法)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/stat.h>
+
+#include "h26x_sps_dec.h"
+#include "fmp4_mux.h"
+
+#define BENCH_MIN_SIZE (64*1024*1024) //测试数据不足时重复拼接到该大小
+#define BENCH_WARMUP_SEC 0.2 //每项至少预热这么久
+#define BENCH_BITS_SIZE (4*1024*1024) //Ue/u 的码流大小
+#define BENCH_SPS_LOOPS 200000 //SPS 解析一轮的次数
+#define BENCH_MP4_PATH "/tmp/bench_h26x.mp4"
+
+//1280x720 29.97fps Main@L3.1, x265 输出的 SPS
+static const unsigned char h265_sps[] = {
+    0x42, 0x01, 0x01, 0x01, 0x60, 0x00, 0x00, 0x03, 0x00, 0x90, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03,
+    0x00, 0x5d, 0xa0, 0x02, 0x80, 0x80, 0x2d, 0x16, 0x59, 0x59, 0xa4, 0x93, 0x2b, 0xc0, 0x5a, 0x70,
+    0x80, 0x00, 0x01, 0xf4, 0x80, 0x00, 0x3a, 0x98, 0x04
+};
+
+//各项共用的测试数据
+typedef struct{
+    unsigned char *stream; //test.h264 重复拼接
+    unsigned int stream_size;
+    unsigned int file_size; //test.h264 本身的大小
+    unsigned char *bits; //Ue/u 码流
+    unsigned int bits_size;
+    unsigned int ue_count; //bits 里的码字数
+    unsigned char *dense; //高密度防竞争字节
+    unsigned char *dst;
+    unsigned char sps264[256];
+    unsigned int sps264_len;
+    int mp4_ok;
+}BenchData_Struct;
+
+//一项测试: 跑一轮, 给出操作数和处理的字节数
+typedef struct{
+    const char *name;
+    const char *unit; //op 指什么
+    void (*run)(BenchData_Struct *d, unsigned long long *ops, unsigned long long *bytes);
+}BenchCase_Struct;
+
+volatile unsigned long long bench_sink; //防止结果被优化掉
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//读入整个文件并重复拼接, 避免小文件全在缓存里测出虚高的数字
+static unsigned char *load_file(char *filePath, unsigned int *size, unsigned int *fileSize)
+{
+    struct stat st;
+    unsigned char *buf;
+    unsigned int len, total;
+    int fd;
+
+    if((fd = open(filePath, O_RDONLY)) < 0 || fstat(fd, &st) < 0 || st.st_size < 1)
+    {
+        fprintf(stderr, "load_file: open %s err !\n", filePath);
+        return NULL;
+    }
+    len = st.st_size;
+    total = len;
+    while(total < BENCH_MIN_SIZE)
+        total += len;
+    buf = (unsigned char *)malloc(total);
+    if(!buf || read(fd, buf, len) != (int)len)
+    {
+        fprintf(stderr, "load_file: read %s err !\n", filePath);
+        close(fd);
+        free(buf);
+        return NULL;
+    }
+    close(fd);
+    *fileSize = len;
+    for(*size = len; *size + len <= total; *size += len)
+        memcpy(buf + *size, buf, len);
+    return buf;
+}
+
+//---------- 测试数据 ----------
+
+typedef struct{
+    unsigned char *buf;
+    unsigned int size;
+    unsigned long long pos; //位
+}BitWriter_Struct;
+
+static void bw_put(BitWriter_Struct *bw, unsigned int val, int n)
+{
+    while(n-- > 0)
+    {
+        unsigned long long byte = bw->pos >> 3;
+        if(byte >= bw->size)
+            return;
+        if((val >> n) & 1)
+            bw->buf[byte] |= 0x80 >> (bw->pos & 7);
+        bw->pos += 1;
+    }
+}
+
+static void bw_ue(BitWriter_Struct *bw, unsigned int val)
+{
+    unsigned int v = val + 1;
+    int bits = 0;
+    while((v >> bits) > 1)
+        bits += 1;
+    bw_put(bw, 0, bits);
+    bw_put(bw, v, bits + 1);
+}
+
+//值集中在小数(像SPS/slice头里那样), 偶尔有大数
+static void make_bits(BenchData_Struct *d)
+{
+    BitWriter_Struct bw;
+    unsigned int seed = 12345, v;
+
+    d->bits_size = BENCH_BITS_SIZE;
+    d->bits = (unsigned char *)calloc(1, d->bits_size + 8);
+    bw.buf = d->bits;
+    bw.size = d->bits_size;
+    bw.pos = 0;
+    d->ue_count = 0;
+    while(bw.pos + 64 < (unsigned long long)bw.size * 8)
+    {
+        seed = seed * 1103515245 + 12345;
+        v = (seed >> 16) & 0xFF;
+        v = v < 200 ? v & 15 : v < 250 ? v : (seed & 0xFFFF);
+        bw_ue(&bw, v);
+        d->ue_count += 1;
+    }
+}
+
+//每16字节一个 00 00 03 xx, 最坏情况
+static void make_dense(BenchData_Struct *d)
+{
+    unsigned int i;
+    d->dense = (unsigned char *)malloc(d->stream_size);
+    for(i = 0; i < d->stream_size; i++)
+        d->dense[i] = (unsigned char)(i * 131 + 7) | 0x10;
+    for(i = 0; i + 4 <= d->stream_size; i += 16)
+    {
+        d->dense[i] = 0;
+        d->dense[i + 1] = 0;
+        d->dense[i + 2] = 3;
+        d->dense[i + 3] = 1;
+    }
+}
+
+static void find_sps(BenchData_Struct *d)
+{
+    NalIter_Struct it;
+    const unsigned char *nal;
+    unsigned int len;
+    nal_iter_init(&it, d->stream, d->file_size);
+    while(nal_iter_next(&it, &nal, &len))
+    {
+        if((nal[0] & 0x1F) == 7 && len <= sizeof(d->sps264))
+        {
+            memcpy(d->sps264, nal, len);
+            d->sps264_len = len;
+            return;
+        }
+    }
+}
+
+static void mp4_out(void *priv, const unsigned char *data, unsigned int len)
+{
+    if(fwrite(data, 1, len, (FILE *)priv) != len)
+        fprintf(stderr, "make_mp4: write err !\n");
+}
+
+//每个VCL NAL算一帧, 40ms
+static void make_mp4(BenchData_Struct *d)
+{
+    Fmp4Mux_Struct *mux = fmp4_mux_create(1);
+    FILE *fp = fopen(BENCH_MP4_PATH, "wb");
+    NalIter_Struct it;
+    const unsigned char *nal;
+    unsigned int len;
+    unsigned long long pts = 0;
+
+    if(!mux || !fp)
+    {
+        fprintf(stderr, "make_mp4: %s err !\n", BENCH_MP4_PATH);
+        if(fp)
+            fclose(fp);
+        fmp4_mux_destroy(mux);
+        return;
+    }
+    nal_iter_init(&it, d->stream, d->file_size);
+    while(nal_iter_next(&it, &nal, &len))
+    {
+        int type = nal[0] & 0x1F;
+        fmp4_mux_write(mux, nal, len, pts, mp4_out, fp);
+        if(type >= 1 && type <= 5)
+            pts += 40000;
+    }
+    fmp4_mux_flush(mux, mp4_out, fp);
+    fmp4_mux_destroy(mux);
+    fclose(fp);
+    d->mp4_ok = 1;
+}
+
+//---------- 测试项 ----------
+
+static void run_ue(BenchData_Struct *d, unsigned long long *ops, unsigned long long *bytes)
+{
+    unsigned int bit = 0, i;
+    unsigned long long sum = 0;
+    for(i = 0; i < d->ue_count; i++)
+        sum += Ue(d->bits, d->bits_size, &bit);
+    bench_sink = sum;
+    *ops = d->ue_count;
+    *bytes = (bit + 7) / 8;
+}
+
+static void run_u(BenchData_Struct *d, unsigned long long *ops, unsigned long long *bytes)
+{
+    unsigned int bit = 0, n = 1, end = (d->bits_size - 8) * 8;
+    unsigned long long sum = 0, count = 0;
+    //1~16 位轮流, 与 SPS 里定长字段的宽度相近
+    while(bit + n <= end)
+    {
+        sum += u(n, d->bits, &bit);
+        n = n == 16 ? 1 : n + 1;
+        count += 1;
+    }
+    bench_sink = sum;
+    *ops = count;
+    *bytes = bit / 8;
+}
+
+static void run_bs_ue(BenchData_Struct *d, unsigned long long *ops, unsigned long long *bytes)
+{
+    BitReader_Struct bs;
+    unsigned int i;
+    unsigned long long sum = 0;
+    bs_init(&bs, d->bits, d->bits_size);
+    for(i = 0; i < d->ue_count; i++)
+        sum += bs_ue(&bs);
+    bench_sink = sum + bs.error;
+    *ops = d->ue_count;
+    *bytes = (bs_pos(&bs, d->bits) + 7) / 8;
+}
+
+static void run_bs_u(BenchData_Struct *d, unsigned long long *ops, unsigned long long *bytes)
+{
+    BitReader_Struct bs;
+    unsigned int bit = 0, n = 1, end = (d->bits_size - 8) * 8;
+    unsigned long long sum = 0, count = 0;
+    //与 run_u 相同的宽度序列和读取量
+    bs_init(&bs, d->bits, d->bits_size);
+    while(bit + n <= end)
+    {
+        sum += bs_u(&bs, n);
+        bit += n;
+        n = n == 16 ? 1 : n + 1;
+        count += 1;
+    }
+    bench_sink = sum + bs.error;
+    *ops = count;
+    *bytes = bit / 8;
+}
+
+static void run_epb_stream(BenchData_Struct *d, unsigned long long *ops, unsigned long long *bytes)
+{
+    bench_sink = de_emulation_prevention_copy(d->stream, d->stream_size, d->dst, d->stream_size);
+    *ops = 1;
+    *bytes = d->stream_size;
+}
+
+static void run_epb_dense(BenchData_Struct *d, unsigned long long *ops, unsigned long long *bytes)
+{
+    bench_sink = de_emulation_prevention_copy(d->dense, d->stream_size, d->dst, d->stream_size);
+    *ops = 1;
+    *bytes = d->stream_size;
+}
+
+//原地版本会改写输入, 每次先拷到工作区, 拷贝计入耗时
+static void run_epb_inplace(BenchData_Struct *d, unsigned long long *ops, unsigned long long *bytes)
+{
+    unsigned int size = d->stream_size;
+    memcpy(d->dst, d->dense, size);
+    de_emulation_prevention(d->dst, &size);
+    bench_sink = size;
+    *ops = 1;
+    *bytes = d->stream_size;
+}
+
+static void run_h264_sps(BenchData_Struct *d, unsigned long long *ops, unsigned long long *bytes)
+{
+    int w = 0, h = 0, fps = 0, i;
+    for(i = 0; i < BENCH_SPS_LOOPS; i++)
+        h264_decode_sps(d->sps264, d->sps264_len, &w, &h, &fps);
+    bench_sink = w + h + fps;
+    *ops = BENCH_SPS_LOOPS;
+    *bytes = (unsigned long long)BENCH_SPS_LOOPS * d->sps264_len;
+}
+
+static void run_h265_sps(BenchData_Struct *d, unsigned long long *ops, unsigned long long *bytes)
+{
+    unsigned char sps[sizeof(h265_sps)];
+    int w = 0, h = 0, fps = 0, i;
+    memcpy(sps, h265_sps, sizeof(sps));
+    for(i = 0; i < BENCH_SPS_LOOPS; i++)
+        h265_decode_sps(sps, sizeof(sps), &w, &h, &fps);
+    bench_sink = w + h + fps;
+    *ops = BENCH_SPS_LOOPS;
+    *bytes = (unsigned long long)BENCH_SPS_LOOPS * sizeof(sps);
+}
+
+static unsigned int count_start_code(const unsigned char *buf, unsigned int size,
+    const unsigned char *(*find)(const unsigned char *, const unsigned char *))
+{
+    const unsigned char *p = buf, *end = buf + size;
+    unsigned int count = 0;
+    while((p = find(p, end)) < end)
+    {
+        count += 1;
+        p += 3;
+    }
+    return count;
+}
+
+static void run_sc_scalar(BenchData_Struct *d, unsigned long long *ops, unsigned long long *bytes)
+{
+    bench_sink = count_start_code(d->stream, d->stream_size, h26x_find_start_code_c);
+    *ops = 1;
+    *bytes = d->stream_size;
+}
+
+static void run_sc_simd(BenchData_Struct *d, unsigned long long *ops, unsigned long long *bytes)
+{
+    bench_sink = count_start_code(d->stream, d->stream_size, h26x_find_start_code);
+    *ops = 1;
+    *bytes = d->stream_size;
+}
+
+static void run_nal_iter(BenchData_Struct *d, unsigned long long *ops, unsigned long long *bytes)
+{
+    NalIter_Struct it;
+    const unsigned char *nal;
+    unsigned int len, count = 0;
+    nal_iter_init(&it, d->stream, d->stream_size);
+    while(nal_iter_next(&it, &nal, &len))
+        count += 1;
+    bench_sink = count;
+    *ops = count;
+    *bytes = d->stream_size;
+}
+
+//每轮打开文件读出所有NAL, 打开和解析样本表计入耗时
+static void run_mp4_read(BenchData_Struct *d, unsigned long long *ops, unsigned long long *bytes)
+{
+    unsigned long long count = 0, total = 0;
+    int ret;
+    mp4_open((char *)BENCH_MP4_PATH);
+    while((ret = mp4_read_frame(d->dst, d->stream_size)) > 0)
+    {
+        count += 1;
+        total += ret;
+    }
+    mp4_close();
+    bench_sink = total;
+    *ops = count;
+    *bytes = total;
+}
+
+static BenchCase_Struct bench_case[] = {
+    {"Ue", "code", run_ue},
+    {"u", "field", run_u},
+    {"bs_ue", "code", run_bs_ue},
+    {"bs_u", "field", run_bs_u},
+    {"epb_copy_stream", "pass", run_epb_stream},
+    {"epb_copy_dense", "pass", run_epb_dense},
+    {"epb_inplace_dense", "pass", run_epb_inplace},
+    {"h264_decode_sps", "sps", run_h264_sps},
+    {"h265_decode_sps", "sps", run_h265_sps},
+    {"start_code_scalar", "pass", run_sc_scalar},
+    {"start_code_simd", "pass", run_sc_simd},
+    {"nal_iter_next", "nal", run_nal_iter},
+    {"mp4_read_frame", "nal", run_mp4_read},
+};
+
+//---------- 计时 ----------
+
+typedef struct{
+    double ns_med;
+    double ns_min;
+    double ns_max;
+    double gbps; //按中位数
+    unsigned long long ops;
+    unsigned long long bytes;
+}BenchResult_Struct;
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_one(BenchCase_Struct *c, BenchData_Struct *d, int reps, BenchResult_Struct *r)
+{
+    double *ns = (double *)malloc(reps * sizeof(double)), t, start;
+    unsigned long long ops = 0, bytes = 0;
+    int i;
+
+    //预热: 填缓存/分支预测, 让CPU升到稳定频率
+    start = now_sec();
+    do
+        c->run(d, &ops, &bytes);
+    while(now_sec() - start < BENCH_WARMUP_SEC);
+
+    for(i = 0; i < reps; i++)
+    {
+        t = now_sec();
+        c->run(d, &ops, &bytes);
+        t = now_sec() - t;
+        ns[i] = ops ? t * 1e9 / ops : 0;
+    }
+    qsort(ns, reps, sizeof(double), cmp_double);
+    r->ns_med = ns[reps / 2];
+    r->ns_min = ns[0];
+    r->ns_max = ns[reps - 1];
+    r->ops = ops;
+    r->bytes = bytes;
+    r->gbps = r->ns_med > 0 ? (double)bytes / (r->ns_med * ops) : 0;
+    free(ns);
+}
+
+int main(int argc, char **argv)
+{
+    char *filePath = (char *)"./test.h264", *jsonPath = NULL, *only = NULL;
+    int reps = 10, cpu = -1, i, n;
+    BenchData_Struct d;
+    BenchResult_Struct r;
+    FILE *json = NULL;
+    cpu_set_t set;
+
+    for(i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            filePath = argv[++i];
+        else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            reps = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-cpu") == 0 && i + 1 < argc)
+            cpu = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-only") == 0 && i + 1 < argc)
+            only = argv[++i];
+        else if(strcmp(argv[i], "-json") == 0 && i + 1 < argc)
+            jsonPath = argv[++i];
+        else if(argv[i][0] != '-' && i == 1)
+            filePath = argv[i];
+        else if(argv[i][0] != '-' && i == 2)
+            reps = atoi(argv[i]);
+        else
+        {
+            printf("Usage: %s [-f test.h264] [-r reps] [-cpu n] [-only name] [-json out.json]\n", argv[0]);
+            return 0;
+        }
+    }
+    if(reps < 1)
+        reps = 1;
+
+    //绑核: 默认绑在当前所在的CPU上, 避免被调度到别的核上冷缓存重来
+    if(cpu < 0)
+        cpu = sched_getcpu();
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if(sched_setaffinity(0, sizeof(set), &set) < 0)
+        fprintf(stderr, "bench_h26x: pin to cpu %d err, not pinned\n", cpu);
+
+    memset(&d, 0, sizeof(d));
+    if(!(d.stream = load_file(filePath, &d.stream_size, &d.file_size)))
+        return 1;
+    d.dst = (unsigned char *)malloc(d.stream_size);
+    make_bits(&d);
+    make_dense(&d);
+    find_sps(&d);
+    make_mp4(&d);
+
+    if(jsonPath)
+    {
+        json = strcmp(jsonPath, "-") == 0 ? stdout : fopen(jsonPath, "w");
+        if(json == NULL)
+        {
+            fprintf(stderr, "bench_h26x: open %s err !\n", jsonPath);
+            return 1;
+        }
+        fprintf(json, "{\"file\": \"%s\", \"bytes\": %u, \"reps\": %d, \"cpu\": %d, \"results\": [", filePath,
+            d.stream_size, reps, cpu);
+    }
+    if(json != stdout)
+    {
+        printf("%s: %u bytes, %d reps, cpu %d\n", filePath, d.stream_size, reps, cpu);
+        printf("  %-20s %12s %12s %12s %10s %12s\n", "name", "ns/op med", "min", "max", "GB/s", "ops/rep");
+    }
+    for(i = 0, n = 0; i < (int)(sizeof(bench_case) / sizeof(bench_case[0])); i++)
+    {
+        BenchCase_Struct *c = &bench_case[i];
+        if(only && strcmp(only, c->name))
+            continue;
+        if((c->run == run_h264_sps && d.sps264_len == 0) || (c->run == run_mp4_read && !d.mp4_ok))
+            continue;
+        bench_one(c, &d, reps, &r);
+        if(json != stdout)
+            printf("  %-20s %12.2f %12.2f %12.2f %10.3f %12llu %s\n", c->name, r.ns_med, r.ns_min, r.ns_max,
+                r.gbps, r.ops, c->unit);
+        if(json)
+            fprintf(json, "%s\n  {\"name\": \"%s\", \"unit\": \"%s\", \"ops\": %llu, \"bytes\": %llu, "
+                "\"ns_per_op\": %.3f, \"ns_per_op_min\": %.3f, \"ns_per_op_max\": %.3f, \"gbps\": %.4f}",
+                n++ ? "," : "", c->name, c->unit, r.ops, r.bytes, r.ns_med, r.ns_min, r.ns_max, r.gbps);
+    }
+    if(json)
+    {
+        fprintf(json, "\n]}\n");
+        if(json != stdout)
+            fclose(json);
+    }
+
+    unlink(BENCH_MP4_PATH);
+    free(d.stream);
+    free(d.dst);
+    free(d.bits);
+    free(d.dense);
+    return 0;
+}
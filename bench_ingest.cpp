@@ -0,0 +1,569 @@
+
+/*
+ *  收流性能测试: 本进程在回环上起一个 live555 RTSPServer, 把 test.h264 循环发成 N 路,
+ *  再拉起 demo 逐个输出模式(-f/-slave/-shm)收流, 统计稳定后的
+ *      帧率/码率, 每路CPU, 收到->写完 的延迟 p50/p99, 丢包/丢帧
+ *  demo 的指标从 -metrics_port 取, -shm 模式另外挂读者统计 收到->读到 的延迟
+ *
+ *  用法: bench_ingest [-n streams] [-d seconds] [-fast] [-modes f,slave,shm] [-t udp|tcp]
+ *                     [-file test.h264] [-demo ./demo] [-port 8660] [-metrics_port 9190]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "liveMedia.hh"
+#include "BasicUsageEnvironment.hh"
+
+#include "shmem.h"
+
+#define BENCH_LAT_BUCKETS 24 //与 stream_stats.h 的 STREAM_STATS_LAT_BUCKETS 一致
+#define BENCH_WARMUP_US 2000000 //建链和等第一个IDR, 不计入结果
+#define BENCH_SHM_FLAG 'b' //不占用默认的 's', 可以和线上实例同时跑
+
+typedef struct{
+  int streams;
+  int seconds;
+  bool fast;//不按帧率节拍发送
+  char modes[64];
+  char transport[8];
+  char file[128];
+  char demo[128];
+  int port;
+  int metrics_port;
+
+  unsigned char *data;//test.h264 整个读进内存, 各路循环发送
+  unsigned int size;
+}Bench_Pro;
+
+static Bench_Pro bench = {
+  .streams = 1,
+  .seconds = 10,
+  .fast = false,
+  .modes = "f,slave,shm",
+  .transport = "udp",
+  .file = "./test.h264",
+  .demo = "./demo",
+  .port = 8660,
+  .metrics_port = 9190,
+  .data = NULL,
+  .size = 0,
+};
+
+static unsigned long long now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//---------- 服务端: 内存里的码流循环发送 ----------
+
+class LoopSource: public FramedSource {
+public:
+  static LoopSource* createNew(UsageEnvironment& env) { return new LoopSource(env); }
+
+protected:
+  LoopSource(UsageEnvironment& env) : FramedSource(env), fPos(0) {}
+
+private:
+  virtual void doGetNextFrame() {
+    unsigned int len = bench.size - fPos;
+    if(len > fMaxSize)
+      len = fMaxSize;
+    memcpy(fTo, bench.data + fPos, len);
+    fFrameSize = len;
+    fNumTruncatedBytes = 0;
+    fPos = (fPos + len) % bench.size;
+    //交给下一轮事件循环, 避免在解析器里递归
+    nextTask() = envir().taskScheduler().scheduleDelayedTask(0, (TaskFunc*)FramedSource::afterGetting, this);
+  }
+
+private:
+  unsigned int fPos;
+};
+
+//-fast: 帧率设得极大, RTPSink 几乎不等待, 发送速度只受收端和回环限制
+//  SPS 里带 VUI 帧率时解析器会改回去, test.h264 没有
+class FastH264Framer: public H264VideoStreamFramer {
+public:
+  static FastH264Framer* createNew(UsageEnvironment& env, FramedSource* inputSource) {
+    return new FastH264Framer(env, inputSource);
+  }
+
+protected:
+  FastH264Framer(UsageEnvironment& env, FramedSource* inputSource)
+    : H264VideoStreamFramer(env, inputSource, True, False) {
+    fFrameRate = 100000.0;
+  }
+};
+
+class LoopSubsession: public OnDemandServerMediaSubsession {
+public:
+  static LoopSubsession* createNew(UsageEnvironment& env) { return new LoopSubsession(env); }
+
+protected:
+  LoopSubsession(UsageEnvironment& env) : OnDemandServerMediaSubsession(env, False) {}
+
+  virtual FramedSource* createNewStreamSource(unsigned /*clientSessionId*/, unsigned& estBitrate) {
+    estBitrate = 4000;
+    if(bench.fast)
+      return FastH264Framer::createNew(envir(), LoopSource::createNew(envir()));
+    return H264VideoStreamFramer::createNew(envir(), LoopSource::createNew(envir()));
+  }
+  virtual RTPSink* createNewRTPSink(Groupsock* rtpGroupsock, unsigned char rtpPayloadTypeIfDynamic,
+    FramedSource* /*inputSource*/) {
+    return H264VideoRTPSink::createNew(envir(), rtpGroupsock, rtpPayloadTypeIfDynamic);
+  }
+};
+
+static void *server_thread(void *argv)
+{
+  UsageEnvironment *env = (UsageEnvironment*)argv;
+  env->taskScheduler().doEventLoop();
+  return NULL;
+}
+
+static int server_start(void)
+{
+  TaskScheduler *scheduler = BasicTaskScheduler::createNew();
+  UsageEnvironment *env = BasicUsageEnvironment::createNew(*scheduler);
+  pthread_t th;
+  char name[16];
+  int i;
+
+  OutPacketBuffer::increaseMaxSizeTo(2 * 1024 * 1024);
+  RTSPServer *server = RTSPServer::createNew(*env, bench.port);
+  if(server == NULL)
+  {
+    fprintf(stderr, "bench_ingest: rtsp server port %d err: %s\n", bench.port, env->getResultMsg());
+    return -1;
+  }
+  for(i = 0; i < bench.streams; i++)
+  {
+    snprintf(name, sizeof(name), "bench%d", i);
+    ServerMediaSession *sms = ServerMediaSession::createNew(*env, name, name, "bench_ingest");
+    sms->addSubsession(LoopSubsession::createNew(*env));
+    server->addServerMediaSession(sms);
+  }
+  return pthread_create(&th, NULL, server_thread, env);
+}
+
+//---------- demo 的指标 ----------
+
+typedef struct{
+  unsigned long long us;
+  unsigned long long cpu_ticks;
+  double frames;
+  double bytes;
+  double dropped;
+  double rtp_lost;
+  double lat_count;
+  double lat_bucket[BENCH_LAT_BUCKETS];//累计
+}BenchSnap_Pro;
+
+//取 -metrics_port 的文本, 各路求和
+static int metrics_scrape(BenchSnap_Pro *snap)
+{
+  static char buf[1024 * 1024];
+  struct sockaddr_in addr;
+  int fd, len = 0, n, b;
+  char *line, *save = NULL;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(bench.metrics_port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if(fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+  {
+    if(fd >= 0)
+      close(fd);
+    return -1;
+  }
+  send(fd, "GET /metrics HTTP/1.0\r\n\r\n", 25, MSG_NOSIGNAL);
+  while(len < (int)sizeof(buf) - 1 && (n = recv(fd, buf + len, sizeof(buf) - 1 - len, 0)) > 0)
+    len += n;
+  close(fd);
+  buf[len] = 0;
+
+  for(line = strtok_r(buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save))
+  {
+    char *value = strrchr(line, ' ');
+    if(line[0] == '#' || value == NULL)
+      continue;
+    double v = atof(value + 1);
+    if(strncmp(line, "rtsp_frames_total{", 18) == 0)
+      snap->frames += v;
+    else if(strncmp(line, "rtsp_received_bytes_total{", 26) == 0)
+      snap->bytes += v;
+    else if(strncmp(line, "rtsp_dropped_nals_total{", 24) == 0)
+      snap->dropped += v;
+    else if(strncmp(line, "rtsp_rtp_lost_total{", 20) == 0)
+      snap->rtp_lost += v;
+    else if(strncmp(line, "rtsp_publish_latency_seconds_count{", 35) == 0)
+      snap->lat_count += v;
+    else if(strncmp(line, "rtsp_publish_latency_seconds_bucket{", 36) == 0)
+    {
+      char *le = strstr(line, "le=\"");
+      if(le == NULL || le[4] == '+')
+        continue;
+      //第b格的上界是 2^b us
+      double us = atof(le + 4) * 1000000;
+      for(b = 0; b < BENCH_LAT_BUCKETS - 1 && (double)(1ULL << b) < us - 0.5; b++)
+        ;
+      snap->lat_bucket[b] += v;
+    }
+  }
+  return 0;
+}
+
+static unsigned long long proc_cpu_ticks(pid_t pid)
+{
+  char path[64], buf[1024], *p;
+  unsigned long long utime = 0, stime = 0;
+  int fd, n, i;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  if((fd = open(path, O_RDONLY)) < 0)
+    return 0;
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if(n <= 0)
+    return 0;
+  buf[n] = 0;
+  //comm 里可能有空格, 从最后一个')'之后数: state 是第3个字段, utime/stime 是第14/15个
+  p = strrchr(buf, ')');
+  for(i = 3; p && i <= 14; i++)
+    p = strchr(p + 1, ' ');
+  if(p)
+    sscanf(p + 1, "%llu %llu", &utime, &stime);
+  return utime + stime;
+}
+
+static void snap_take(pid_t pid, BenchSnap_Pro *snap)
+{
+  memset(snap, 0, sizeof(BenchSnap_Pro));
+  metrics_scrape(snap);
+  snap->cpu_ticks = proc_cpu_ticks(pid);
+  snap->us = now_us();
+}
+
+//直方图分位: 落在哪一格就报该格上界, 精度为2倍
+static double snap_pct_ms(BenchSnap_Pro *a, BenchSnap_Pro *b, double pct)
+{
+  double count = b->lat_count - a->lat_count;
+  int i;
+  if(count <= 0)
+    return 0;
+  for(i = 0; i < BENCH_LAT_BUCKETS - 1; i++)
+  {
+    if(b->lat_bucket[i] - a->lat_bucket[i] >= count * pct)
+      return (double)(1ULL << i) / 1000;
+  }
+  return (double)(1ULL << (BENCH_LAT_BUCKETS - 1)) / 1000;
+}
+
+//---------- 输出端的读者 ----------
+
+typedef struct{
+  pthread_t th;
+  int index;
+  volatile bool stop;
+  volatile bool measure;
+  unsigned long long bytes;//-slave
+  unsigned long long frames;//-shm, 只计测量期间
+  unsigned long long drops;
+  unsigned long long *lat;//收到->读到 us
+  unsigned int lat_count;
+  unsigned int lat_size;
+  int fd;
+}BenchReader_Pro;
+
+static void *slave_reader(void *argv)
+{
+  BenchReader_Pro *rd = (BenchReader_Pro*)argv;
+  static char buf[256 * 1024];
+  int n;
+  while((n = read(rd->fd, buf, sizeof(buf))) > 0)
+  {
+    if(rd->measure)
+      rd->bytes += n;
+  }
+  return NULL;
+}
+
+static void *shm_reader(void *argv)
+{
+  BenchReader_Pro *rd = (BenchReader_Pro*)argv;
+  ShmRing_Struct *ring = NULL;
+  ShmFrameTime_Struct ft;
+  unsigned char *buf = NULL;
+  unsigned long long drops0 = 0;
+  int reader = -1, len;
+  bool measuring = false;
+
+  while(!rd->stop && ring == NULL)
+  {
+    ring = shm_ring_attach((char*)"/tmp", BENCH_SHM_FLAG + rd->index, NULL);
+    if(ring == NULL)
+      usleep(100000);
+  }
+  if(ring == NULL || (reader = shm_ring_reader_open(ring)) < 0)
+    return NULL;
+  buf = (unsigned char*)malloc(ring->slot_size);
+  while(!rd->stop)
+  {
+    if(rd->measure && !measuring)
+    {
+      measuring = true;
+      drops0 = ring->reader[reader].drops;
+    }
+    if(!shm_ring_wait(ring, reader, 100))
+      continue;
+    while((len = shm_ring_read_ts(ring, reader, buf, ring->slot_size, &ft)) != 0)
+    {
+      if(len < 0 || !measuring)
+        continue;
+      rd->frames += 1;
+      if(rd->lat_count == rd->lat_size)
+      {
+        rd->lat_size = rd->lat_size ? rd->lat_size * 2 : 4096;
+        rd->lat = (unsigned long long*)realloc(rd->lat, rd->lat_size * sizeof(unsigned long long));
+      }
+      rd->lat[rd->lat_count++] = now_us() - ft.recv_us;
+    }
+  }
+  rd->drops = ring->reader[reader].drops - drops0;
+  shm_ring_reader_close(ring, reader);
+  shm_ring_detach(ring);
+  free(buf);
+  return NULL;
+}
+
+static int lat_cmp(const void *a, const void *b)
+{
+  unsigned long long x = *(const unsigned long long*)a, y = *(const unsigned long long*)b;
+  return x < y ? -1 : x > y;
+}
+
+//---------- 一种输出模式跑一轮 ----------
+
+static void run_mode(const char *mode)
+{
+  char outDir[64] = {0}, outFile[96], mport[16], urls[64][64];
+  const char *args[128];
+  BenchReader_Pro *rd = (BenchReader_Pro*)calloc(bench.streams, sizeof(BenchReader_Pro));
+  BenchSnap_Pro a, b;
+  int pipeFd[2] = {-1, -1}, argc = 0, i;
+  pid_t pid;
+
+  args[argc++] = bench.demo;
+  for(i = 0; i < bench.streams && i < 64; i++)
+  {
+    snprintf(urls[i], sizeof(urls[i]), "rtsp://127.0.0.1:%d/bench%d", bench.port, i);
+    args[argc++] = urls[i];
+  }
+  snprintf(mport, sizeof(mport), "%d", bench.metrics_port);
+  args[argc++] = "-metrics_port";
+  args[argc++] = mport;
+  args[argc++] = "-t";
+  args[argc++] = bench.transport;
+  if(strcmp(mode, "f") == 0)
+  {
+    strcpy(outDir, "/tmp/bench_ingest.XXXXXX");
+    if(mkdtemp(outDir) == NULL)
+      return;
+    snprintf(outFile, sizeof(outFile), "%s/bench", outDir);
+    args[argc++] = "-f";
+    args[argc++] = outFile;
+  }
+  else if(strcmp(mode, "slave") == 0)
+  {
+    args[argc++] = "-slave";
+    if(pipe(pipeFd) < 0)
+      return;
+  }
+  else if(strcmp(mode, "shm") == 0)
+  {
+    args[argc++] = "-shm";
+    args[argc++] = "-shm_flag";
+    args[argc++] = "b";
+  }
+  else
+  {
+    fprintf(stderr, "bench_ingest: unknown mode %s\n", mode);
+    return;
+  }
+  args[argc] = NULL;
+
+  pid = fork();
+  if(pid == 0)
+  {
+    int null = open("/dev/null", O_RDWR);
+    dup2(pipeFd[1] >= 0 ? pipeFd[1] : null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    if(pipeFd[0] >= 0)
+      close(pipeFd[0]);
+    execv(bench.demo, (char* const*)args);
+    _exit(127);
+  }
+  if(pid < 0)
+    return;
+
+  //-slave 只把第一路写到 stdout
+  if(pipeFd[0] >= 0)
+  {
+    close(pipeFd[1]);
+    rd[0].fd = pipeFd[0];
+    pthread_create(&rd[0].th, NULL, slave_reader, &rd[0]);
+  }
+  if(strcmp(mode, "shm") == 0)
+  {
+    for(i = 0; i < bench.streams; i++)
+    {
+      rd[i].index = i;
+      pthread_create(&rd[i].th, NULL, shm_reader, &rd[i]);
+    }
+  }
+
+  usleep(BENCH_WARMUP_US);
+  snap_take(pid, &a);
+  for(i = 0; i < bench.streams; i++)
+    rd[i].measure = true;
+  usleep(bench.seconds * 1000000);
+  snap_take(pid, &b);
+  for(i = 0; i < bench.streams; i++)
+    rd[i].measure = false;
+
+  kill(pid, SIGINT);
+  waitpid(pid, NULL, 0);
+  if(pipeFd[0] >= 0)
+  {
+    pthread_join(rd[0].th, NULL);
+    close(pipeFd[0]);
+  }
+  if(strcmp(mode, "shm") == 0)
+  {
+    for(i = 0; i < bench.streams; i++)
+    {
+      rd[i].stop = true;
+      pthread_join(rd[i].th, NULL);
+    }
+  }
+
+  double sec = (b.us - a.us) / 1e6;
+  double cpu = (double)(b.cpu_ticks - a.cpu_ticks) / sysconf(_SC_CLK_TCK) / sec * 100;
+  printf("%-6s %7d %10.1f %10.2f %10.2f %9.3f %9.3f %8.0f %8.0f",
+    mode, bench.streams, (b.frames - a.frames) / sec, (b.bytes - a.bytes) / sec / 1e6,
+    cpu / bench.streams, snap_pct_ms(&a, &b, 0.5), snap_pct_ms(&a, &b, 0.99),
+    b.rtp_lost - a.rtp_lost, b.dropped - a.dropped);
+  if(strcmp(mode, "slave") == 0)
+    printf("   stdout %.2f MB/s", rd[0].bytes / sec / 1e6);
+  if(strcmp(mode, "shm") == 0)
+  {
+    unsigned long long frames = 0, drops = 0, *all = NULL;
+    unsigned int count = 0;
+    for(i = 0; i < bench.streams; i++)
+    {
+      frames += rd[i].frames;
+      drops += rd[i].drops;
+      all = (unsigned long long*)realloc(all, (count + rd[i].lat_count + 1) * sizeof(unsigned long long));
+      memcpy(all + count, rd[i].lat, rd[i].lat_count * sizeof(unsigned long long));
+      count += rd[i].lat_count;
+      free(rd[i].lat);
+    }
+    if(count)
+    {
+      qsort(all, count, sizeof(unsigned long long), lat_cmp);
+      printf("   reader %.1f nal/s p50 %.3f p99 %.3f ms drops %llu", frames / sec,
+        all[(count - 1) / 2] / 1000.0, all[(unsigned long long)(count - 1) * 99 / 100] / 1000.0, drops);
+    }
+    free(all);
+  }
+  printf("\n");
+  fflush(stdout);
+
+  if(outDir[0])
+  {
+    char cmd[96];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", outDir);
+    if(system(cmd) != 0)
+      fprintf(stderr, "bench_ingest: remove %s err\n", outDir);
+  }
+  free(rd);
+}
+
+int main(int argc, char **argv)
+{
+  struct stat st;
+  char *mode, *save = NULL;
+  int fd, i;
+
+  for(i = 1; i < argc; i++)
+  {
+    if(strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+      bench.streams = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+      bench.seconds = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-fast") == 0)
+      bench.fast = true;
+    else if(strcmp(argv[i], "-modes") == 0 && i + 1 < argc)
+      snprintf(bench.modes, sizeof(bench.modes), "%s", argv[++i]);
+    else if(strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+      snprintf(bench.transport, sizeof(bench.transport), "%s", argv[++i]);
+    else if(strcmp(argv[i], "-file") == 0 && i + 1 < argc)
+      snprintf(bench.file, sizeof(bench.file), "%s", argv[++i]);
+    else if(strcmp(argv[i], "-demo") == 0 && i + 1 < argc)
+      snprintf(bench.demo, sizeof(bench.demo), "%s", argv[++i]);
+    else if(strcmp(argv[i], "-port") == 0 && i + 1 < argc)
+      bench.port = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-metrics_port") == 0 && i + 1 < argc)
+      bench.metrics_port = atoi(argv[++i]);
+    else
+    {
+      printf("Usage: %s [-n streams] [-d seconds] [-fast] [-modes f,slave,shm] [-t udp|tcp]\n"
+        "          [-file test.h264] [-demo ./demo] [-port 8660] [-metrics_port 9190]\n", argv[0]);
+      return 0;
+    }
+  }
+  if(bench.streams < 1 || bench.streams > 64)
+    bench.streams = 1;
+  if(bench.seconds < 1)
+    bench.seconds = 1;
+
+  if((fd = open(bench.file, O_RDONLY)) < 0 || fstat(fd, &st) < 0 || st.st_size < 1)
+  {
+    fprintf(stderr, "bench_ingest: open %s err\n", bench.file);
+    return 1;
+  }
+  bench.size = st.st_size;
+  bench.data = (unsigned char*)malloc(bench.size);
+  if(bench.data == NULL || read(fd, bench.data, bench.size) != (int)bench.size)
+  {
+    fprintf(stderr, "bench_ingest: read %s err\n", bench.file);
+    return 1;
+  }
+  close(fd);
+  signal(SIGPIPE, SIG_IGN);
+
+  if(server_start() != 0)
+    return 1;
+  printf("bench_ingest: %s x %d, %s, %s, %ds per mode\n", bench.file, bench.streams,
+    bench.fast ? "unthrottled" : "real-time", bench.transport, bench.seconds);
+  printf("%-6s %7s %10s %10s %10s %9s %9s %8s %8s\n",
+    "mode", "streams", "frames/s", "MB/s", "cpu%/strm", "p50 ms", "p99 ms", "rtp lost", "dropped");
+  for(mode = strtok_r(bench.modes, ",", &save); mode; mode = strtok_r(NULL, ",", &save))
+    run_mode(mode);
+  return 0;
+}
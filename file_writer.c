@@ -0,0 +1,749 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "file_writer.h"
+
+#define FILE_WRITER_ALIGN_UP(x) (((x) + FILE_WRITER_ALIGN - 1) & ~(FILE_WRITER_ALIGN - 1))
+
+static unsigned long long now_ms(void)
+{
+    struct timespec ts;
+    //COARSE 走vDSO且精度够用, 每帧调用一次不值得更贵的时钟
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//把 iov 全部写出, 处理短写, iov 内容会被修改
+static int fw_output(FileWriter_Struct *fw, struct iovec *iov, int iovcnt)
+{
+    ssize_t ret;
+    while(iovcnt > 0)
+    {
+        if(fw->seekable)
+            ret = pwritev(fw->fd, iov, iovcnt, fw->offset);
+        else
+            ret = writev(fw->fd, iov, iovcnt);
+        fw->syscalls += 1;
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            fw->errors += 1;
+            return -1;
+        }
+        fw->offset += ret;
+        while(iovcnt > 0 && (size_t)ret >= iov->iov_len)
+        {
+            ret -= iov->iov_len;
+            iov += 1;
+            iovcnt -= 1;
+        }
+        if(iovcnt > 0)
+        {
+            iov->iov_base = (unsigned char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return 0;
+}
+
+//一段数据离开缓冲, 告诉调用者它落在文件的哪里
+static void fw_handed(FileWriter_Struct *fw, unsigned int n, unsigned long long offset, int written)
+{
+    if(fw->on_block)
+        fw->on_block(fw->priv, fw->handed, n, offset, written);
+    fw->handed += n;
+}
+
+static FileWriter_Struct *fw_new(int fd, unsigned int bufSize, unsigned int flushMs)
+{
+    FileWriter_Struct *fw;
+    void *buf = NULL;
+
+    bufSize = FILE_WRITER_ALIGN_UP(bufSize ? bufSize : FILE_WRITER_BUF_SIZE);
+    fw = (FileWriter_Struct *)calloc(1, sizeof(FileWriter_Struct));
+    if(!fw || posix_memalign(&buf, FILE_WRITER_ALIGN, bufSize))
+    {
+        fprintf(stderr, "file_writer: malloc %u err !\n", bufSize);
+        free(fw);
+        return NULL;
+    }
+    fw->fd = fd;
+    fw->buf = (unsigned char *)buf;
+    fw->size = bufSize;
+    fw->flush_ms = flushMs;
+    fw->flush_time = now_ms();
+    fw->seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+    if(fw->seekable)
+        fw->offset = lseek(fd, 0, SEEK_CUR);
+    return fw;
+}
+
+FileWriter_Struct *file_writer_open(char *filePath, unsigned int bufSize, unsigned int flushMs, int direct)
+{
+    FileWriter_Struct *fw;
+    int fd = -1;
+
+    if(direct)
+    {
+        fd = open(filePath, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        //tmpfs 等不支持 O_DIRECT
+        if(fd < 0)
+            fprintf(stderr, "file_writer: %s O_DIRECT err %d, fallback to buffered io\n", filePath, errno);
+    }
+    if(fd < 0)
+    {
+        direct = 0;
+        fd = open(filePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if(fd < 0)
+    {
+        fprintf(stderr, "file_writer: open %s err %d\n", filePath, errno);
+        return NULL;
+    }
+    if(!(fw = fw_new(fd, bufSize, flushMs)))
+    {
+        close(fd);
+        return NULL;
+    }
+    fw->direct = direct;
+    return fw;
+}
+
+FileWriter_Struct *file_writer_open_fd(int fd, unsigned int bufSize, unsigned int flushMs)
+{
+    FileWriter_Struct *fw = fw_new(fd, bufSize, flushMs);
+    //与调用者共用文件位置(如 >> 重定向), 只能用 writev
+    if(fw)
+    {
+        fw->external = 1;
+        fw->seekable = 0;
+    }
+    return fw;
+}
+
+//---------- 异步写 ----------
+//满的缓冲块交给 io_uring 或写线程, 事件循环线程换一块空闲的继续填, 从不等磁盘
+//  空闲块用完(磁盘跟不上)时丢弃当前块并计入 stalls/dropped, 而不是阻塞收流, nodrop 时改为等待
+
+typedef struct{
+    unsigned char *data;
+    unsigned int len;
+    unsigned int done; //已写出的字节, 短写时从这里续写
+    unsigned long long offset;
+    struct iovec iov;
+}FwBlock_Struct;
+
+typedef struct{
+    int mode; //FILE_WRITER_AIO_THREAD/FILE_WRITER_AIO_URING
+    FileWriter_Struct *fw;
+    unsigned int count; //块数 = 队列深度 + 1(正在填的那块)
+    unsigned int cur;
+    FwBlock_Struct *block;
+    unsigned int *idle; //空闲块栈
+    unsigned int idle_count;
+
+    //写线程
+    pthread_t th;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned int *queue; //待写块, 按提交顺序
+    unsigned int q_head, q_tail;
+    int quit;
+
+    //io_uring, 直接用系统调用, 不依赖 liburing
+    int ring_fd;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+}FwAio_Struct;
+
+static int uring_init(FwAio_Struct *aio, unsigned int entries)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    aio->ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+    if(aio->ring_fd < 0)
+        return -1;
+    aio->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    aio->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(aio->cq_size > aio->sq_size)
+            aio->sq_size = aio->cq_size;
+        aio->cq_size = aio->sq_size;
+    }
+    aio->sq_ptr = mmap(NULL, aio->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, aio->ring_fd, IORING_OFF_SQ_RING);
+    if(aio->sq_ptr == MAP_FAILED)
+        goto err;
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        aio->cq_ptr = aio->sq_ptr;
+    else
+    {
+        aio->cq_ptr = mmap(NULL, aio->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, aio->ring_fd, IORING_OFF_CQ_RING);
+        if(aio->cq_ptr == MAP_FAILED)
+        {
+            munmap(aio->sq_ptr, aio->sq_size);
+            goto err;
+        }
+    }
+    aio->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    aio->sqes = (struct io_uring_sqe *)mmap(NULL, aio->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, aio->ring_fd, IORING_OFF_SQES);
+    if(aio->sqes == MAP_FAILED)
+    {
+        if(aio->cq_ptr != aio->sq_ptr)
+            munmap(aio->cq_ptr, aio->cq_size);
+        munmap(aio->sq_ptr, aio->sq_size);
+        goto err;
+    }
+    aio->sq_head = (unsigned int *)((char *)aio->sq_ptr + p.sq_off.head);
+    aio->sq_tail = (unsigned int *)((char *)aio->sq_ptr + p.sq_off.tail);
+    aio->sq_mask = (unsigned int *)((char *)aio->sq_ptr + p.sq_off.ring_mask);
+    aio->sq_array = (unsigned int *)((char *)aio->sq_ptr + p.sq_off.array);
+    aio->cq_head = (unsigned int *)((char *)aio->cq_ptr + p.cq_off.head);
+    aio->cq_tail = (unsigned int *)((char *)aio->cq_ptr + p.cq_off.tail);
+    aio->cq_mask = (unsigned int *)((char *)aio->cq_ptr + p.cq_off.ring_mask);
+    aio->cqes = (struct io_uring_cqe *)((char *)aio->cq_ptr + p.cq_off.cqes);
+    return 0;
+err:
+    close(aio->ring_fd);
+    aio->ring_fd = -1;
+    return -1;
+}
+
+static void uring_exit(FwAio_Struct *aio)
+{
+    munmap(aio->sqes, aio->sqes_size);
+    if(aio->cq_ptr != aio->sq_ptr)
+        munmap(aio->cq_ptr, aio->cq_size);
+    munmap(aio->sq_ptr, aio->sq_size);
+    close(aio->ring_fd);
+}
+
+//SQ 里还没被内核取走的条目数, 没有 SQPOLL 时只在 io_uring_enter 里被取走
+static unsigned int uring_pending(FwAio_Struct *aio)
+{
+    return *aio->sq_tail - __atomic_load_n(aio->sq_head, __ATOMIC_ACQUIRE);
+}
+
+//提交 SQ 里所有待提交的, wait 为1时同时等至少一个完成, return: 0/success -1/出错(errno)
+static int uring_enter(FwAio_Struct *aio, int wait)
+{
+    int ret;
+    do
+    {
+        ret = syscall(__NR_io_uring_enter, aio->ring_fd, uring_pending(aio), wait ? 1 : 0,
+            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    }while(ret < 0 && errno == EINTR);
+    return ret < 0 ? -1 : 0;
+}
+
+//块写完(或写失败)后放回空闲栈
+static void uring_done(FwAio_Struct *aio, unsigned int idx)
+{
+    aio->idle[aio->idle_count++] = idx;
+    aio->fw->inflight -= 1;
+}
+
+//提交失败时同写线程一样直接 pwrite, 不让块留在 SQ 里没人提交
+static void uring_write_sync(FwAio_Struct *aio, unsigned int idx)
+{
+    FileWriter_Struct *fw = aio->fw;
+    FwBlock_Struct *b = &aio->block[idx];
+    ssize_t ret;
+
+    while(b->done < b->len)
+    {
+        ret = pwrite(fw->fd, b->data + b->done, b->len - b->done, b->offset + b->done);
+        fw->syscalls += 1;
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+        {
+            fw->errors += 1;
+            break;
+        }
+        b->done += ret;
+    }
+    uring_done(aio, idx);
+}
+
+//在飞的块不超过 sq_entries, SQ 不会满
+static void uring_submit(FwAio_Struct *aio, unsigned int idx)
+{
+    FwBlock_Struct *b = &aio->block[idx];
+    unsigned int tail = *aio->sq_tail;
+    unsigned int index = tail & *aio->sq_mask;
+    struct io_uring_sqe *sqe = &aio->sqes[index];
+
+    b->iov.iov_base = b->data + b->done;
+    b->iov.iov_len = b->len - b->done;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = aio->fw->fd;
+    sqe->addr = (unsigned long)&b->iov;
+    sqe->len = 1;
+    sqe->off = b->offset + b->done;
+    sqe->user_data = idx;
+    aio->sq_array[index] = index;
+    __atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    aio->fw->syscalls += 1;
+    if(uring_enter(aio, 0) == 0 && uring_pending(aio) == 0)
+        return;
+    //EAGAIN/EBUSY/ENOMEM 等: 内核一个都没取走(没有 SQPOLL, 失败时 head 不动), 收回这一条改为同步写
+    aio->fw->errors += 1;
+    __atomic_store_n(aio->sq_tail, tail, __ATOMIC_RELEASE);
+    uring_write_sync(aio, idx);
+}
+
+//收割完成的写, wait 为1时至少等到一个完成
+static void uring_reap(FwAio_Struct *aio, int wait)
+{
+    FileWriter_Struct *fw = aio->fw;
+    unsigned int head, idx;
+    int res;
+
+    while(fw->inflight)
+    {
+        head = *aio->cq_head;
+        if(head == __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            if(!wait)
+                break;
+            //持续出错(如 ENOMEM)时不原地空转
+            if(uring_enter(aio, 1) < 0)
+                usleep(1000);
+            continue;
+        }
+        idx = aio->cqes[head & *aio->cq_mask].user_data;
+        res = aio->cqes[head & *aio->cq_mask].res;
+        __atomic_store_n(aio->cq_head, head + 1, __ATOMIC_RELEASE);
+        wait = 0;
+        if(res == -EINTR || res == -EAGAIN)
+        {
+            uring_submit(aio, idx);
+            continue;
+        }
+        //res == 0 时一个字节都没写进去(如磁盘满), 与写失败一样处理, 不能当作写完
+        if(res <= 0)
+            fw->errors += 1;
+        else
+        {
+            aio->block[idx].done += res;
+            //短写: 续写剩下的部分
+            if(aio->block[idx].done < aio->block[idx].len)
+            {
+                uring_submit(aio, idx);
+                continue;
+            }
+        }
+        uring_done(aio, idx);
+    }
+}
+
+static void *fw_thread(void *argv)
+{
+    FwAio_Struct *aio = (FwAio_Struct *)argv;
+    FileWriter_Struct *fw = aio->fw;
+    FwBlock_Struct *b;
+    unsigned int idx;
+    ssize_t ret;
+
+    pthread_mutex_lock(&aio->lock);
+    while(1)
+    {
+        while(aio->q_head == aio->q_tail && !aio->quit)
+            pthread_cond_wait(&aio->cond, &aio->lock);
+        if(aio->q_head == aio->q_tail)
+            break;
+        idx = aio->queue[aio->q_head++ % aio->count];
+        pthread_mutex_unlock(&aio->lock);
+
+        b = &aio->block[idx];
+        while(b->done < b->len)
+        {
+            ret = pwrite(fw->fd, b->data + b->done, b->len - b->done, b->offset + b->done);
+            __atomic_add_fetch(&fw->syscalls, 1, __ATOMIC_RELAXED);
+            if(ret < 0 && errno == EINTR)
+                continue;
+            if(ret <= 0)
+            {
+                __atomic_add_fetch(&fw->errors, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            b->done += ret;
+        }
+
+        pthread_mutex_lock(&aio->lock);
+        aio->idle[aio->idle_count++] = idx;
+        fw->inflight -= 1;
+        pthread_cond_broadcast(&aio->cond);
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return NULL;
+}
+
+//return: 取到的空闲块 -1/没有空闲块
+static int fw_aio_get(FwAio_Struct *aio)
+{
+    int idx = -1;
+    if(aio->mode == FILE_WRITER_AIO_URING)
+    {
+        uring_reap(aio, 0);
+        if(aio->idle_count)
+            idx = aio->idle[--aio->idle_count];
+        return idx;
+    }
+    pthread_mutex_lock(&aio->lock);
+    if(aio->idle_count)
+        idx = aio->idle[--aio->idle_count];
+    pthread_mutex_unlock(&aio->lock);
+    return idx;
+}
+
+static void fw_aio_put(FwAio_Struct *aio, unsigned int idx)
+{
+    FileWriter_Struct *fw = aio->fw;
+    if(aio->mode == FILE_WRITER_AIO_URING)
+    {
+        fw->inflight += 1;
+        uring_submit(aio, idx);
+    }
+    else
+    {
+        pthread_mutex_lock(&aio->lock);
+        fw->inflight += 1;
+        aio->queue[aio->q_tail++ % aio->count] = idx;
+        pthread_cond_broadcast(&aio->cond);
+        pthread_mutex_unlock(&aio->lock);
+    }
+    if(fw->inflight > fw->inflight_max)
+        fw->inflight_max = fw->inflight;
+}
+
+//等到有空闲块, 用于关闭/切段这种不能丢数据的场合
+static int fw_aio_get_wait(FwAio_Struct *aio)
+{
+    int idx;
+    if(aio->mode == FILE_WRITER_AIO_URING)
+    {
+        //没有空闲块时其余的块都在飞
+        while((idx = fw_aio_get(aio)) < 0)
+            uring_reap(aio, 1);
+        return idx;
+    }
+    pthread_mutex_lock(&aio->lock);
+    while(aio->idle_count == 0)
+        pthread_cond_wait(&aio->cond, &aio->lock);
+    idx = aio->idle[--aio->idle_count];
+    pthread_mutex_unlock(&aio->lock);
+    return idx;
+}
+
+//等所有在飞的块写完
+static void fw_aio_drain(FwAio_Struct *aio)
+{
+    if(aio->mode == FILE_WRITER_AIO_URING)
+    {
+        while(aio->fw->inflight)
+            uring_reap(aio, 1);
+        return;
+    }
+    pthread_mutex_lock(&aio->lock);
+    while(aio->fw->inflight)
+        pthread_cond_wait(&aio->cond, &aio->lock);
+    pthread_mutex_unlock(&aio->lock);
+}
+
+//把当前块的前 n 字节交出去写, 剩下的尾巴搬到新块开头, wait 为1时没有空闲块就等, 不丢
+static int fw_aio_flush(FileWriter_Struct *fw, unsigned int n, int wait)
+{
+    FwAio_Struct *aio = (FwAio_Struct *)fw->aio;
+    FwBlock_Struct *b = &aio->block[aio->cur];
+    int next = fw_aio_get(aio);
+
+    if(next < 0 && wait)
+    {
+        fw->stalls += 1;
+        next = fw_aio_get_wait(aio);
+    }
+    if(next < 0)
+    {
+        //反压: 磁盘跟不上, 丢掉这一块, 解码端会在下一个起始码处恢复
+        fw->stalls += 1;
+        fw->dropped += n;
+        fw_handed(fw, n, 0, 0);
+        fw->len -= n;
+        if(fw->len)
+            memmove(fw->buf, fw->buf + n, fw->len);
+        return -1;
+    }
+    b->len = n;
+    b->done = 0;
+    b->offset = fw->offset;
+    fw_handed(fw, n, b->offset, 1);
+    fw->offset += n;
+    fw->len -= n;
+    if(fw->len)
+        memcpy(aio->block[next].data, b->data + n, fw->len);
+    aio->cur = next;
+    fw->buf = aio->block[next].data;
+    fw_aio_put(aio, b - aio->block);
+    return 0;
+}
+
+int file_writer_async(FileWriter_Struct *fw, unsigned int depth)
+{
+    FwAio_Struct *aio;
+    unsigned int i;
+    void *buf;
+
+    if(depth == 0 || fw->aio || fw->external || !fw->seekable)
+        return 0;
+    aio = (FwAio_Struct *)calloc(1, sizeof(FwAio_Struct));
+    if(!aio)
+        return 0;
+    aio->fw = fw;
+    aio->count = depth + 1;
+    aio->block = (FwBlock_Struct *)calloc(aio->count, sizeof(FwBlock_Struct));
+    aio->idle = (unsigned int *)calloc(aio->count, sizeof(unsigned int));
+    aio->queue = (unsigned int *)calloc(aio->count, sizeof(unsigned int));
+    if(!aio->block || !aio->idle || !aio->queue)
+        goto err;
+    //第0块沿用已有的缓冲, 里面可能已有数据
+    aio->block[0].data = fw->buf;
+    for(i = 1; i < aio->count; i++)
+    {
+        if(posix_memalign(&buf, FILE_WRITER_ALIGN, fw->size))
+            goto err;
+        aio->block[i].data = (unsigned char *)buf;
+        aio->idle[aio->idle_count++] = i;
+    }
+
+    if(uring_init(aio, depth) == 0)
+        aio->mode = FILE_WRITER_AIO_URING;
+    else
+    {
+        //内核太老或被 io_uring_disabled 禁用
+        pthread_mutex_init(&aio->lock, NULL);
+        pthread_cond_init(&aio->cond, NULL);
+        if(pthread_create(&aio->th, NULL, fw_thread, aio))
+            goto err;
+        aio->mode = FILE_WRITER_AIO_THREAD;
+    }
+    fw->aio = aio;
+    return aio->mode;
+err:
+    if(aio->block)
+    {
+        for(i = 1; i < aio->count; i++)
+            free(aio->block[i].data);
+    }
+    free(aio->block);
+    free(aio->idle);
+    free(aio->queue);
+    free(aio);
+    return 0;
+}
+
+void file_writer_on_block(FileWriter_Struct *fw, FileWriter_Callback callback, void *priv)
+{
+    fw->on_block = callback;
+    fw->priv = priv;
+}
+
+void file_writer_nodrop(FileWriter_Struct *fw, int nodrop)
+{
+    fw->nodrop = nodrop;
+}
+
+int file_writer_busy(FileWriter_Struct *fw)
+{
+    FwAio_Struct *aio = (FwAio_Struct *)fw->aio;
+    unsigned int inflight;
+    if(!aio)
+        return 0;
+    if(aio->mode == FILE_WRITER_AIO_URING)
+    {
+        uring_reap(aio, 0);
+        return fw->inflight;
+    }
+    pthread_mutex_lock(&aio->lock);
+    inflight = fw->inflight;
+    pthread_mutex_unlock(&aio->lock);
+    return inflight;
+}
+
+static void fw_aio_close(FileWriter_Struct *fw)
+{
+    FwAio_Struct *aio = (FwAio_Struct *)fw->aio;
+    unsigned int i;
+
+    fw_aio_drain(aio);
+    if(aio->mode == FILE_WRITER_AIO_URING)
+        uring_exit(aio);
+    else
+    {
+        pthread_mutex_lock(&aio->lock);
+        aio->quit = 1;
+        pthread_cond_broadcast(&aio->cond);
+        pthread_mutex_unlock(&aio->lock);
+        pthread_join(aio->th, NULL);
+    }
+    //fw->buf 是当前块, 由 file_writer_close 释放
+    for(i = 0; i < aio->count; i++)
+    {
+        if(i != aio->cur)
+            free(aio->block[i].data);
+    }
+    free(aio->block);
+    free(aio->idle);
+    free(aio->queue);
+    free(aio);
+    fw->aio = NULL;
+}
+
+static int fw_flush(FileWriter_Struct *fw, int wait)
+{
+    unsigned long long offset;
+    struct iovec iov;
+    unsigned int n = fw->len;
+
+    fw->flush_time = now_ms();
+    //O_DIRECT 只能整块写, 不满一块的尾巴挪到缓冲开头
+    if(fw->direct)
+        n &= ~(FILE_WRITER_ALIGN - 1);
+    if(n == 0)
+        return 0;
+    if(fw->aio)
+        return fw_aio_flush(fw, n, wait);
+    iov.iov_base = fw->buf;
+    iov.iov_len = n;
+    offset = fw->offset;
+    if(fw_output(fw, &iov, 1) < 0)
+    {
+        //写失败的数据丢弃, 避免缓冲一直满着
+        fw_handed(fw, fw->len, offset, 0);
+        fw->len = 0;
+        return -1;
+    }
+    fw_handed(fw, n, offset, 1);
+    fw->len -= n;
+    if(fw->len)
+        memmove(fw->buf, fw->buf + n, fw->len);
+    return 0;
+}
+
+int file_writer_flush(FileWriter_Struct *fw)
+{
+    return fw_flush(fw, fw->nodrop);
+}
+
+int file_writer_sync(FileWriter_Struct *fw)
+{
+    return fw_flush(fw, 1);
+}
+
+int file_writer_poll(FileWriter_Struct *fw)
+{
+    if(fw->len && now_ms() - fw->flush_time >= fw->flush_ms)
+        return file_writer_flush(fw);
+    return 0;
+}
+
+int file_writer_writev(FileWriter_Struct *fw, const struct iovec *iov, int iovcnt)
+{
+    struct iovec out[FILE_WRITER_IOV_MAX + 1];
+    unsigned long long offset;
+    unsigned int total = 0, copy;
+    const unsigned char *src;
+    int i, ret = 0;
+
+    if(iovcnt > FILE_WRITER_IOV_MAX)
+        return -1;
+    for(i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    fw->pos += total;
+
+    //放不下: 缓冲和本次的分片一起写出, 大帧不再拷贝一次
+    //  异步写时调用者的数据在返回后就会被覆盖, 只能拷贝
+    if(!fw->direct && !fw->aio && (fw->len + total > fw->size || fw->flush_ms == 0))
+    {
+        out[0].iov_base = fw->buf;
+        out[0].iov_len = fw->len;
+        memcpy(&out[1], iov, iovcnt * sizeof(struct iovec));
+        fw->len = 0;
+        fw->flush_time = now_ms();
+        offset = fw->offset;
+        ret = fw_output(fw, out + (out[0].iov_len ? 0 : 1), iovcnt + (out[0].iov_len ? 1 : 0));
+        fw_handed(fw, out[0].iov_len + total, offset, ret == 0);
+        return ret;
+    }
+
+    for(i = 0; i < iovcnt; i++)
+    {
+        src = (const unsigned char *)iov[i].iov_base;
+        total = iov[i].iov_len;
+        while(total)
+        {
+            copy = fw->size - fw->len;
+            if(copy > total)
+                copy = total;
+            memcpy(fw->buf + fw->len, src, copy);
+            fw->len += copy;
+            src += copy;
+            total -= copy;
+            if(fw->len == fw->size && file_writer_flush(fw) < 0)
+                ret = -1;
+        }
+    }
+    if(now_ms() - fw->flush_time >= fw->flush_ms && file_writer_flush(fw) < 0)
+        ret = -1;
+    return ret;
+}
+
+int file_writer_write(FileWriter_Struct *fw, const void *data, unsigned int len)
+{
+    struct iovec iov;
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+    return file_writer_writev(fw, &iov, 1);
+}
+
+void file_writer_close(FileWriter_Struct *fw)
+{
+    if(!fw)
+        return;
+    //关闭时等空闲块, 最后一块不能因为前面的还在写就丢掉
+    file_writer_sync(fw);
+    if(fw->aio)
+        fw_aio_close(fw);
+    //O_DIRECT 剩下的不足一块, 关掉 O_DIRECT 再写
+    if(fw->direct && fw->len)
+    {
+        fcntl(fw->fd, F_SETFL, fcntl(fw->fd, F_GETFL) & ~O_DIRECT);
+        fw->direct = 0;
+        file_writer_flush(fw);
+    }
+    if(!fw->external)
+        close(fw->fd);
+    free(fw->buf);
+    free(fw);
+}
@@ -0,0 +1,76 @@
+
+#ifndef _FILE_WRITER_H_
+#define _FILE_WRITER_H_
+
+#include <sys/uio.h>
+
+#define FILE_WRITER_BUF_SIZE (1024*1024) //默认聚合缓冲 1M
+#define FILE_WRITER_FLUSH_MS 1000 //默认最长1秒落盘一次
+#define FILE_WRITER_ALIGN 4096 //O_DIRECT 要求的缓冲/长度/偏移对齐
+#define FILE_WRITER_IOV_MAX 8 //单次写入最多的分片数
+
+//一段数据离开缓冲(交出去写或被反压丢掉)时回调, start: 第一个字节在 pos 计数里的序号,
+//  offset: 落在文件中的位置, written 为0时这段被丢弃, offset 无意义
+typedef void (*FileWriter_Callback)(void *priv, unsigned long long start, unsigned int len,
+    unsigned long long offset, int written);
+
+//录像写入器: 多帧聚合到对齐的大缓冲里, 满了或超时才用一次 pwritev/writev 写出
+//  大帧在缓冲放不下时不拷贝, 与缓冲一起组成iovec直接写
+//  O_DIRECT 模式下只写出整块对齐的部分, 尾巴留到下次或关闭时再写
+typedef struct{
+    int fd;
+    int seekable; //普通文件用 pwritev 按偏移写, 管道/stdout 用 writev
+    int direct; //1/O_DIRECT
+    int external; //1/fd 由调用者管理, 关闭时不 close
+    unsigned char *buf;
+    unsigned int size; //buf 容量
+    unsigned int len; //buf 中待写的数据量
+    unsigned long long offset; //buf[0] 对应的文件偏移
+    unsigned int flush_ms; //0/每次写入都落盘
+    unsigned long long flush_time; //上次落盘的时间 ms
+    unsigned long long pos; //已写入(含缓冲中)的总字节数
+    unsigned long long syscalls; //写系统调用次数
+    unsigned long long errors;
+    void *aio; //异步写状态, NULL/同步写
+    unsigned int inflight; //已提交未完成的块数
+    unsigned int inflight_max;
+    unsigned long long stalls; //空闲块用完的次数(反压)
+    unsigned long long dropped; //反压时丢弃的字节数
+    int nodrop; //1/反压时等待而不丢, 容器格式(mp4)丢掉中间的字节整个文件就解析不了
+    unsigned long long handed; //已离开缓冲的字节数, 与 pos 同一计数, pos - handed 即缓冲中的量
+    FileWriter_Callback on_block;
+    void *priv;
+}FileWriter_Struct;
+
+//bufSize 会向上取整到 FILE_WRITER_ALIGN, 0 时用默认值
+//return: NULL/失败 (direct 打开失败时会退回普通模式)
+FileWriter_Struct *file_writer_open(char *filePath, unsigned int bufSize, unsigned int flushMs, int direct);
+//包装已打开的fd(如 stdout), 用 writev 跟随fd的文件位置, 关闭时不 close 该fd
+FileWriter_Struct *file_writer_open_fd(int fd, unsigned int bufSize, unsigned int flushMs);
+#define FILE_WRITER_AIO_QUEUE 4 //默认异步写队列深度(在飞的块数)
+#define FILE_WRITER_AIO_THREAD 1
+#define FILE_WRITER_AIO_URING 2
+
+//改为异步写: 满的缓冲块交给 io_uring(不可用时交给写线程), 最多 depth 块在飞, 不阻塞调用者
+//  只支持 file_writer_open 打开的文件, return: 0/仍为同步写 FILE_WRITER_AIO_THREAD/FILE_WRITER_AIO_URING
+int file_writer_async(FileWriter_Struct *fw, unsigned int depth);
+//反压时阻塞调用者等空闲块, 而不是丢掉当前块, 给中间不能缺字节的输出(如 fMP4)用
+void file_writer_nodrop(FileWriter_Struct *fw, int nodrop);
+//数据离开缓冲时通知调用者, 需要记录文件位置(如关键帧索引)时用, 反压丢块之后的位置才是准的
+void file_writer_on_block(FileWriter_Struct *fw, FileWriter_Callback callback, void *priv);
+//return: 还没写完的块数, 为0时 file_writer_close 不会阻塞
+int file_writer_busy(FileWriter_Struct *fw);
+//写出全部数据并释放, 异步写时会等待在飞的块写完
+void file_writer_close(FileWriter_Struct *fw);
+
+//聚合写入多个分片(如起始码+NAL), 按需触发落盘, return: 0/success -1/写文件出错
+int file_writer_writev(FileWriter_Struct *fw, const struct iovec *iov, int iovcnt);
+int file_writer_write(FileWriter_Struct *fw, const void *data, unsigned int len);
+//把缓冲写出, O_DIRECT 下只写整块, return: 0/success -1/出错或反压丢弃
+int file_writer_flush(FileWriter_Struct *fw);
+//同上, 但异步写的空闲块用完时等待而不丢弃, 关闭/切段时用, return: 0/success -1/写文件出错
+int file_writer_sync(FileWriter_Struct *fw);
+//超过 flush_ms 没落盘时写出, 供定时器调用
+int file_writer_poll(FileWriter_Struct *fw);
+
+#endif
@@ -0,0 +1,535 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fmp4_mux.h"
+#include "h26x_sps_dec.h"
+
+#define FMP4_SAMPLE_SYNC 0x02000000 //sample_depends_on=2
+#define FMP4_SAMPLE_NON_SYNC 0x01010000 //sample_depends_on=1, sample_is_non_sync_sample=1
+
+//---------- 缓冲/box 组装 ----------
+
+static int buf_reserve(Mp4Buf_Struct *b, unsigned int len)
+{
+    unsigned char *data;
+    unsigned int size;
+    if(b->len + len <= b->size)
+        return 0;
+    size = b->size ? b->size : 4096;
+    while(size < b->len + len)
+        size *= 2;
+    data = (unsigned char *)realloc(b->data, size);
+    if(!data)
+        return -1;
+    b->data = data;
+    b->size = size;
+    return 0;
+}
+
+//内存不足时后续写入全部忽略, 由调用者检查 len
+static void put_bytes(Mp4Buf_Struct *b, const void *data, unsigned int len)
+{
+    if(buf_reserve(b, len) < 0)
+        return;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void put8(Mp4Buf_Struct *b, unsigned int v)
+{
+    unsigned char c = v;
+    put_bytes(b, &c, 1);
+}
+
+static void put16(Mp4Buf_Struct *b, unsigned int v)
+{
+    unsigned char c[2] = {(unsigned char)(v >> 8), (unsigned char)v};
+    put_bytes(b, c, 2);
+}
+
+static void put32(Mp4Buf_Struct *b, unsigned int v)
+{
+    unsigned char c[4] = {(unsigned char)(v >> 24), (unsigned char)(v >> 16), (unsigned char)(v >> 8), (unsigned char)v};
+    put_bytes(b, c, 4);
+}
+
+static void put64(Mp4Buf_Struct *b, unsigned long long v)
+{
+    put32(b, (unsigned int)(v >> 32));
+    put32(b, (unsigned int)v);
+}
+
+static void put_zero(Mp4Buf_Struct *b, unsigned int len)
+{
+    while(len--)
+        put8(b, 0);
+}
+
+//return: box 起点, box_end() 时回填长度
+static unsigned int box_begin(Mp4Buf_Struct *b, const char *type)
+{
+    unsigned int start = b->len;
+    put32(b, 0);
+    put_bytes(b, type, 4);
+    return start;
+}
+
+static unsigned int full_box_begin(Mp4Buf_Struct *b, const char *type, int version, unsigned int flags)
+{
+    unsigned int start = box_begin(b, type);
+    put32(b, (version << 24) | flags);
+    return start;
+}
+
+static void box_end(Mp4Buf_Struct *b, unsigned int start)
+{
+    unsigned int size = b->len - start;
+    if(b->len < start + 8)
+        return;
+    b->data[start] = size >> 24;
+    b->data[start + 1] = size >> 16;
+    b->data[start + 2] = size >> 8;
+    b->data[start + 3] = size;
+}
+
+static void put_matrix(Mp4Buf_Struct *b)
+{
+    put32(b, 0x00010000); put32(b, 0); put32(b, 0);
+    put32(b, 0); put32(b, 0x00010000); put32(b, 0);
+    put32(b, 0); put32(b, 0); put32(b, 0x40000000);
+}
+
+//---------- 文件头 ----------
+
+static void put_avcc(Fmp4Mux_Struct *mux, Mp4Buf_Struct *b, H26xSps_Struct *sps)
+{
+    unsigned char *s = mux->ps[1];
+    unsigned int box = box_begin(b, "avcC");
+    put8(b, 1); //configurationVersion
+    put8(b, s[1]); //AVCProfileIndication
+    put8(b, s[2]); //profile_compatibility
+    put8(b, s[3]); //AVCLevelIndication
+    put8(b, 0xFF); //lengthSizeMinusOne = 3
+    put8(b, 0xE1); //numOfSequenceParameterSets = 1
+    put16(b, mux->ps_len[1]);
+    put_bytes(b, mux->ps[1], mux->ps_len[1]);
+    put8(b, 1); //numOfPictureParameterSets
+    put16(b, mux->ps_len[2]);
+    put_bytes(b, mux->ps[2], mux->ps_len[2]);
+    if(s[1] == 100 || s[1] == 110 || s[1] == 122 || s[1] == 144)
+    {
+        put8(b, 0xFC | sps->chroma_format_idc);
+        put8(b, 0xF8 | (sps->bit_depth_luma - 8));
+        put8(b, 0xF8 | (sps->bit_depth_chroma - 8));
+        put8(b, 0); //numOfSequenceParameterSetExt
+    }
+    box_end(b, box);
+}
+
+static void put_hvcc(Fmp4Mux_Struct *mux, Mp4Buf_Struct *b, H26xSps_Struct *sps)
+{
+    unsigned char rbsp[32];
+    unsigned int box, i;
+
+    //SPS: 2字节NAL头 + 1字节(vps_id/max_sub_layers/nesting) + 12字节 general profile_tier_level, 都是字节对齐的
+    memset(rbsp, 0, sizeof(rbsp));
+    de_emulation_prevention_copy(mux->ps[1], mux->ps_len[1] < sizeof(rbsp) ? mux->ps_len[1] : sizeof(rbsp), rbsp, sizeof(rbsp));
+    box = box_begin(b, "hvcC");
+    put8(b, 1); //configurationVersion
+    put_bytes(b, rbsp + 3, 12); //profile_space/tier/profile_idc, compatibility, constraint, level_idc
+    put16(b, 0xF000); //min_spatial_segmentation_idc
+    put8(b, 0xFC); //parallelismType
+    put8(b, 0xFC | sps->chroma_format_idc);
+    put8(b, 0xF8 | (sps->bit_depth_luma - 8));
+    put8(b, 0xF8 | (sps->bit_depth_chroma - 8));
+    put16(b, 0); //avgFrameRate
+    //constantFrameRate=0, numTemporalLayers, temporalIdNested, lengthSizeMinusOne=3
+    put8(b, ((((rbsp[2] >> 1) & 7) + 1) << 3) | ((rbsp[2] & 1) << 2) | 3);
+    put8(b, 3); //numOfArrays
+    for(i = 0; i < 3; i++)
+    {
+        put8(b, 0x80 | (32 + i)); //array_completeness + NAL_unit_type
+        put16(b, 1);
+        put16(b, mux->ps_len[i]);
+        put_bytes(b, mux->ps[i], mux->ps_len[i]);
+    }
+    box_end(b, box);
+}
+
+//return: 0/success -1/参数集不全或解析失败
+static int fmp4_init_segment(Fmp4Mux_Struct *mux, Fmp4_Output out, void *priv)
+{
+    Mp4Buf_Struct *b = &mux->box;
+    H26xSps_Struct sps;
+    unsigned int moov, trak, mdia, minf, dinf, dref, stbl, stsd, entry, box;
+    int ok;
+
+    if(!mux->ps_len[1] || !mux->ps_len[2] || (mux->codec == 2 && !mux->ps_len[0]))
+        return -1;
+    if(mux->codec == 2)
+        ok = h265_parse_sps(mux->ps[1], mux->ps_len[1], &sps);
+    else
+        ok = h264_parse_sps(mux->ps[1], mux->ps_len[1], &sps);
+    if(!ok)
+        return -1;
+    if(sps.fps > 0)
+        mux->interval = (unsigned int)(FMP4_TIMESCALE / sps.fps + 0.5);
+
+    b->len = 0;
+    box = box_begin(b, "ftyp");
+    put_bytes(b, "isom", 4);
+    put32(b, 0x200);
+    put_bytes(b, "isom", 4);
+    put_bytes(b, "iso6", 4);
+    put_bytes(b, "cmfc", 4);
+    put_bytes(b, mux->codec == 2 ? "hvc1" : "avc1", 4);
+    box_end(b, box);
+
+    moov = box_begin(b, "moov");
+    box = full_box_begin(b, "mvhd", 0, 0);
+    put32(b, 0); //creation_time
+    put32(b, 0); //modification_time
+    put32(b, 1000); //timescale
+    put32(b, 0); //duration 未知
+    put32(b, 0x00010000); //rate
+    put16(b, 0x0100); //volume
+    put_zero(b, 10);
+    put_matrix(b);
+    put_zero(b, 24);
+    put32(b, 2); //next_track_ID
+    box_end(b, box);
+
+    trak = box_begin(b, "trak");
+    box = full_box_begin(b, "tkhd", 0, 3); //enabled | in_movie
+    put32(b, 0);
+    put32(b, 0);
+    put32(b, 1); //track_ID
+    put32(b, 0);
+    put32(b, 0); //duration
+    put_zero(b, 8);
+    put16(b, 0); //layer
+    put16(b, 0); //alternate_group
+    put16(b, 0); //volume
+    put16(b, 0);
+    put_matrix(b);
+    put32(b, sps.width << 16);
+    put32(b, sps.height << 16);
+    box_end(b, box);
+
+    mdia = box_begin(b, "mdia");
+    box = full_box_begin(b, "mdhd", 0, 0);
+    put32(b, 0);
+    put32(b, 0);
+    put32(b, FMP4_TIMESCALE);
+    put32(b, 0);
+    put16(b, 0x55C4); //language "und"
+    put16(b, 0);
+    box_end(b, box);
+    box = full_box_begin(b, "hdlr", 0, 0);
+    put32(b, 0);
+    put_bytes(b, "vide", 4);
+    put_zero(b, 12);
+    put_bytes(b, "VideoHandler", 13);
+    box_end(b, box);
+
+    minf = box_begin(b, "minf");
+    box = full_box_begin(b, "vmhd", 0, 1);
+    put_zero(b, 8);
+    box_end(b, box);
+    dinf = box_begin(b, "dinf");
+    dref = full_box_begin(b, "dref", 0, 0);
+    put32(b, 1);
+    box = full_box_begin(b, "url ", 0, 1); //数据在本文件内
+    box_end(b, box);
+    box_end(b, dref);
+    box_end(b, dinf);
+
+    stbl = box_begin(b, "stbl");
+    stsd = full_box_begin(b, "stsd", 0, 0);
+    put32(b, 1);
+    entry = box_begin(b, mux->codec == 2 ? "hvc1" : "avc1");
+    put_zero(b, 6);
+    put16(b, 1); //data_reference_index
+    put_zero(b, 16);
+    put16(b, sps.width);
+    put16(b, sps.height);
+    put32(b, 0x00480000); //72 dpi
+    put32(b, 0x00480000);
+    put32(b, 0);
+    put16(b, 1); //frame_count
+    put_zero(b, 32); //compressorname
+    put16(b, 0x0018); //depth
+    put16(b, 0xFFFF); //pre_defined
+    if(mux->codec == 2)
+        put_hvcc(mux, b, &sps);
+    else
+        put_avcc(mux, b, &sps);
+    if(sps.sar_width && sps.sar_height && sps.sar_width != sps.sar_height)
+    {
+        box = box_begin(b, "pasp");
+        put32(b, sps.sar_width);
+        put32(b, sps.sar_height);
+        box_end(b, box);
+    }
+    box_end(b, entry);
+    box_end(b, stsd);
+    //样本都在片段里, 这些表为空
+    box = full_box_begin(b, "stts", 0, 0);
+    put32(b, 0);
+    box_end(b, box);
+    box = full_box_begin(b, "stsc", 0, 0);
+    put32(b, 0);
+    box_end(b, box);
+    box = full_box_begin(b, "stsz", 0, 0);
+    put32(b, 0);
+    put32(b, 0);
+    box_end(b, box);
+    box = full_box_begin(b, "stco", 0, 0);
+    put32(b, 0);
+    box_end(b, box);
+    box_end(b, stbl);
+    box_end(b, minf);
+    box_end(b, mdia);
+    box_end(b, trak);
+
+    box = box_begin(b, "mvex");
+    entry = full_box_begin(b, "trex", 0, 0);
+    put32(b, 1); //track_ID
+    put32(b, 1); //default_sample_description_index
+    put32(b, 0);
+    put32(b, 0);
+    put32(b, 0);
+    box_end(b, entry);
+    box_end(b, box);
+    box_end(b, moov);
+
+    out(priv, b->data, b->len);
+    return 0;
+}
+
+//---------- 片段 ----------
+
+//输出前 count 个样本, 之后的数据挪到缓冲开头
+static void fmp4_fragment(Fmp4Mux_Struct *mux, unsigned int count, Fmp4_Output out, void *priv)
+{
+    Mp4Buf_Struct *b = &mux->box;
+    Fmp4Sample_Struct *s;
+    unsigned int moof, traf, box, dataOffset, bytes = 0, i;
+
+    if(count == 0)
+        return;
+    for(i = 0; i < count; i++)
+        bytes += mux->sample[i].size;
+
+    b->len = 0;
+    moof = box_begin(b, "moof");
+    box = full_box_begin(b, "mfhd", 0, 0);
+    put32(b, ++mux->seq);
+    box_end(b, box);
+    traf = box_begin(b, "traf");
+    box = full_box_begin(b, "tfhd", 0, 0x020000); //default-base-is-moof
+    put32(b, 1);
+    box_end(b, box);
+    box = full_box_begin(b, "tfdt", 1, 0);
+    put64(b, mux->sample[0].dts - mux->dts_origin);
+    box_end(b, box);
+    //data-offset | duration | size | flags | composition-time-offset, version 1 允许负的偏移
+    box = full_box_begin(b, "trun", 1, 0x000001 | 0x000100 | 0x000200 | 0x000400 | 0x000800);
+    put32(b, count);
+    dataOffset = b->len;
+    put32(b, 0);
+    for(i = 0; i < count; i++)
+    {
+        s = &mux->sample[i];
+        put32(b, s->duration);
+        put32(b, s->size);
+        put32(b, s->sync ? FMP4_SAMPLE_SYNC : FMP4_SAMPLE_NON_SYNC);
+        put32(b, (unsigned int)s->cto);
+    }
+    box_end(b, box);
+    box_end(b, traf);
+    box_end(b, moof);
+    //data_offset: 从 moof 开头到 mdat 数据
+    put32(b, 8 + bytes);
+    put_bytes(b, "mdat", 4);
+    if(b->len < dataOffset + 4)
+        return;
+    i = b->len - moof;
+    b->data[dataOffset] = i >> 24;
+    b->data[dataOffset + 1] = i >> 16;
+    b->data[dataOffset + 2] = i >> 8;
+    b->data[dataOffset + 3] = i;
+
+    out(priv, b->data, b->len);
+    out(priv, mux->mdat.data, bytes);
+
+    mux->samples += count;
+    mux->fragments += 1;
+    mux->sample_count -= count;
+    memmove(mux->sample, mux->sample + count, mux->sample_count * sizeof(Fmp4Sample_Struct));
+    mux->mdat.len -= bytes;
+    memmove(mux->mdat.data, mux->mdat.data + bytes, mux->mdat.len);
+    mux->au_start -= bytes;
+}
+
+//当前帧结束: 用下一帧的显示时间定下它的时长和解码时间
+static void fmp4_close_au(Fmp4Mux_Struct *mux, unsigned long long nextPts)
+{
+    Fmp4Sample_Struct *s = &mux->sample[mux->sample_count - 1];
+    unsigned int duration = mux->interval;
+
+    mux->au_open = 0;
+    if(nextPts > s->pts && nextPts - s->pts < 10 * FMP4_TIMESCALE)
+    {
+        duration = nextPts - s->pts;
+        //没有帧率信息时用观察到的最小帧间隔
+        if(!mux->interval || duration < mux->interval)
+            mux->interval = duration;
+    }
+    else if(nextPts != (unsigned long long)-1 && nextPts < s->pts)
+        mux->reorder = 1;
+    if(!duration)
+        duration = 3600;
+    if(mux->reorder)
+        duration = mux->interval ? mux->interval : 3600;
+    s->duration = duration;
+}
+
+Fmp4Mux_Struct *fmp4_mux_create(int codec)
+{
+    Fmp4Mux_Struct *mux = (Fmp4Mux_Struct *)calloc(1, sizeof(Fmp4Mux_Struct));
+    if(mux)
+        mux->codec = codec;
+    return mux;
+}
+
+void fmp4_mux_destroy(Fmp4Mux_Struct *mux)
+{
+    if(!mux)
+        return;
+    free(mux->mdat.data);
+    free(mux->box.data);
+    free(mux->sample);
+    free(mux);
+}
+
+int fmp4_mux_write(Fmp4Mux_Struct *mux, const unsigned char *nal, unsigned int len,
+    unsigned long long ptsUs, Fmp4_Output out, void *priv)
+{
+    unsigned long long pts = ptsUs * 9 / 100;
+    Fmp4Sample_Struct *s;
+    int type, vcl, irap, psIndex = -1;
+
+    if(len < 2)
+        return 0;
+    if(mux->codec == 2)
+    {
+        type = (nal[0] & 0x7E) >> 1;
+        vcl = type < 32;
+        irap = type >= 16 && type <= 21;
+        if(type >= 32 && type <= 34)
+            psIndex = type - 32;
+        else if(type == 35) //AUD
+            return 0;
+    }
+    else
+    {
+        type = nal[0] & 0x1F;
+        vcl = type >= 1 && type <= 5;
+        irap = type == 5;
+        if(type == 7 || type == 8)
+            psIndex = type - 6;
+        else if(type == 9) //AUD
+            return 0;
+    }
+    //参数集放进 avcC/hvcC
+    if(psIndex >= 0)
+    {
+        if(len <= FMP4_PS_MAX && !mux->init_done)
+        {
+            memcpy(mux->ps[psIndex], nal, len);
+            mux->ps_len[psIndex] = len;
+        }
+        return 0;
+    }
+
+    //显示时间变了就是新的一帧
+    if(mux->au_open && pts != mux->sample[mux->sample_count - 1].pts)
+        fmp4_close_au(mux, pts);
+    if(!mux->au_open)
+    {
+        if(mux->sample_count == mux->sample_max)
+        {
+            unsigned int max = mux->sample_max ? mux->sample_max * 2 : 256;
+            Fmp4Sample_Struct *sample = (Fmp4Sample_Struct *)realloc(mux->sample, max * sizeof(Fmp4Sample_Struct));
+            if(!sample)
+                return -1;
+            mux->sample = sample;
+            mux->sample_max = max;
+        }
+        s = &mux->sample[mux->sample_count++];
+        memset(s, 0, sizeof(Fmp4Sample_Struct));
+        s->pts = pts;
+        if(mux->sample_count > 1)
+            s->dts = s[-1].dts + s[-1].duration;
+        else
+            s->dts = pts;
+        mux->au_open = 1;
+        mux->au_start = mux->mdat.len;
+        mux->discard = 0;
+    }
+    s = &mux->sample[mux->sample_count - 1];
+
+    if(vcl && !s->vcl)
+    {
+        //文件头等到第一个关键帧且参数集齐全时才输出, 之前的帧丢掉
+        if(!mux->init_done)
+        {
+            if(irap && fmp4_init_segment(mux, out, priv) == 0)
+            {
+                mux->init_done = 1;
+                mux->dts_origin = s->dts;
+            }
+            else
+                mux->discard = 1;
+        }
+        //新的GOP, 之前的帧组成一个片段
+        if(!mux->discard && (irap || mux->mdat.len > FMP4_FRAG_MAX))
+            fmp4_fragment(mux, mux->sample_count - 1, out, priv);
+        s = &mux->sample[mux->sample_count - 1];
+    }
+    if(mux->discard)
+    {
+        mux->sample_count -= 1;
+        mux->au_open = 0;
+        mux->mdat.len = mux->au_start;
+        return 0;
+    }
+
+    s->vcl |= vcl;
+    s->sync |= irap;
+    put32(&mux->mdat, len);
+    put_bytes(&mux->mdat, nal, len);
+    s->size += 4 + len;
+    if(mux->mdat.len != mux->au_start + s->size)
+        return -1;
+    s->cto = (int)((long long)s->pts - (long long)s->dts);
+    return 0;
+}
+
+void fmp4_mux_flush(Fmp4Mux_Struct *mux, Fmp4_Output out, void *priv)
+{
+    if(mux->au_open)
+    {
+        fmp4_close_au(mux, (unsigned long long)-1);
+        //只有SEI之类的残帧不输出
+        if(!mux->sample[mux->sample_count - 1].vcl)
+        {
+            mux->mdat.len = mux->au_start;
+            mux->sample_count -= 1;
+        }
+    }
+    if(mux->init_done)
+        fmp4_fragment(mux, mux->sample_count, out, priv);
+}
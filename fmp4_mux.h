@@ -0,0 +1,63 @@
+
+#ifndef _FMP4_MUX_H_
+#define _FMP4_MUX_H_
+
+#define FMP4_TIMESCALE 90000 //轨道时间单位, 与RTP视频时钟一致
+#define FMP4_PS_MAX 512
+#define FMP4_FRAG_MAX (16*1024*1024) //单个片段最大字节数, 超过时不等关键帧提前输出
+
+//输出回调: 数据只在回调期间有效
+typedef void (*Fmp4_Output)(void *priv, const unsigned char *data, unsigned int len);
+
+//可增长的输出缓冲
+typedef struct{
+    unsigned char *data;
+    unsigned int len;
+    unsigned int size;
+}Mp4Buf_Struct;
+
+typedef struct{
+    unsigned int size; //mdat 中的字节数, 含4字节长度前缀
+    unsigned int duration;
+    int cto; //显示时间 - 解码时间
+    unsigned long long pts;
+    unsigned long long dts;
+    int sync; //含 IDR/IRAP
+    int vcl; //含图像数据
+}Fmp4Sample_Struct;
+
+//fMP4(CMAF) 复用器: Annex-B NAL 转为 avc1/hvc1 的 AVCC/HVCC 样本
+//  文件头(ftyp+moov)在第一个关键帧时输出一次, 之后每个GOP输出一个 moof+mdat, 不回写
+//  同一显示时间的NAL属于同一帧, 参数集放在 avcC/hvcC 里, 不进样本
+//  有B帧(显示时间倒退)时解码时间按帧间隔递增, 显示时间差放在 trun 的 composition offset 里
+typedef struct{
+    int codec; //1/h264 2/h265
+    unsigned char ps[3][FMP4_PS_MAX]; //VPS/SPS/PPS, h264 不用 ps[0]
+    unsigned int ps_len[3];
+    int init_done;
+    int discard; //当前帧在文件头之前, 丢掉
+    unsigned int interval; //帧间隔, 来自SPS帧率或观察到的最小时间差
+    int reorder; //1/出现过显示时间倒退
+    unsigned long long dts_origin; //第一帧的解码时间, 文件从0开始
+    Mp4Buf_Struct mdat; //当前片段的样本数据
+    Fmp4Sample_Struct *sample; //当前片段的样本, 最后一个可能还没结束
+    unsigned int sample_count;
+    unsigned int sample_max;
+    int au_open; //最后一个样本还在接收NAL
+    unsigned int au_start; //最后一个样本在 mdat 中的起点
+    Mp4Buf_Struct box; //组装 moov/moof 用
+    unsigned int seq; //moof 序号
+    unsigned long long samples; //已输出的样本数
+    unsigned long long fragments;
+}Fmp4Mux_Struct;
+
+Fmp4Mux_Struct *fmp4_mux_create(int codec);
+void fmp4_mux_destroy(Fmp4Mux_Struct *mux);
+//送入一个NAL(不含起始码), ptsUs: 显示时间 微秒, 需要写出的数据通过 out 回调给出
+//return: 0/success -1/内存不足
+int fmp4_mux_write(Fmp4Mux_Struct *mux, const unsigned char *nal, unsigned int len,
+    unsigned long long ptsUs, Fmp4_Output out, void *priv);
+//结束: 把最后一个片段写出
+void fmp4_mux_flush(Fmp4Mux_Struct *mux, Fmp4_Output out, void *priv);
+
+#endif
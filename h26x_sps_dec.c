@@ -10,8 +10,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <string.h>
-#include <math.h>
+
+#include "h26x_sps_dec.h"
+#include "mp4_demux.h"
 
 void get_profile(int profile_idc, char* profile_str)
 {
@@ -37,419 +38,822 @@ void get_profile(int profile_idc, char* profile_str)
         case 144:
             strcpy(profile_str, "High4:4:4(FRExt)");
             break;
+        case 244:
+            strcpy(profile_str, "High4:4:4Predictive");
+            break;
+        case 44:
+            strcpy(profile_str, "CAVLC4:4:4Intra");
+            break;
         default:
             strcpy(profile_str, "Unknown");
     }
 }
 
-unsigned int Ue(unsigned char *pBuff, unsigned int nLen, unsigned int *nStartBit)
+//按大端一次装入尽量多的字节, 缓存中有效位始终左对齐
+static void bs_refill(BitReader_Struct *bs)
 {
-    unsigned int nZeroNum = 0;
-    while (*nStartBit < nLen * 8)
+    if(bs->end - bs->ptr >= 8)
     {
-        if (pBuff[*nStartBit / 8] & (0x80 >> (*nStartBit % 8)))
-        {
-            break;
-        }
-        nZeroNum++;
-        *nStartBit+=1;
+        unsigned long long v;
+        memcpy(&v, bs->ptr, 8);
+        v = __builtin_bswap64(v);
+        bs->cache |= v >> bs->bits;
+        bs->ptr += (63 - bs->bits) >> 3;
+        bs->bits |= 56;
+        return;
     }
-    *nStartBit+=1;
- 
-    unsigned long dwRet = 0;
-    for (unsigned int i=0; i<nZeroNum; i++)
+    while(bs->bits <= 56 && bs->ptr < bs->end)
     {
-        dwRet <<= 1;
-        if (pBuff[*nStartBit / 8] & (0x80 >> (*nStartBit % 8)))
+        bs->cache |= (unsigned long long)(*bs->ptr++) << (56 - bs->bits);
+        bs->bits += 8;
+    }
+}
+
+void bs_init(BitReader_Struct *bs, const unsigned char *buf, unsigned int len)
+{
+    bs->ptr = buf;
+    bs->end = buf + len;
+    bs->cache = 0;
+    bs->bits = 0;
+    bs->error = 0;
+    bs_refill(bs);
+}
+
+//n: 0~32, 越界时置 error 并返回0
+unsigned int bs_u(BitReader_Struct *bs, int n)
+{
+    unsigned int ret;
+    if(n <= 0)
+        return 0;
+    if(bs->bits < n)
+    {
+        bs_refill(bs);
+        if(bs->bits < n)
         {
-            dwRet += 1;
+            bs->error = 1;
+            bs->cache = 0;
+            bs->bits = 0;
+            return 0;
         }
-        *nStartBit+=1;
     }
-    return (1 << nZeroNum) - 1 + dwRet;
+    ret = (unsigned int)(bs->cache >> (64 - n));
+    bs->cache <<= n;
+    bs->bits -= n;
+    return ret;
+}
+
+void bs_skip(BitReader_Struct *bs, unsigned int n)
+{
+    while(n > 32 && !bs->error)
+    {
+        bs_u(bs, 32);
+        n -= 32;
+    }
+    bs_u(bs, n);
+}
+
+//Exp-Golomb: 前导0个数由 clz 一次得到, 超过31个视为码流错误
+unsigned int bs_ue(BitReader_Struct *bs)
+{
+    int zeros;
+    if(bs->bits < 32)
+        bs_refill(bs);
+    if(bs->cache == 0)
+    {
+        bs->error = 1;
+        return 0;
+    }
+    zeros = __builtin_clzll(bs->cache);
+    if(zeros > 31)
+    {
+        bs->error = 1;
+        return 0;
+    }
+    bs->cache <<= zeros;
+    bs->bits -= zeros;
+    return bs_u(bs, zeros + 1) - 1;
+}
+
+int bs_se(BitReader_Struct *bs)
+{
+    unsigned int k = bs_ue(bs);
+    if(k & 1)
+        return (int)((k >> 1) + 1);
+    return -(int)(k >> 1);
+}
+
+//已读取的位数
+unsigned int bs_pos(BitReader_Struct *bs, const unsigned char *buf)
+{
+    return (unsigned int)(bs->ptr - buf) * 8 - bs->bits;
+}
+
+//以下三个保留原接口, 内部改用 BitReader_Struct
+unsigned int Ue(unsigned char *pBuff, unsigned int nLen, unsigned int *nStartBit)
+{
+    BitReader_Struct bs;
+    unsigned int ret;
+    if(*nStartBit >= nLen * 8)
+        return 0;
+    bs_init(&bs, pBuff + *nStartBit / 8, nLen - *nStartBit / 8);
+    bs_u(&bs, *nStartBit % 8);
+    ret = bs_ue(&bs);
+    *nStartBit = (*nStartBit & ~7) + bs_pos(&bs, pBuff + *nStartBit / 8);
+    return ret;
 }
 
 int Se(unsigned char *pBuff, unsigned int nLen, unsigned int *nStartBit)
 {
-    int UeVal=Ue(pBuff,nLen,nStartBit);
-    double k=UeVal;
-    int nValue=ceil(k/2);
-    if (UeVal % 2==0)
-        nValue=-nValue;
-    return nValue;
+    unsigned int k = Ue(pBuff, nLen, nStartBit);
+    if(k & 1)
+        return (int)((k >> 1) + 1);
+    return -(int)(k >> 1);
 }
 
 unsigned long u(unsigned int BitCount, unsigned char * buf, unsigned int *nStartBit)
 {
+    BitReader_Struct bs;
     unsigned long dwRet = 0;
-    for (unsigned int i=0; i<BitCount; i++)
+    unsigned int n;
+    //原接口不带长度, 只装入本次需要的字节
+    bs_init(&bs, buf + *nStartBit / 8, (*nStartBit % 8 + BitCount + 7) / 8);
+    bs_u(&bs, *nStartBit % 8);
+    for(n = BitCount; n > 32; n -= 32)
+        dwRet = (dwRet << 32) | bs_u(&bs, 32);
+    dwRet = (dwRet << n) | bs_u(&bs, n);
+    *nStartBit += BitCount;
+    return dwRet;
+}
+
+//块内是否有0字节: SSE2一次看16字节, 否则按8字节用位运算判断
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define EPB_BLOCK 16
+static int epb_block_has_zero(const unsigned char *p)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0;
+}
+#else
+#define EPB_BLOCK 8
+static int epb_block_has_zero(const unsigned char *p)
+{
+    unsigned long long v;
+    memcpy(&v, p, 8);
+    return ((v - 0x0101010101010101ULL) & ~v & 0x8080808080808080ULL) != 0;
+}
+#endif
+
+//去除 0x000003 中的 0x03, 单次线性扫描, dst 可以等于 src(原地)
+//return: 输出长度, 不超过 dstMaxLen
+unsigned int de_emulation_prevention_copy(const unsigned char *src, unsigned int len, unsigned char *dst, unsigned int dstMaxLen)
+{
+    unsigned int i = 0, j = 0, zeros = 0;
+
+    if(len > dstMaxLen)
+        len = dstMaxLen;
+    while(i < len)
     {
-        dwRet <<= 1;
-        if (buf[*nStartBit / 8] & (0x80 >> (*nStartBit % 8)))
+        //整块没有0: 只有块首字节可能是紧跟两个0之后的0x03, 其余整块照搬
+        if(zeros < 2 && i + EPB_BLOCK <= len && !epb_block_has_zero(src + i))
+        {
+            if(dst + j != src + i)
+                memmove(dst + j, src + i, EPB_BLOCK);
+            i += EPB_BLOCK;
+            j += EPB_BLOCK;
+            zeros = 0;
+            continue;
+        }
+        if(zeros >= 2 && src[i] == 0x03)
         {
-            dwRet += 1;
+            zeros = 0;
+            i += 1;
+            continue;
         }
-        *nStartBit += 1;
+        zeros = src[i] ? 0 : zeros + 1;
+        dst[j++] = src[i++];
     }
-    return dwRet;
+    return j;
 }
 
 void de_emulation_prevention(unsigned char* buf,unsigned int* buf_size)
 {
-    int i=0,j=0;
-    unsigned char* tmp_ptr=NULL;
-    unsigned int tmp_buf_size=0;
-    int val=0;
- 
-    tmp_ptr=buf;
-    tmp_buf_size=*buf_size;
-    for(i=0;i<(tmp_buf_size-2);i++)
-    {
-        //check for 0x000003
-        val=(tmp_ptr[i]^0x00) +(tmp_ptr[i+1]^0x00)+(tmp_ptr[i+2]^0x03);
-        if(val==0)
+    *buf_size = de_emulation_prevention_copy(buf, *buf_size, buf, *buf_size);
+}
+
+//SPS只解析到VUI, 4K的RBSP足够, 超出部分按截断处理
+#define SPS_RBSP_MAX 4096
+
+//H.264 Table E-1 / H.265 Table E-1, aspect_ratio_idc 1~16 对应的SAR
+static const unsigned char sar_table[17][2] = {
+    {0, 0}, {1, 1}, {12, 11}, {10, 11}, {16, 11}, {40, 33}, {24, 11}, {20, 11},
+    {32, 11}, {80, 33}, {18, 11}, {15, 11}, {64, 33}, {160, 99}, {4, 3}, {3, 2}, {2, 1}
+};
+
+//aspect_ratio_info ~ chroma_loc_info, 两种编码的VUI前半段相同
+static void vui_decode_common(BitReader_Struct *bs, H26xSps_Struct *sps)
+{
+    if(bs_u(bs, 1)) //aspect_ratio_info_present_flag
+    {
+        int aspect_ratio_idc = bs_u(bs, 8);
+        if(aspect_ratio_idc == 255)
         {
-            //kick out 0x03
-            for(j=i+2;j<tmp_buf_size-1;j++)
-                tmp_ptr[j]=tmp_ptr[j+1];
- 
-            //and so we should devrease bufsize
-            (*buf_size)--;
+            sps->sar_width = bs_u(bs, 16);
+            sps->sar_height = bs_u(bs, 16);
+        }
+        else if(aspect_ratio_idc > 0 && aspect_ratio_idc < 17)
+        {
+            sps->sar_width = sar_table[aspect_ratio_idc][0];
+            sps->sar_height = sar_table[aspect_ratio_idc][1];
+        }
+    }
+    if(bs_u(bs, 1)) //overscan_info_present_flag
+        bs_u(bs, 1); //overscan_appropriate_flag
+    if(bs_u(bs, 1)) //video_signal_type_present_flag
+    {
+        bs_u(bs, 3); //video_format
+        sps->video_full_range_flag = bs_u(bs, 1);
+        if(bs_u(bs, 1)) //colour_description_present_flag
+        {
+            sps->colour_primaries = bs_u(bs, 8);
+            sps->transfer_characteristics = bs_u(bs, 8);
+            sps->matrix_coefficients = bs_u(bs, 8);
         }
     }
+    if(bs_u(bs, 1)) //chroma_loc_info_present_flag
+    {
+        bs_ue(bs); //chroma_sample_loc_type_top_field
+        bs_ue(bs); //chroma_sample_loc_type_bottom_field
+    }
+}
+
+static void sps_defaults(H26xSps_Struct *sps, int codec)
+{
+    memset(sps, 0, sizeof(H26xSps_Struct));
+    sps->codec = codec;
+    sps->chroma_format_idc = 1;
+    sps->bit_depth_luma = 8;
+    sps->bit_depth_chroma = 8;
+    sps->sar_width = 1;
+    sps->sar_height = 1;
+    sps->colour_primaries = 2; //unspecified
+    sps->transfer_characteristics = 2;
+    sps->matrix_coefficients = 2;
 }
 
+//---------- H.265 ----------
+
 //return: 0/false 1/success
-int h265_decode_sps(unsigned char * buf,unsigned int nLen,int *width,int *height,int *fps)
+static int h265_profile_tier_level(BitReader_Struct *bs, H26xSps_Struct *sps, int max_sub_layers_minus1)
 {
-    unsigned int StartBit=0;
-    de_emulation_prevention(buf,&nLen);
+    int sub_layer_profile_present_flag[8];
+    int sub_layer_level_present_flag[8];
+    int i;
 
-    //--- nal_uint_header ---
-    int forbidden_zero_bit=u(1,buf,&StartBit);
-    int nal_unit_type = u(6,buf,&StartBit);
-    if(nal_unit_type != 33)
-        return 0;
-    int nuh_layer_id = u(6,buf,&StartBit);
-    int nuh_temporal_id_plus = u(3,buf,&StartBit);
+    sps->profile_space = bs_u(bs, 2);
+    sps->tier_flag = bs_u(bs, 1);
+    sps->profile_idc = bs_u(bs, 5);
+    sps->profile_compatibility_flags = bs_u(bs, 32);
+    sps->progressive_source_flag = bs_u(bs, 1);
+    sps->interlaced_source_flag = bs_u(bs, 1);
+    //non_packed/frame_only 2bit + 43bit 约束标志 + 1bit inbld/reserved, 按 profile 拆法不同但总长固定
+    bs_skip(bs, 2 + 43 + 1);
+    sps->level_idc = bs_u(bs, 8);
 
-    //--- seq_parameter_set_rbsp ---
-    int sps_video_parameter_set_id = u(4,buf,&StartBit);
-    int sps_max_sub_layers_minus1 = u(3,buf,&StartBit);
-    int sps_temporal_id_nesting_flag = u(1,buf,&StartBit);
-    // printf("sps_video_parameter_set_id/%d\n"
-    //     "sps_max_sub_layers_minus1/%d\n"
-    //     "sps_temporal_id_nesting_flag/%d\n",
-    //     sps_video_parameter_set_id,
-    //     sps_max_sub_layers_minus1,
-    //     sps_temporal_id_nesting_flag);
-    if(sps_temporal_id_nesting_flag) //--- profile_tier_level ---
-    {
-        int general_profile_space = u(2,buf,&StartBit);
-        int general_tier_flag = u(1,buf,&StartBit);
-        int general_profile_idc = u(5,buf,&StartBit);
-        int general_profile_compatibility_flag[32];
-        // printf("general_profile_space/%d\n"
-        //     "general_tier_flag/%d\n"
-        //     "general_profile_idc/%d\n",
-        //     general_profile_space,
-        //     general_tier_flag,
-        //     general_profile_idc);
-        int j;
-        for(j = 0; j < 32; j++)
-        {
-            general_profile_compatibility_flag[j] = u(1,buf,&StartBit);
-            // printf("bit[%d]: %d\n", j, general_profile_compatibility_flag[j]);
-        }
-        int general_progressive_source_flag = u(1,buf,&StartBit);
-        int general_interlaced_source_flag = u(1,buf,&StartBit);
-        int general_non_packed_constraint_flag = u(1,buf,&StartBit);
-        int general_frame_only_constraint_flag = u(1,buf,&StartBit);
-        if(general_profile_idc == 4 || general_profile_compatibility_flag[4] ||
-            general_profile_idc == 5 || general_profile_compatibility_flag[5] ||
-            general_profile_idc == 6 || general_profile_compatibility_flag[6] ||
-            general_profile_idc == 7 || general_profile_compatibility_flag[7] ||
-            general_profile_idc == 8 || general_profile_compatibility_flag[8] ||
-            general_profile_idc == 9 || general_profile_compatibility_flag[9] ||
-            general_profile_idc == 10 || general_profile_compatibility_flag[10])
+    for(i = 0; i < max_sub_layers_minus1; i++)
+    {
+        sub_layer_profile_present_flag[i] = bs_u(bs, 1);
+        sub_layer_level_present_flag[i] = bs_u(bs, 1);
+    }
+    if(max_sub_layers_minus1 > 0)
+        bs_skip(bs, 2 * (8 - max_sub_layers_minus1)); //reserved_zero_2bits
+    for(i = 0; i < max_sub_layers_minus1; i++)
+    {
+        if(sub_layer_profile_present_flag[i])
+            bs_skip(bs, 88);
+        if(sub_layer_level_present_flag[i])
+            bs_skip(bs, 8);
+    }
+    return !bs->error;
+}
+
+static void h265_scaling_list_data(BitReader_Struct *bs)
+{
+    int sizeId, matrixId, i, coefNum;
+    for(sizeId = 0; sizeId < 4 && !bs->error; sizeId++)
+    {
+        for(matrixId = 0; matrixId < 6; matrixId += (sizeId == 3) ? 3 : 1)
         {
-            // printf("> hit 1-1\n");
-            int general_max_12bit_constraint_flag = u(1,buf,&StartBit);
-            int general_max_10bit_constraint_flag = u(1,buf,&StartBit);
-            int general_max_8bit_constraint_flag = u(1,buf,&StartBit);
-            int general_max_422chroma_constraint_flag = u(1,buf,&StartBit);
-            int general_max_420chroma_constraint_flag = u(1,buf,&StartBit);
-            int general_max_monochrome_constraint_flag = u(1,buf,&StartBit);
-            int general_intra_constraint_flag = u(1,buf,&StartBit);
-            int general_one_picture_only_constraint_flag = u(1,buf,&StartBit);
-            int general_lower_bit_rate_constraint_flag = u(1,buf,&StartBit);
-            if(general_profile_idc == 5 || general_profile_compatibility_flag[5] ||
-                general_profile_idc == 9 || general_profile_compatibility_flag[9] ||
-                general_profile_idc == 10 || general_profile_compatibility_flag[10])
-            {
-                int general_max_14bit_constraint_flag = u(1,buf,&StartBit);
-                int general_reserved_zero_33bits = u(33,buf,&StartBit);
-            }
+            if(!bs_u(bs, 1)) //scaling_list_pred_mode_flag
+                bs_ue(bs); //scaling_list_pred_matrix_id_delta
             else
             {
-                int general_reserved_zero_34bits = u(34,buf,&StartBit);
+                coefNum = 1 << (4 + (sizeId << 1));
+                if(coefNum > 64)
+                    coefNum = 64;
+                if(sizeId > 1)
+                    bs_se(bs); //scaling_list_dc_coef_minus8
+                for(i = 0; i < coefNum && !bs->error; i++)
+                    bs_se(bs); //scaling_list_delta_coef
             }
         }
-        else if(general_profile_idc == 2 || general_profile_compatibility_flag[2])
+    }
+}
+
+//return: 0/false 1/success
+static int h265_st_ref_pic_set(BitReader_Struct *bs, int idx, int *num_delta_pocs)
+{
+    int i, count = 0;
+    if(idx != 0 && bs_u(bs, 1)) //inter_ref_pic_set_prediction_flag
+    {
+        //SPS中参考的总是前一个集合
+        bs_u(bs, 1); //delta_rps_sign
+        bs_ue(bs); //abs_delta_rps_minus1
+        for(i = 0; i <= num_delta_pocs[idx - 1]; i++)
         {
-            // printf("> hit 1-2\n");
-            int general_reserved_zero_7bits = u(7,buf,&StartBit);
-            int general_one_picture_only_constraint_flag = u(1,buf,&StartBit);
-            int general_reserved_zero_35bits = u(35,buf,&StartBit);
+            int used_by_curr_pic_flag = bs_u(bs, 1);
+            int use_delta_flag = 1;
+            if(!used_by_curr_pic_flag)
+                use_delta_flag = bs_u(bs, 1);
+            if(used_by_curr_pic_flag || use_delta_flag)
+                count += 1;
         }
-        else
+    }
+    else
+    {
+        unsigned int num_negative_pics = bs_ue(bs);
+        unsigned int num_positive_pics = bs_ue(bs);
+        if(num_negative_pics > 16 || num_positive_pics > 16)
+            return 0;
+        for(i = 0; i < (int)(num_negative_pics + num_positive_pics); i++)
         {
-            // printf("> hit 1-3\n");
-            int general_reserved_zero_43bits = u(43,buf,&StartBit);
+            bs_ue(bs); //delta_poc_s0/s1_minus1
+            bs_u(bs, 1); //used_by_curr_pic_s0/s1_flag
         }
-        if((general_profile_idc >= 1 && general_profile_idc <= 5) ||
-            general_profile_idc == 9 ||
-            general_profile_compatibility_flag[1] || general_profile_compatibility_flag[2] ||
-            general_profile_compatibility_flag[3] || general_profile_compatibility_flag[4] ||
-            general_profile_compatibility_flag[5] || general_profile_compatibility_flag[9])
+        count = num_negative_pics + num_positive_pics;
+    }
+    if(count > 32)
+        return 0;
+    num_delta_pocs[idx] = count;
+    return !bs->error;
+}
+
+static void h265_sub_layer_hrd_parameters(BitReader_Struct *bs, unsigned int cpb_cnt_minus1, int sub_pic_hrd_params_present_flag)
+{
+    unsigned int i;
+    for(i = 0; i <= cpb_cnt_minus1 && !bs->error; i++)
+    {
+        bs_ue(bs); //bit_rate_value_minus1
+        bs_ue(bs); //cpb_size_value_minus1
+        if(sub_pic_hrd_params_present_flag)
         {
-            // printf("> hit 2-1\n");
-            int general_inbld_flag = u(1,buf,&StartBit);
+            bs_ue(bs); //cpb_size_du_value_minus1
+            bs_ue(bs); //bit_rate_du_value_minus1
         }
+        bs_u(bs, 1); //cbr_flag
+    }
+}
+
+static void h265_hrd_parameters(BitReader_Struct *bs, int max_sub_layers_minus1)
+{
+    int nal_hrd_parameters_present_flag = bs_u(bs, 1);
+    int vcl_hrd_parameters_present_flag = bs_u(bs, 1);
+    int sub_pic_hrd_params_present_flag = 0;
+    int i;
+
+    if(nal_hrd_parameters_present_flag || vcl_hrd_parameters_present_flag)
+    {
+        sub_pic_hrd_params_present_flag = bs_u(bs, 1);
+        if(sub_pic_hrd_params_present_flag)
+            bs_skip(bs, 8 + 5 + 1 + 5); //tick_divisor_minus2 ~ dpb_output_delay_du_length_minus1
+        bs_skip(bs, 4 + 4); //bit_rate_scale, cpb_size_scale
+        if(sub_pic_hrd_params_present_flag)
+            bs_skip(bs, 4); //cpb_size_du_scale
+        bs_skip(bs, 5 + 5 + 5); //initial_cpb_removal_delay_length_minus1 ~ dpb_output_delay_length_minus1
+    }
+    for(i = 0; i <= max_sub_layers_minus1 && !bs->error; i++)
+    {
+        int fixed_pic_rate_within_cvs_flag = 1;
+        int low_delay_hrd_flag = 0;
+        unsigned int cpb_cnt_minus1 = 0;
+        if(!bs_u(bs, 1)) //fixed_pic_rate_general_flag
+            fixed_pic_rate_within_cvs_flag = bs_u(bs, 1);
+        if(fixed_pic_rate_within_cvs_flag)
+            bs_ue(bs); //elemental_duration_in_tc_minus1
         else
+            low_delay_hrd_flag = bs_u(bs, 1);
+        if(!low_delay_hrd_flag)
+            cpb_cnt_minus1 = bs_ue(bs);
+        if(cpb_cnt_minus1 > 31)
         {
-            // printf("> hit 2-2\n");
-            int general_reserved_zero_bit = u(1,buf,&StartBit);
+            bs->error = 1;
+            return;
         }
-        int general_level_idc = u(8,buf,&StartBit);
-        if(sps_max_sub_layers_minus1 > 0)
-        {
-            fprintf(stderr, "error: sps_max_sub_layers_minus1 must 0 (%d)\n",
-                sps_max_sub_layers_minus1);
+        if(nal_hrd_parameters_present_flag)
+            h265_sub_layer_hrd_parameters(bs, cpb_cnt_minus1, sub_pic_hrd_params_present_flag);
+        if(vcl_hrd_parameters_present_flag)
+            h265_sub_layer_hrd_parameters(bs, cpb_cnt_minus1, sub_pic_hrd_params_present_flag);
+    }
+}
+
+static void h265_vui_parameters(BitReader_Struct *bs, H26xSps_Struct *sps, int max_sub_layers_minus1)
+{
+    vui_decode_common(bs, sps);
+    bs_u(bs, 1); //neutral_chroma_indication_flag
+    sps->field_seq_flag = bs_u(bs, 1);
+    bs_u(bs, 1); //frame_field_info_present_flag
+    if(bs_u(bs, 1)) //default_display_window_flag
+    {
+        bs_ue(bs);
+        bs_ue(bs);
+        bs_ue(bs);
+        bs_ue(bs);
+    }
+    sps->timing_info_present_flag = bs_u(bs, 1);
+    if(sps->timing_info_present_flag)
+    {
+        sps->num_units_in_tick = bs_u(bs, 32);
+        sps->time_scale = bs_u(bs, 32);
+        if(bs_u(bs, 1)) //vui_poc_proportional_to_timing_flag
+            bs_ue(bs); //vui_num_ticks_poc_diff_one_minus1
+        if(bs_u(bs, 1)) //vui_hrd_parameters_present_flag
+            h265_hrd_parameters(bs, max_sub_layers_minus1);
+    }
+    if(bs_u(bs, 1)) //bitstream_restriction_flag
+    {
+        bs_skip(bs, 3); //tiles_fixed_structure_flag ~ restricted_ref_pic_lists_flag
+        bs_ue(bs); //min_spatial_segmentation_idc
+        bs_ue(bs); //max_bytes_per_pic_denom
+        bs_ue(bs); //max_bits_per_min_cu_denom
+        bs_ue(bs); //log2_max_mv_length_horizontal
+        bs_ue(bs); //log2_max_mv_length_vertical
+    }
+}
+
+//return: 0/false 1/success
+int h265_parse_sps(const unsigned char *buf, unsigned int nLen, H26xSps_Struct *sps)
+{
+    BitReader_Struct bs;
+    unsigned char rbsp[SPS_RBSP_MAX];
+    int num_delta_pocs[65];
+    int sub_width_c, sub_height_c;
+    unsigned int i;
+
+    sps_defaults(sps, 2);
+    //在私有缓冲区里去除防竞争字节, 不改动调用者的数据
+    nLen = de_emulation_prevention_copy(buf, nLen, rbsp, sizeof(rbsp));
+    bs_init(&bs, rbsp, nLen);
+
+    //--- nal_uint_header ---
+    bs_u(&bs, 1); //forbidden_zero_bit
+    if(bs_u(&bs, 6) != 33) //nal_unit_type
+        return 0;
+    bs_u(&bs, 6); //nuh_layer_id
+    bs_u(&bs, 3); //nuh_temporal_id_plus1
+
+    //--- seq_parameter_set_rbsp ---
+    bs_u(&bs, 4); //sps_video_parameter_set_id
+    int sps_max_sub_layers_minus1 = bs_u(&bs, 3);
+    bs_u(&bs, 1); //sps_temporal_id_nesting_flag
+    if(sps_max_sub_layers_minus1 > 6)
+        return 0;
+    if(!h265_profile_tier_level(&bs, sps, sps_max_sub_layers_minus1))
+        return 0;
+
+    sps->sps_id = bs_ue(&bs);
+    sps->chroma_format_idc = bs_ue(&bs);
+    if(sps->chroma_format_idc > 3)
+        return 0;
+    if(sps->chroma_format_idc == 3)
+        sps->separate_colour_plane_flag = bs_u(&bs, 1);
+    sps->coded_width = bs_ue(&bs); //pic_width_in_luma_samples
+    sps->coded_height = bs_ue(&bs); //pic_height_in_luma_samples
+    //conformance window 的偏移以色度采样为单位
+    sub_width_c = (sps->chroma_format_idc == 1 || sps->chroma_format_idc == 2) && !sps->separate_colour_plane_flag ? 2 : 1;
+    sub_height_c = sps->chroma_format_idc == 1 && !sps->separate_colour_plane_flag ? 2 : 1;
+    if(bs_u(&bs, 1)) //conformance_window_flag
+    {
+        sps->crop_left = bs_ue(&bs) * sub_width_c;
+        sps->crop_right = bs_ue(&bs) * sub_width_c;
+        sps->crop_top = bs_ue(&bs) * sub_height_c;
+        sps->crop_bottom = bs_ue(&bs) * sub_height_c;
+    }
+    sps->bit_depth_luma = bs_ue(&bs) + 8;
+    sps->bit_depth_chroma = bs_ue(&bs) + 8;
+    unsigned int log2_max_pic_order_cnt_lsb_minus4 = bs_ue(&bs);
+    if(log2_max_pic_order_cnt_lsb_minus4 > 12)
+        return 0;
+
+    //按最高子层的取值作为整个码流的DPB需求
+    int sps_sub_layer_ordering_info_present_flag = bs_u(&bs, 1);
+    for(i = sps_sub_layer_ordering_info_present_flag ? 0 : sps_max_sub_layers_minus1;
+        i <= (unsigned int)sps_max_sub_layers_minus1; i++)
+    {
+        sps->max_dec_frame_buffering = bs_ue(&bs) + 1; //sps_max_dec_pic_buffering_minus1
+        sps->num_reorder_frames = bs_ue(&bs); //sps_max_num_reorder_pics
+        bs_ue(&bs); //sps_max_latency_increase_plus1
+    }
+
+    bs_ue(&bs); //log2_min_luma_coding_block_size_minus3
+    bs_ue(&bs); //log2_diff_max_min_luma_coding_block_size
+    bs_ue(&bs); //log2_min_luma_transform_block_size_minus2
+    bs_ue(&bs); //log2_diff_max_min_luma_transform_block_size
+    bs_ue(&bs); //max_transform_hierarchy_depth_inter
+    bs_ue(&bs); //max_transform_hierarchy_depth_intra
+    if(bs_u(&bs, 1)) //scaling_list_enabled_flag
+    {
+        if(bs_u(&bs, 1)) //sps_scaling_list_data_present_flag
+            h265_scaling_list_data(&bs);
+    }
+    bs_u(&bs, 1); //amp_enabled_flag
+    bs_u(&bs, 1); //sample_adaptive_offset_enabled_flag
+    if(bs_u(&bs, 1)) //pcm_enabled_flag
+    {
+        bs_skip(&bs, 4 + 4); //pcm_sample_bit_depth_luma/chroma_minus1
+        bs_ue(&bs); //log2_min_pcm_luma_coding_block_size_minus3
+        bs_ue(&bs); //log2_diff_max_min_pcm_luma_coding_block_size
+        bs_u(&bs, 1); //pcm_loop_filter_disabled_flag
+    }
+
+    unsigned int num_short_term_ref_pic_sets = bs_ue(&bs);
+    if(num_short_term_ref_pic_sets > 64)
+        return 0;
+    for(i = 0; i < num_short_term_ref_pic_sets; i++)
+    {
+        if(!h265_st_ref_pic_set(&bs, i, num_delta_pocs))
             return 0;
-        }
     }
-    int sps_seq_parameter_set_id = Ue(buf,nLen,&StartBit);
-    int chroma_format_idc = Ue(buf,nLen,&StartBit);
-    if(chroma_format_idc == 3)
-    {
-        int separate_colour_plane_flag = u(1,buf,&StartBit);
-    }
-    int pic_width_in_luma_samples = Ue(buf,nLen,&StartBit);
-    int pic_height_in_luma_samples = Ue(buf,nLen,&StartBit);
-    int conformance_window_flag = u(1,buf,&StartBit);
-
-    int conf_win_left_offset = 0;
-    int conf_win_right_offset = 0;
-    int conf_win_top_offset = 0;
-    int conf_win_bottom_offset = 0;
-    if(conformance_window_flag)
-    {
-        int conf_win_left_offset = Ue(buf,nLen,&StartBit);
-        int conf_win_right_offset = Ue(buf,nLen,&StartBit);
-        int conf_win_top_offset = Ue(buf,nLen,&StartBit);
-        int conf_win_bottom_offset = Ue(buf,nLen,&StartBit);
-    }
-
-    // printf("forbidden_zero_bit/%d,\n"
-    // "nal_unit_type/%d, nuh_layer_id/%d,\n"
-    // "sps_video_parameter_set_id/%d,\n"
-    // "sps_max_sub_layers_minus1/%d,\n"
-    // "sps_temporal_id_nesting_flag/%d\n"
-    // "sps_seq_parameter_set_id/%d\n"
-    // "chroma_format_idc/%d\n",
-    //     forbidden_zero_bit,
-    //     nal_unit_type,
-    //     nuh_layer_id,
-    //     sps_video_parameter_set_id,
-    //     sps_max_sub_layers_minus1,
-    //     sps_temporal_id_nesting_flag,
-    //     sps_seq_parameter_set_id,
-    //     chroma_format_idc);
-
-    *width = pic_width_in_luma_samples - (conf_win_left_offset + conf_win_right_offset);
-    *height = pic_height_in_luma_samples - (conf_win_top_offset + conf_win_bottom_offset);
-    *fps = 0;
+    if(bs_u(&bs, 1)) //long_term_ref_pics_present_flag
+    {
+        unsigned int num_long_term_ref_pics_sps = bs_ue(&bs);
+        if(num_long_term_ref_pics_sps > 32)
+            return 0;
+        for(i = 0; i < num_long_term_ref_pics_sps; i++)
+            bs_skip(&bs, log2_max_pic_order_cnt_lsb_minus4 + 4 + 1); //lt_ref_pic_poc_lsb_sps, used_by_curr_pic_lt_sps_flag
+    }
+    bs_u(&bs, 1); //sps_temporal_mvp_enabled_flag
+    bs_u(&bs, 1); //strong_intra_smoothing_enabled_flag
+    if(bs_u(&bs, 1)) //vui_parameters_present_flag
+        h265_vui_parameters(&bs, sps, sps_max_sub_layers_minus1);
+
+    if(bs.error)
+        return 0;
 
+    sps->width = sps->coded_width - (sps->crop_left + sps->crop_right);
+    sps->height = sps->coded_height - (sps->crop_top + sps->crop_bottom);
+    if(sps->timing_info_present_flag && sps->num_units_in_tick)
+        sps->fps = (double)sps->time_scale / sps->num_units_in_tick;
     return 1;
 }
 
 //return: 0/false 1/success
-int h264_decode_sps(unsigned char * buf,unsigned int nLen,int *width,int *height,int *fps)
+int h265_decode_sps(unsigned char * buf,unsigned int nLen,int *width,int *height,int *fps)
+{
+    H26xSps_Struct sps;
+    if(!h265_parse_sps(buf, nLen, &sps))
+        return 0;
+    *width = sps.width;
+    *height = sps.height;
+    *fps = (int)(sps.fps + 0.5);
+    return 1;
+}
+
+//---------- H.264 ----------
+
+//Table A-1: level_idc -> MaxDpbMbs
+static int h264_max_dpb_mbs(int level_idc, int constraint_set3_flag)
+{
+    switch(level_idc)
+    {
+        case 9: return 396;
+        case 10: return 396;
+        case 11: return constraint_set3_flag ? 396 : 900; //level 1b
+        case 12: case 13: case 20: return 2376;
+        case 21: return 4752;
+        case 22: case 30: return 8100;
+        case 31: return 18000;
+        case 32: return 20480;
+        case 40: case 41: return 32768;
+        case 42: return 34816;
+        case 50: return 110400;
+        case 51: case 52: return 184320;
+        case 60: case 61: case 62: return 696320;
+        default: return 0;
+    }
+}
+
+static void h264_scaling_list(BitReader_Struct *bs, int size)
 {
-    unsigned int StartBit=0;
-    de_emulation_prevention(buf,&nLen);
- 
-    int timing_info_present_flag = 0;
-    int forbidden_zero_bit=u(1,buf,&StartBit);
-    int nal_ref_idc=u(2,buf,&StartBit);
-    int nal_unit_type=u(5,buf,&StartBit);
-    if(nal_unit_type==7)
-    {
-        int profile_idc=u(8,buf,&StartBit);
-        int constraint_set0_flag=u(1,buf,&StartBit);//(buf[1] & 0x80)>>7;
-        int constraint_set1_flag=u(1,buf,&StartBit);//(buf[1] & 0x40)>>6;
-        int constraint_set2_flag=u(1,buf,&StartBit);//(buf[1] & 0x20)>>5;
-        int constraint_set3_flag=u(1,buf,&StartBit);//(buf[1] & 0x10)>>4;
-        int reserved_zero_4bits=u(4,buf,&StartBit);
-        int level_idc=u(8,buf,&StartBit);
- 
-        int seq_parameter_set_id=Ue(buf,nLen,&StartBit);
- 
-        int chroma_format_idc = 1;
-        // if( profile_idc == 100 || profile_idc == 110 ||
-        //     profile_idc == 122 || profile_idc == 144 )
-        if (profile_idc == 100 || profile_idc == 110 || profile_idc == 122 ||
-            profile_idc == 244 || profile_idc == 44 || profile_idc == 83 ||
-            profile_idc == 86 || profile_idc == 118 || profile_idc == 128 || 
-            profile_idc == 144 || profile_idc == 138 || profile_idc == 139 || 
-            profile_idc == 134 || profile_idc == 135)
+    int lastScale = 8, nextScale = 8, delta, j;
+    for(j = 0; j < size && !bs->error; j++)
+    {
+        if(nextScale != 0)
         {
-            chroma_format_idc=Ue(buf,nLen,&StartBit);
-            if( chroma_format_idc == 3 )
-            {
-                unsigned long residual_colour_transform_flag=u(1,buf,&StartBit);
-            }
-            int bit_depth_luma_minus8=Ue(buf,nLen,&StartBit);
-            int bit_depth_chroma_minus8=Ue(buf,nLen,&StartBit);
-            int qpprime_y_zero_transform_bypass_flag=u(1,buf,&StartBit);
-            int seq_scaling_matrix_present_flag=u(1,buf,&StartBit);
- 
-            int seq_scaling_list_present_flag[8];
-            if( seq_scaling_matrix_present_flag )
+            //标准规定 delta_scale 在 -128~127, 超出的是坏数据, 直接相加还会溢出
+            delta = bs_se(bs);
+            if(delta < -128 || delta > 127)
             {
-                for( int i = 0; i < 8; i++ ) {
-                    seq_scaling_list_present_flag[i]=u(1,buf,&StartBit);
-                }
+                bs->error = 1;
+                return;
             }
+            nextScale = (lastScale + delta + 256) % 256;
         }
-        int log2_max_frame_num_minus4=Ue(buf,nLen,&StartBit);
-        int pic_order_cnt_type=Ue(buf,nLen,&StartBit);
-        if( pic_order_cnt_type == 0 )
-        {
-            unsigned int log2_max_pic_order_cnt_lsb_minus4=Ue(buf,nLen,&StartBit);
-        }
-        else if( pic_order_cnt_type == 1 )
-        {
-            int delta_pic_order_always_zero_flag=u(1,buf,&StartBit);
-            int offset_for_non_ref_pic=Se(buf,nLen,&StartBit);
-            int offset_for_top_to_bottom_field=Se(buf,nLen,&StartBit);
-            int num_ref_frames_in_pic_order_cnt_cycle=Ue(buf,nLen,&StartBit);
- 
-            int *offset_for_ref_frame = (int*)calloc(num_ref_frames_in_pic_order_cnt_cycle, sizeof(int));
-            for( int i = 0; i < num_ref_frames_in_pic_order_cnt_cycle; i++ )
-                offset_for_ref_frame[i]=Se(buf,nLen,&StartBit);
-            free(offset_for_ref_frame);
-        }
-        int num_ref_frames=Ue(buf,nLen,&StartBit);
-        int gaps_in_frame_num_value_allowed_flag=u(1,buf,&StartBit);
-        int pic_width_in_mbs_minus1=Ue(buf,nLen,&StartBit);
-        int pic_height_in_map_units_minus1=Ue(buf,nLen,&StartBit);
-        
+        lastScale = (nextScale == 0) ? lastScale : nextScale;
+    }
+}
 
-        int frame_mbs_only_flag=u(1,buf,&StartBit);
-        if(!frame_mbs_only_flag)
-        {
-            unsigned long mb_adaptive_frame_field_flag=u(1,buf,&StartBit);
-        }
-        int direct_8x8_inference_flag=u(1,buf,&StartBit);
-        int frame_cropping_flag=u(1,buf,&StartBit);
-
-        int frame_crop_left_offset=0;
-        int frame_crop_right_offset=0;
-        int frame_crop_top_offset=0;
-        int frame_crop_bottom_offset=0;
-        if(frame_cropping_flag)
-        {
-            frame_crop_left_offset=Ue(buf,nLen,&StartBit);
-            frame_crop_right_offset=Ue(buf,nLen,&StartBit);
-            frame_crop_top_offset=Ue(buf,nLen,&StartBit);
-            frame_crop_bottom_offset=Ue(buf,nLen,&StartBit);
-        }
-        int vui_parameter_present_flag=u(1,buf,&StartBit);
-        if(vui_parameter_present_flag)
+static void h264_hrd_parameters(BitReader_Struct *bs)
+{
+    unsigned int cpb_cnt_minus1 = bs_ue(bs), i;
+    if(cpb_cnt_minus1 > 31)
+    {
+        bs->error = 1;
+        return;
+    }
+    bs_skip(bs, 4 + 4); //bit_rate_scale, cpb_size_scale
+    for(i = 0; i <= cpb_cnt_minus1 && !bs->error; i++)
+    {
+        bs_ue(bs); //bit_rate_value_minus1
+        bs_ue(bs); //cpb_size_value_minus1
+        bs_u(bs, 1); //cbr_flag
+    }
+    bs_skip(bs, 5 + 5 + 5 + 5); //initial_cpb_removal_delay_length_minus1 ~ time_offset_length
+}
+
+static void h264_vui_parameters(BitReader_Struct *bs, H26xSps_Struct *sps)
+{
+    vui_decode_common(bs, sps);
+    sps->timing_info_present_flag = bs_u(bs, 1);
+    if(sps->timing_info_present_flag)
+    {
+        sps->num_units_in_tick = bs_u(bs, 32);
+        sps->time_scale = bs_u(bs, 32);
+        sps->fixed_frame_rate_flag = bs_u(bs, 1);
+    }
+    int nal_hrd_parameters_present_flag = bs_u(bs, 1);
+    if(nal_hrd_parameters_present_flag)
+        h264_hrd_parameters(bs);
+    int vcl_hrd_parameters_present_flag = bs_u(bs, 1);
+    if(vcl_hrd_parameters_present_flag)
+        h264_hrd_parameters(bs);
+    if(nal_hrd_parameters_present_flag || vcl_hrd_parameters_present_flag)
+        bs_u(bs, 1); //low_delay_hrd_flag
+    bs_u(bs, 1); //pic_struct_present_flag
+    if(bs_u(bs, 1)) //bitstream_restriction_flag
+    {
+        bs_u(bs, 1); //motion_vectors_over_pic_boundaries_flag
+        bs_ue(bs); //max_bytes_per_pic_denom
+        bs_ue(bs); //max_bits_per_mb_denom
+        bs_ue(bs); //log2_max_mv_length_horizontal
+        bs_ue(bs); //log2_max_mv_length_vertical
+        sps->num_reorder_frames = bs_ue(bs); //max_num_reorder_frames
+        sps->max_dec_frame_buffering = bs_ue(bs);
+        sps->bitstream_restriction_flag = 1;
+    }
+}
+
+//return: 0/false 1/success
+int h264_parse_sps(const unsigned char *buf, unsigned int nLen, H26xSps_Struct *sps)
+{
+    BitReader_Struct bs;
+    unsigned char rbsp[SPS_RBSP_MAX];
+    unsigned int i;
+
+    sps_defaults(sps, 1);
+    //在私有缓冲区里去除防竞争字节, 不改动调用者的数据
+    nLen = de_emulation_prevention_copy(buf, nLen, rbsp, sizeof(rbsp));
+    bs_init(&bs, rbsp, nLen);
+
+    bs_u(&bs, 1); //forbidden_zero_bit
+    bs_u(&bs, 2); //nal_ref_idc
+    if(bs_u(&bs, 5) != 7) //nal_unit_type
+        return 0;
+
+    sps->profile_idc = bs_u(&bs, 8);
+    sps->constraint_flags = bs_u(&bs, 8); //constraint_set0~5_flag + reserved_zero_2bits
+    sps->level_idc = bs_u(&bs, 8);
+    sps->sps_id = bs_ue(&bs);
+
+    if (sps->profile_idc == 100 || sps->profile_idc == 110 || sps->profile_idc == 122 ||
+        sps->profile_idc == 244 || sps->profile_idc == 44 || sps->profile_idc == 83 ||
+        sps->profile_idc == 86 || sps->profile_idc == 118 || sps->profile_idc == 128 ||
+        sps->profile_idc == 144 || sps->profile_idc == 138 || sps->profile_idc == 139 ||
+        sps->profile_idc == 134 || sps->profile_idc == 135)
+    {
+        sps->chroma_format_idc = bs_ue(&bs);
+        if(sps->chroma_format_idc > 3)
+            return 0;
+        if(sps->chroma_format_idc == 3)
+            sps->separate_colour_plane_flag = bs_u(&bs, 1);
+        sps->bit_depth_luma = bs_ue(&bs) + 8;
+        sps->bit_depth_chroma = bs_ue(&bs) + 8;
+        bs_u(&bs, 1); //qpprime_y_zero_transform_bypass_flag
+        if(bs_u(&bs, 1)) //seq_scaling_matrix_present_flag
         {
-            int aspect_ratio_info_present_flag=u(1,buf,&StartBit);
-            if(aspect_ratio_info_present_flag)
-            {
-                int aspect_ratio_idc=u(8,buf,&StartBit);
-                if(aspect_ratio_idc==255)
-                {
-                    int sar_width=u(16,buf,&StartBit);
-                    int sar_height=u(16,buf,&StartBit);
-                }
-            }
-            int overscan_info_present_flag=u(1,buf,&StartBit);
-            if(overscan_info_present_flag)
+            for(i = 0; i < (sps->chroma_format_idc != 3 ? 8U : 12U); i++)
             {
-                int overscan_appropriate_flagu=u(1,buf,&StartBit);
-            }
-            int video_signal_type_present_flag=u(1,buf,&StartBit);
-            if(video_signal_type_present_flag)
-            {
-                int video_format=u(3,buf,&StartBit);
-                int video_full_range_flag=u(1,buf,&StartBit);
-                int colour_description_present_flag=u(1,buf,&StartBit);
-                if(colour_description_present_flag)
-                {
-                    int colour_primaries=u(8,buf,&StartBit);
-                    int transfer_characteristics=u(8,buf,&StartBit);
-                    int matrix_coefficients=u(8,buf,&StartBit);
-                }
-            }
-            int chroma_loc_info_present_flag=u(1,buf,&StartBit);
-            if(chroma_loc_info_present_flag)
-            {
-                int chroma_sample_loc_type_top_field=Ue(buf,nLen,&StartBit);
-                int chroma_sample_loc_type_bottom_field=Ue(buf,nLen,&StartBit);
-            }
-            timing_info_present_flag=u(1,buf,&StartBit);
- 
-            if(timing_info_present_flag)
-            {
-                int num_units_in_tick=u(32,buf,&StartBit);
-                int time_scale=u(32,buf,&StartBit);
-                *fps=time_scale/num_units_in_tick;
-                int fixed_frame_rate_flag=u(1,buf,&StartBit);
-                if(fixed_frame_rate_flag)
-                {
-                    *fps = (*fps)/2;
-                }
+                if(bs_u(&bs, 1)) //seq_scaling_list_present_flag[i]
+                    h264_scaling_list(&bs, i < 6 ? 16 : 64);
             }
         }
+    }
+    bs_ue(&bs); //log2_max_frame_num_minus4
+    unsigned int pic_order_cnt_type = bs_ue(&bs);
+    if(pic_order_cnt_type == 0)
+        bs_ue(&bs); //log2_max_pic_order_cnt_lsb_minus4
+    else if(pic_order_cnt_type == 1)
+    {
+        bs_u(&bs, 1); //delta_pic_order_always_zero_flag
+        bs_se(&bs); //offset_for_non_ref_pic
+        bs_se(&bs); //offset_for_top_to_bottom_field
+        unsigned int num_ref_frames_in_pic_order_cnt_cycle = bs_ue(&bs);
+        //取值范围0~255, 超出说明码流已损坏
+        if(num_ref_frames_in_pic_order_cnt_cycle > 255)
+            return 0;
+        for(i = 0; i < num_ref_frames_in_pic_order_cnt_cycle && !bs.error; i++)
+            bs_se(&bs); //offset_for_ref_frame[i]
+    }
+    else if(pic_order_cnt_type > 2)
+        return 0;
+    sps->max_num_ref_frames = bs_ue(&bs);
+    bs_u(&bs, 1); //gaps_in_frame_num_value_allowed_flag
+    unsigned int pic_width_in_mbs_minus1 = bs_ue(&bs);
+    unsigned int pic_height_in_map_units_minus1 = bs_ue(&bs);
+    sps->frame_mbs_only_flag = bs_u(&bs, 1);
+    if(!sps->frame_mbs_only_flag)
+        bs_u(&bs, 1); //mb_adaptive_frame_field_flag
+    bs_u(&bs, 1); //direct_8x8_inference_flag
+    unsigned int frame_crop_left_offset = 0;
+    unsigned int frame_crop_right_offset = 0;
+    unsigned int frame_crop_top_offset = 0;
+    unsigned int frame_crop_bottom_offset = 0;
+    if(bs_u(&bs, 1)) //frame_cropping_flag
+    {
+        frame_crop_left_offset = bs_ue(&bs);
+        frame_crop_right_offset = bs_ue(&bs);
+        frame_crop_top_offset = bs_ue(&bs);
+        frame_crop_bottom_offset = bs_ue(&bs);
+    }
+    if(bs_u(&bs, 1)) //vui_parameters_present_flag
+        h264_vui_parameters(&bs, sps);
 
-        //Source, decoded, and output picture formats
-        int crop_unit_x = 1;
-        int crop_unit_y = 2 - frame_mbs_only_flag;      //monochrome or 4:4:4
-        if (chroma_format_idc == 1) {   //4:2:0
-            crop_unit_x = 2;
-            crop_unit_y = 2 * (2 - frame_mbs_only_flag);
-        }else if (chroma_format_idc == 2) {    //4:2:2
-            crop_unit_x = 2;
-            crop_unit_y = 2 - frame_mbs_only_flag;
-        }
+    if(bs.error || pic_width_in_mbs_minus1 > 1023 || pic_height_in_map_units_minus1 > 1023)
+        return 0;
 
-        *width=(pic_width_in_mbs_minus1+1)*16;
-        *height=(2-frame_mbs_only_flag)*(pic_height_in_map_units_minus1+1)*16;
-    
-        *width-=crop_unit_x*(frame_crop_left_offset+frame_crop_right_offset);
-        *height-=crop_unit_y*(frame_crop_top_offset+frame_crop_bottom_offset);
-
-        *fps = 0;
-
-        // char profile_str[32] = {0};
-        // get_profile(profile_idc, &profile_str[0]);
-        // if(timing_info_present_flag){
-        //     printf("H.264 SPS: -> video size %dx%d, %d fps, profile(%d) %s\n",
-        //         *width, *height, *fps, profile_idc, profile_str);
-        // } else {
-        //     printf("H.264 SPS: -> video size %dx%d, unknown fps, profile(%d) %s\n",
-        //         *width, *height, profile_idc, profile_str);
-        // }
-        return 1;
+    //Source, decoded, and output picture formats
+    int pic_width_in_mbs = pic_width_in_mbs_minus1 + 1;
+    int frame_height_in_mbs = (2 - sps->frame_mbs_only_flag) * (pic_height_in_map_units_minus1 + 1);
+    int crop_unit_x = 1;
+    int crop_unit_y = 2 - sps->frame_mbs_only_flag;      //monochrome or 4:4:4
+    if (sps->separate_colour_plane_flag) {
+        //ChromaArrayType == 0, 同 monochrome
+    }else if (sps->chroma_format_idc == 1) {   //4:2:0
+        crop_unit_x = 2;
+        crop_unit_y = 2 * (2 - sps->frame_mbs_only_flag);
+    }else if (sps->chroma_format_idc == 2) {    //4:2:2
+        crop_unit_x = 2;
+        crop_unit_y = 2 - sps->frame_mbs_only_flag;
     }
-    else
+
+    sps->coded_width = pic_width_in_mbs * 16;
+    sps->coded_height = frame_height_in_mbs * 16;
+    sps->crop_left = crop_unit_x * frame_crop_left_offset;
+    sps->crop_right = crop_unit_x * frame_crop_right_offset;
+    sps->crop_top = crop_unit_y * frame_crop_top_offset;
+    sps->crop_bottom = crop_unit_y * frame_crop_bottom_offset;
+    sps->width = sps->coded_width - (sps->crop_left + sps->crop_right);
+    sps->height = sps->coded_height - (sps->crop_top + sps->crop_bottom);
+
+    //一个tick是一场, 帧率要再除以2
+    if(sps->timing_info_present_flag && sps->num_units_in_tick)
+        sps->fps = (double)sps->time_scale / (2.0 * sps->num_units_in_tick);
+
+    //没有 bitstream_restriction 时按 E.2.1 推导: 纯帧内 profile 为0, 其余取 MaxDpbFrames
+    if(!sps->bitstream_restriction_flag)
+    {
+        int max_dpb_frames = 16;
+        int max_dpb_mbs = h264_max_dpb_mbs(sps->level_idc, (sps->constraint_flags >> 4) & 1);
+        if(max_dpb_mbs && max_dpb_mbs / (pic_width_in_mbs * frame_height_in_mbs) < 16)
+            max_dpb_frames = max_dpb_mbs / (pic_width_in_mbs * frame_height_in_mbs);
+        if(((sps->constraint_flags >> 4) & 1) && (sps->profile_idc == 44 || sps->profile_idc == 86 ||
+            sps->profile_idc == 100 || sps->profile_idc == 110 || sps->profile_idc == 122 || sps->profile_idc == 244))
+            max_dpb_frames = 0;
+        sps->num_reorder_frames = max_dpb_frames;
+        sps->max_dec_frame_buffering = max_dpb_frames;
+    }
+    return 1;
+}
+
+//return: 0/false 1/success
+int h264_decode_sps(unsigned char * buf,unsigned int nLen,int *width,int *height,int *fps)
+{
+    H26xSps_Struct sps;
+    if(!h264_parse_sps(buf, nLen, &sps))
         return 0;
+    *width = sps.width;
+    *height = sps.height;
+    *fps = (int)(sps.fps + 0.5);
+    return 1;
 }
 
 #include <stdlib.h>
@@ -458,10 +862,160 @@ int h264_decode_sps(unsigned char * buf,unsigned int nLen,int *width,int *height
 #include <sys/stat.h>
 #include <sys/types.h>
 
+//---------- Annex-B 起始码查找 ----------
+
+//标量版本: 按 p[2] 的值一次跳过1~3字节
+const unsigned char *h26x_find_start_code_c(const unsigned char *p, const unsigned char *end)
+{
+    while(p + 2 < end)
+    {
+        if(p[2] > 1)
+            p += 3;
+        else if(p[2] == 0)
+            p += 1;
+        else
+        {
+            if(p[0] == 0 && p[1] == 0)
+                return p;
+            p += 3;
+        }
+    }
+    return end;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+//同时比较 p[i]==0 && p[i+1]==0 && p[i+2]==1, 命中位取最低位
+__attribute__((target("sse2")))
+static const unsigned char *h26x_find_start_code_sse2(const unsigned char *p, const unsigned char *end)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    while(end - p >= 18)
+    {
+        __m128i m = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), zero),
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 1)), zero)),
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 2)), one));
+        int mask = _mm_movemask_epi8(m);
+        if(mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return h26x_find_start_code_c(p, end);
+}
+
+__attribute__((target("avx2")))
+static const unsigned char *h26x_find_start_code_avx2(const unsigned char *p, const unsigned char *end)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    while(end - p >= 34)
+    {
+        __m256i m = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), zero),
+                _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 1)), zero)),
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 2)), one));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(m);
+        if(mask)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return h26x_find_start_code_sse2(p, end);
+}
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+
+static const unsigned char *h26x_find_start_code_neon(const unsigned char *p, const unsigned char *end)
+{
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t one = vdupq_n_u8(1);
+    while(end - p >= 18)
+    {
+        uint8x16_t m = vandq_u8(
+            vandq_u8(vceqq_u8(vld1q_u8(p), zero), vceqq_u8(vld1q_u8(p + 1), zero)),
+            vceqq_u8(vld1q_u8(p + 2), one));
+        uint64x2_t m64 = vreinterpretq_u64_u8(m);
+        //块内有命中, 交给标量版本定位
+        if(vgetq_lane_u64(m64, 0) | vgetq_lane_u64(m64, 1))
+            return h26x_find_start_code_c(p, p + 18);
+        p += 16;
+    }
+    return h26x_find_start_code_c(p, end);
+}
+#endif
+
+typedef const unsigned char *(*FindStartCode_Func)(const unsigned char *, const unsigned char *);
+static FindStartCode_Func find_start_code_func = NULL;
+
+//运行时按CPU能力选择实现
+static FindStartCode_Func h26x_find_start_code_pick(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return h26x_find_start_code_avx2;
+    if(__builtin_cpu_supports("sse2"))
+        return h26x_find_start_code_sse2;
+#elif defined(__ARM_NEON)
+    return h26x_find_start_code_neon;
+#endif
+    return h26x_find_start_code_c;
+}
+
+const unsigned char *h26x_find_start_code(const unsigned char *p, const unsigned char *end)
+{
+    if(!find_start_code_func)
+        find_start_code_func = h26x_find_start_code_pick();
+    return find_start_code_func(p, end);
+}
+
+int h26x_start_code_len(const unsigned char *p, unsigned int len)
+{
+    if(len >= 4 && p[0] == 0 && p[1] == 0 && p[2] == 0 && p[3] == 1)
+        return 4;
+    if(len >= 3 && p[0] == 0 && p[1] == 0 && p[2] == 1)
+        return 3;
+    return 0;
+}
+
+void nal_iter_init(NalIter_Struct *it, const unsigned char *buf, unsigned int len)
+{
+    it->ptr = buf;
+    it->end = buf + len;
+}
+
+int nal_iter_next(NalIter_Struct *it, const unsigned char **nal, unsigned int *len)
+{
+    const unsigned char *start, *next;
+    while(it->ptr < it->end)
+    {
+        //ptr 停在起始码上(首次调用时可能在起始码之前的垃圾数据上)
+        start = h26x_find_start_code(it->ptr, it->end);
+        if(start >= it->end)
+            break;
+        start += 3;
+        next = h26x_find_start_code(start, it->end);
+        it->ptr = next;
+        //4字节起始码的首个0和 trailing_zero_8bits 不属于本NAL
+        while(next > start && next[-1] == 0)
+            next--;
+        if(next > start)
+        {
+            *nal = start;
+            *len = (unsigned int)(next - start);
+            return 1;
+        }
+    }
+    it->ptr = it->end;
+    return 0;
+}
+
 //return: 0/false 1/success
 int h26x_get_width_height(char *filePath, int *width, int *height, char isH264)
 {
-    unsigned char buff[1024] = {0};
+    unsigned char buff[4096] = {0};
     int fps, fd, ret;
     int retFinal = 0;
     if((fd = open(filePath, O_RDONLY)) < 1)
@@ -469,45 +1023,23 @@ int h26x_get_width_height(char *filePath, int *width, int *height, char isH264)
         fprintf(stderr, "h26x_get_width_height: open %s err !\n", filePath);
         return retFinal;
     }
-    if((ret = read(fd, buff, 1024)) > 0)
+    if((ret = read(fd, buff, sizeof(buff))) > 0)
     {
-        int i, step = 0;
-        if(isH264)
+        NalIter_Struct it;
+        const unsigned char *nal;
+        unsigned int len;
+        nal_iter_init(&it, buff, ret);
+        while(nal_iter_next(&it, &nal, &len))
         {
-            for(i = 0; i < ret - 10; i++)
+            if(isH264 && (nal[0]&0x1F) == 7)
             {
-                if(buff[i] == 0 && buff[i+1] == 0 && buff[i+2] == 0 && buff[i+3] == 1)
-                {
-                    if(step == 0 && (buff[i+4]&0x1F) == 7)
-                    {
-                        i += 4;
-                        step = i;
-                    }
-                    else if(step)
-                    {
-                        retFinal = h264_decode_sps(&buff[step], i-step, width, height, &fps);
-                        break;
-                    }
-                }
+                retFinal = h264_decode_sps((unsigned char *)nal, len, width, height, &fps);
+                break;
             }
-        }
-        else
-        {
-            for(i = 0; i < ret - 10; i++)
+            else if(!isH264 && ((nal[0]&0x7E)>>1) == 33)
             {
-                if(buff[i] == 0 && buff[i+1] == 0 && buff[i+2] == 0 && buff[i+3] == 1)
-                {
-                    if(step == 0 && ((buff[i+4]&0x7E)>>1) == 33)
-                    {
-                        i += 4;
-                        step = i;
-                    }
-                    else if(step)
-                    {
-                        retFinal = h265_decode_sps(&buff[step], i-step, width, height, &fps);
-                        break;
-                    }
-                }
+                retFinal = h265_decode_sps((unsigned char *)nal, len, width, height, &fps);
+                break;
             }
         }
     }
@@ -608,146 +1140,56 @@ int mp4_get_width_height(char *filePath, int *width, int *height)
 }
 
 
-static int mp4_fd = 0;
-static unsigned long long mdat_size = 0;
+//旧接口: 单个全局的解复用器, 逐个返回NAL(不含长度前缀), 新代码直接用 mp4_demux.h
+static Mp4Demux_Struct *mp4_demux = NULL;
+static unsigned int mp4_sample_index = 0;
+static unsigned int mp4_nal_pos = 0;
 
 void mp4_close(void)
 {
-    if(mp4_fd > 0)
-        close(mp4_fd);
-    mp4_fd = 0;
-    mdat_size = 0;
+    mp4_demux_close(mp4_demux);
+    mp4_demux = NULL;
+    mp4_sample_index = 0;
+    mp4_nal_pos = 0;
 }
 
 void mp4_open(char *filePath)
 {
-    unsigned char buff[9] = {0};
-    char *type;
-    int ret;
-
-    type = (char*)&buff[4];
-
-    if(mp4_fd)
-        mp4_close();
-    mp4_fd = open(filePath, O_RDONLY);
-    if(mp4_fd > 0)
-    {
-        //找到mdat
-        while((ret = read(mp4_fd, buff, 8)) > 0)
-        {
-            mdat_size = (buff[0]<<24)|(buff[1]<<16)|(buff[2]<<8)|buff[3];
-
-            if(strncmp(type, "mdat", 4) == 0)
-            {
-                if(mdat_size == 1)//largesize模式取后面8字节作为size
-                {
-                    if(read(mp4_fd, buff, 8) != 8)
-                    {
-                        fprintf(stderr, "mp4_open: read err\n");
-                        mp4_close();
-                        break;
-                    }
-                    int i;
-                    for(i = 0, mdat_size = 0; i < 8; i++)
-                    {
-                        mdat_size <<= 8;
-                        mdat_size |= buff[i];
-                    }
-                    mdat_size = mdat_size - ret - 8;
-                }
-                break;
-            }
-            
-            if(lseek(mp4_fd, mdat_size - ret, SEEK_CUR) < 0)
-            {
-                fprintf(stderr, "mp4_open: lseek to final\n");
-                mp4_close();
-                break;
-            }
-        }
-    }
+    mp4_close();
+    mp4_demux = mp4_demux_open(filePath);
 }
 
 //return: <=0 final or error
 int mp4_read_frame(unsigned char *data, int dataMaxLen)
 {
-    if(mp4_fd < 1 || mdat_size < 1)
-    {
-        mp4_close();
-        return -1;
-    }
-    
-    unsigned char buff[9] = {0};
-    unsigned int size = 0;
-    int retFinal = 0, ret;
+    Mp4Sample_Struct sample;
+    const unsigned char *nal;
+    unsigned int len;
+    int ret = 0;
 
-    if(read(mp4_fd, buff, 4) == 4)
+    if(!mp4_demux)
+        return -1;
+    while(mp4_demux_sample(mp4_demux, mp4_sample_index, &sample) == 0)
     {
-        size = (buff[0]<<24)|(buff[1]<<16)|(buff[2]<<8)|buff[3];
-        if(size < 1)
-            goto error_return;
-        
-        // printf("mp4_read_frame: size %d / remain %ld\n", size, mdat_size);
-
-        mdat_size = mdat_size - 4 - size;
-
-        if(size > dataMaxLen)
+        ret = mp4_demux_nal_next(mp4_demux, &sample, &mp4_nal_pos, &nal, &len);
+        if(ret < 0)
+            break;
+        //该样本取完, 下一个
+        if(ret == 0)
         {
-            retFinal = read(mp4_fd, data, dataMaxLen);
-            read(mp4_fd, buff, size - dataMaxLen);
+            mp4_sample_index += 1;
+            mp4_nal_pos = 0;
+            continue;
         }
-        else
-            retFinal = read(mp4_fd, data, size);
-        
-        if(retFinal < 1)
-            goto error_return;
-
-        //寻找下一个mdat
-        if(mdat_size == 0)
-        {
-            char *type;
-            type = (char*)&buff[4];
-
-            //找到mdat
-            while((ret = read(mp4_fd, buff, 8)) > 0)
-            {
-                mdat_size = (buff[0]<<24)|(buff[1]<<16)|(buff[2]<<8)|buff[3];
-
-                if(strncmp(type, "mdat", 4) == 0)
-                {
-                    if(mdat_size == 1)
-                    {
-                        if(read(mp4_fd, buff, 8) != 8)
-                        {
-                            fprintf(stderr, "mp4_open: read err\n");
-                            mp4_close();
-                            break;
-                        }
-                        int i;
-                        for(i = 0, mdat_size = 0; i < 8; i++)
-                        {
-                            mdat_size <<= 8;
-                            mdat_size |= buff[i];
-                        }
-                        mdat_size = mdat_size - ret - 8;
-                    }
-                    break;
-                }
-                
-                if(lseek(mp4_fd, mdat_size - ret, SEEK_CUR) < 0)
-                {
-                    fprintf(stderr, "mp4_open: lseek to final\n");
-                    mp4_close();
-                    break;
-                }
-            }
-        }
-
-        return retFinal;
+        if(len < 1)
+            continue;
+        if(len > (unsigned int)dataMaxLen)
+            len = dataMaxLen;
+        memcpy(data, nal, len);
+        return len;
     }
-
-error_return:
-    //error
+    //结束或出错
+    ret = ret < 0 ? 0 : -1;
     mp4_close();
-    return 0;
+    return ret;
 }
@@ -0,0 +1,103 @@
+
+#ifndef _H26X_SPS_DEC_H_
+#define _H26X_SPS_DEC_H_
+
+//按字读取的比特流读取器, 缓存64位, 读越界时置 error 而不会访问 end 之后的内存
+typedef struct{
+    const unsigned char *ptr; //下一个待装入缓存的字节
+    const unsigned char *end;
+    unsigned long long cache; //有效位左对齐
+    int bits; //cache 中的有效位数
+    int error; //1/读越界或码流错误
+}BitReader_Struct;
+
+void bs_init(BitReader_Struct *bs, const unsigned char *buf, unsigned int len);
+unsigned int bs_u(BitReader_Struct *bs, int n);
+void bs_skip(BitReader_Struct *bs, unsigned int n);
+unsigned int bs_ue(BitReader_Struct *bs);
+int bs_se(BitReader_Struct *bs);
+unsigned int bs_pos(BitReader_Struct *bs, const unsigned char *buf);
+
+void get_profile(int profile_idc, char* profile_str);
+unsigned int Ue(unsigned char *pBuff, unsigned int nLen, unsigned int *nStartBit);
+int Se(unsigned char *pBuff, unsigned int nLen, unsigned int *nStartBit);
+unsigned long u(unsigned int BitCount, unsigned char * buf, unsigned int *nStartBit);
+void de_emulation_prevention(unsigned char* buf,unsigned int* buf_size);
+//非原地版本, return: 写入 dst 的长度
+unsigned int de_emulation_prevention_copy(const unsigned char *src, unsigned int len, unsigned char *dst, unsigned int dstMaxLen);
+
+//SPS(含VUI)解析结果, 宽高为裁剪后的显示尺寸, crop_* 以亮度像素为单位
+typedef struct{
+    int codec; //1/h264 2/h265
+    int profile_idc;
+    int level_idc; //h264: 10*级别 h265: 30*级别
+    int constraint_flags; //h264: constraint_set0~5_flag
+    int profile_space; //h265
+    int tier_flag; //h265
+    unsigned int profile_compatibility_flags; //h265
+    int progressive_source_flag; //h265
+    int interlaced_source_flag; //h265
+    int sps_id;
+    int chroma_format_idc; //0/单色 1/4:2:0 2/4:2:2 3/4:4:4
+    int separate_colour_plane_flag;
+    int bit_depth_luma;
+    int bit_depth_chroma;
+    int width;
+    int height;
+    int coded_width; //裁剪前
+    int coded_height;
+    int crop_left;
+    int crop_right;
+    int crop_top;
+    int crop_bottom;
+    int frame_mbs_only_flag; //h264, 0 表示可能是场编码
+    int field_seq_flag; //h265
+    int sar_width; //像素宽高比
+    int sar_height;
+    int video_full_range_flag;
+    int colour_primaries;
+    int transfer_characteristics;
+    int matrix_coefficients;
+    int timing_info_present_flag;
+    unsigned int num_units_in_tick;
+    unsigned int time_scale;
+    int fixed_frame_rate_flag;
+    double fps; //没有 timing_info 时为0
+    int max_num_ref_frames;
+    int bitstream_restriction_flag; //h264: 0 时 reorder/dpb 为按级别推导的值
+    int num_reorder_frames;
+    int max_dec_frame_buffering;
+}H26xSps_Struct;
+
+//不修改 buf, 可直接传入已发布/已写文件的帧
+//return: 0/false 1/success
+int h265_parse_sps(const unsigned char *buf, unsigned int nLen, H26xSps_Struct *sps);
+int h264_parse_sps(const unsigned char *buf, unsigned int nLen, H26xSps_Struct *sps);
+//只取宽高和帧率(四舍五入)的简化接口
+int h265_decode_sps(unsigned char * buf,unsigned int nLen,int *width,int *height,int *fps);
+int h264_decode_sps(unsigned char * buf,unsigned int nLen,int *width,int *height,int *fps);
+int h26x_get_width_height(char *filePath, int *width, int *height, char isH264);
+
+//Annex-B NAL 迭代器, 支持3/4字节起始码
+typedef struct{
+    const unsigned char *ptr;
+    const unsigned char *end;
+}NalIter_Struct;
+
+//查找 00 00 01, 按CPU选用 AVX2/SSE2/NEON 实现, return: 起始码首字节 找不到返回 end
+const unsigned char *h26x_find_start_code(const unsigned char *p, const unsigned char *end);
+const unsigned char *h26x_find_start_code_c(const unsigned char *p, const unsigned char *end);
+//return: p 开头的起始码长度 0/3/4
+int h26x_start_code_len(const unsigned char *p, unsigned int len);
+void nal_iter_init(NalIter_Struct *it, const unsigned char *buf, unsigned int len);
+//return: 1/取到NAL(nal指向NAL头, 不含起始码和尾部的0) 0/结束
+int nal_iter_next(NalIter_Struct *it, const unsigned char **nal, unsigned int *len);
+int mp4_get_width_height(char *filePath, int *width, int *height);
+
+//旧接口, 基于 mp4_demux.h 的单个全局对象, 依次返回每个样本中的NAL(不含长度前缀和起始码)
+void mp4_close(void);
+void mp4_open(char *filePath);
+//return: <=0 final or error
+int mp4_read_frame(unsigned char *data, int dataMaxLen);
+
+#endif
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "key_index.h"
+
+KeyIndex_Struct *key_index_create(const char *path, int codec)
+{
+    KeyIndex_Struct *idx;
+    KeyIndexHead_Struct head;
+    FILE *fp = fopen(path, "wb");
+
+    if(!fp)
+        return NULL;
+    idx = (KeyIndex_Struct *)calloc(1, sizeof(KeyIndex_Struct));
+    if(!idx)
+    {
+        fclose(fp);
+        return NULL;
+    }
+    memset(&head, 0, sizeof(head));
+    head.magic = KEY_INDEX_MAGIC;
+    head.version = KEY_INDEX_VERSION;
+    head.entry_size = sizeof(KeyIndexEntry_Struct);
+    head.codec = codec;
+    fwrite(&head, sizeof(head), 1, fp);
+    idx->fp = fp;
+    idx->codec = codec;
+    return idx;
+}
+
+void key_index_add(KeyIndex_Struct *idx, unsigned long long offset, unsigned long long pts,
+    unsigned int len, int type, int irap)
+{
+    KeyIndexEntry_Struct e;
+
+    if(!idx || !idx->fp)
+        return;
+    memset(&e, 0, sizeof(e));
+    e.offset = offset;
+    e.pts = pts;
+    e.len = len;
+    e.type = type;
+    e.irap = irap;
+    fwrite(&e, sizeof(e), 1, idx->fp);
+    idx->entries += 1;
+}
+
+void key_index_flush(KeyIndex_Struct *idx)
+{
+    if(idx && idx->fp)
+        fflush(idx->fp);
+}
+
+KeyIndex_Struct *key_index_load(const char *path)
+{
+    KeyIndex_Struct *idx = NULL;
+    KeyIndexHead_Struct head;
+    unsigned char *rec = NULL;
+    unsigned int i, n;
+    long size;
+    FILE *fp = fopen(path, "rb");
+
+    if(!fp)
+        return NULL;
+    if(fread(&head, sizeof(head), 1, fp) != 1 || head.magic != KEY_INDEX_MAGIC ||
+        head.entry_size < sizeof(KeyIndexEntry_Struct))
+        goto end;
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp) - sizeof(head);
+    fseek(fp, sizeof(head), SEEK_SET);
+    //录像中的文件最后一条可能没写完, 按整条算
+    n = size / head.entry_size;
+
+    idx = (KeyIndex_Struct *)calloc(1, sizeof(KeyIndex_Struct));
+    rec = (unsigned char *)malloc((size_t)n * head.entry_size + 1);
+    if(!idx || !rec)
+        goto err;
+    idx->entry = (KeyIndexEntry_Struct *)malloc((size_t)n * sizeof(KeyIndexEntry_Struct) + 1);
+    if(!idx->entry)
+        goto err;
+    n = fread(rec, head.entry_size, n, fp);
+    //新版本的条目更长, 只取认识的部分
+    for(i = 0; i < n; i++)
+        memcpy(&idx->entry[i], rec + (size_t)i * head.entry_size, sizeof(KeyIndexEntry_Struct));
+    idx->count = n;
+    idx->codec = head.codec;
+    goto end;
+err:
+    if(idx)
+        free(idx->entry);
+    free(idx);
+    idx = NULL;
+end:
+    free(rec);
+    fclose(fp);
+    return idx;
+}
+
+int key_index_seek(KeyIndex_Struct *idx, unsigned long long pts, KeySeek_Struct *seek)
+{
+    KeyIndexEntry_Struct *e = idx->entry;
+    unsigned int lo = 0, hi = idx->count, k;
+    int i, ps;
+
+    //二分: 第一个 pts 大于目标的条目
+    while(lo < hi)
+    {
+        k = (lo + hi) / 2;
+        if(e[k].pts <= pts)
+            lo = k + 1;
+        else
+            hi = k;
+    }
+    //往前找关键帧, 没有就往后找第一个
+    for(i = (int)lo - 1; i >= 0 && !e[i].irap; i--)
+        ;
+    if(i < 0)
+    {
+        for(i = lo; i < (int)idx->count && !e[i].irap; i++)
+            ;
+        if(i == (int)idx->count)
+            return -1;
+    }
+
+    memset(seek, 0, sizeof(KeySeek_Struct));
+    seek->index = i;
+    seek->pts = e[i].pts;
+    seek->offset = e[i].offset;
+    //同一帧(显示时间相同)的参数集一起读, 起点前移, 中间的SEI等也带上
+    for(k = i; k > 0 && !e[k - 1].irap && e[k - 1].pts == e[i].pts; k--)
+        seek->offset = e[k - 1].offset;
+    for(k = i; k > 0; k--)
+    {
+        if(e[k - 1].irap)
+            continue;
+        ps = idx->codec == 2 ? e[k - 1].type - 32 : e[k - 1].type - 6;
+        if(ps < 0 || ps > 2 || seek->ps_len[ps])
+            continue;
+        seek->ps_offset[ps] = e[k - 1].offset;
+        seek->ps_len[ps] = e[k - 1].len;
+        if(seek->ps_len[1] && seek->ps_len[2] && (idx->codec != 2 || seek->ps_len[0]))
+            break;
+    }
+    return 0;
+}
+
+void key_index_close(KeyIndex_Struct *idx)
+{
+    if(!idx)
+        return;
+    if(idx->fp)
+        fclose(idx->fp);
+    free(idx->entry);
+    free(idx);
+}
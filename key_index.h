@@ -0,0 +1,63 @@
+
+#ifndef _KEY_INDEX_H_
+#define _KEY_INDEX_H_
+
+#include <stdio.h>
+
+#define KEY_INDEX_MAGIC 0x5844494B //"KIDX"
+#define KEY_INDEX_VERSION 1
+
+//文件头, 之后是连续的 KeyIndexEntry_Struct, 小端, 可追加
+typedef struct{
+    unsigned int magic;
+    unsigned short version;
+    unsigned short entry_size; //sizeof(KeyIndexEntry_Struct), 以后加字段时旧的读取端按它跳
+    unsigned int codec; //1/h264 2/h265
+    unsigned int resv;
+}KeyIndexHead_Struct;
+
+//一个 IDR/IRAP 或参数集
+typedef struct{
+    unsigned long long offset; //起始码在录像文件中的位置
+    unsigned long long pts; //显示时间 us
+    unsigned int len; //含起始码的长度
+    unsigned char type; //NAL类型
+    unsigned char irap; //1/关键帧 0/参数集
+    unsigned short resv;
+}KeyIndexEntry_Struct;
+
+//关键帧索引: 录像时在 xxx.h264 旁边写 xxx.h264.idx, 回放时二分查找定位, 不用扫描整个裸流
+//  只在关键帧/参数集时写一条, 用 stdio 缓冲, 每段结束时落盘
+typedef struct{
+    FILE *fp; //写入时
+    int codec;
+    KeyIndexEntry_Struct *entry; //读入后
+    unsigned int count;
+    unsigned long long entries; //已写入的条数
+}KeyIndex_Struct;
+
+//seek 结果: 从 offset 开始读就能解码(与关键帧同一帧的参数集也从这里开始), ps_* 是关键帧之前最近的 VPS/SPS/PPS,
+//  若它们不在 offset 之后(只在流开头发过一次), 需要调用者先单独读出送给解码器
+typedef struct{
+    unsigned long long offset;
+    unsigned long long pts; //关键帧的显示时间
+    unsigned int index; //关键帧在 entry[] 中的序号
+    unsigned long long ps_offset[3]; //VPS/SPS/PPS, h264 不用 [0]
+    unsigned int ps_len[3]; //0/没有
+}KeySeek_Struct;
+
+//return: NULL/打开失败
+KeyIndex_Struct *key_index_create(const char *path, int codec);
+void key_index_add(KeyIndex_Struct *idx, unsigned long long offset, unsigned long long pts,
+    unsigned int len, int type, int irap);
+void key_index_flush(KeyIndex_Struct *idx);
+
+//整个读进内存, return: NULL/不存在或格式不对
+KeyIndex_Struct *key_index_load(const char *path);
+//找显示时间不晚于 pts 的最近关键帧, pts 早于第一个关键帧时给第一个
+//return: 0/success -1/没有关键帧
+int key_index_seek(KeyIndex_Struct *idx, unsigned long long pts, KeySeek_Struct *seek);
+//写入和读取都用它释放
+void key_index_close(KeyIndex_Struct *idx);
+
+#endif
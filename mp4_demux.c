@@ -0,0 +1,651 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mp4_demux.h"
+
+//box 视图, 都指向映射的文件
+typedef struct{
+    const unsigned char *start;
+    const unsigned char *body;
+    const unsigned char *end;
+    char type[5];
+}Mp4Box_Struct;
+
+//解析中用到的 stbl/trex 表
+typedef struct{
+    const unsigned char *stts, *ctts, *stsc, *stsz, *stco, *co64, *stss;
+    const unsigned char *stts_end, *ctts_end, *stsc_end, *stsz_end, *stco_end, *co64_end, *stss_end;
+    int ctts_version;
+    unsigned int trex_duration;
+    unsigned int trex_size;
+    unsigned int trex_flags;
+}Mp4Tables_Struct;
+
+static unsigned int rd16(const unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static unsigned int rd32(const unsigned char *p)
+{
+    return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static unsigned long long rd64(const unsigned char *p)
+{
+    return ((unsigned long long)rd32(p) << 32) | rd32(p + 4);
+}
+
+//取 [p, end) 中的下一个box, return: 1/取到 0/结束或长度错误
+static int box_next(const unsigned char **p, const unsigned char *end, Mp4Box_Struct *box)
+{
+    unsigned long long size;
+    unsigned int head = 8;
+
+    if(end - *p < 8)
+        return 0;
+    size = rd32(*p);
+    if(size == 1)
+    {
+        if(end - *p < 16)
+            return 0;
+        size = rd64(*p + 8);
+        head = 16;
+    }
+    else if(size == 0) //到文件末尾
+        size = end - *p;
+    if(size < head || size > (unsigned long long)(end - *p))
+        return 0;
+    box->start = *p;
+    box->body = *p + head;
+    box->end = *p + size;
+    memcpy(box->type, *p + 4, 4);
+    box->type[4] = 0;
+    *p = box->end;
+    return 1;
+}
+
+//在父box内找第一个指定类型的子box, return: 1/找到
+static int box_find(const unsigned char *p, const unsigned char *end, const char *type, Mp4Box_Struct *box)
+{
+    while(box_next(&p, end, box))
+    {
+        if(memcmp(box->type, type, 4) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+//full box 的表: 跳过 version/flags 和 entry_count, 检查长度, return: 条数 -1/长度不对
+static int table_init(Mp4Box_Struct *box, unsigned int entrySize, unsigned int skip,
+    const unsigned char **table, const unsigned char **tableEnd)
+{
+    unsigned int count;
+    if(box->end - box->body < 8 + skip)
+        return -1;
+    count = rd32(box->body + 4 + skip);
+    *table = box->body + 8 + skip;
+    *tableEnd = box->end;
+    if(entrySize && (unsigned long long)count * entrySize > (unsigned long long)(box->end - *table))
+        return -1;
+    return count;
+}
+
+static int sample_grow(Mp4Demux_Struct *demux, unsigned int *max, unsigned int need)
+{
+    Mp4DemuxSample_Struct *sample;
+    unsigned int size = *max ? *max : 1024;
+    if(need <= *max)
+        return 0;
+    while(size < need)
+        size *= 2;
+    sample = (Mp4DemuxSample_Struct *)realloc(demux->sample, (size_t)size * sizeof(Mp4DemuxSample_Struct));
+    if(!sample)
+        return -1;
+    demux->sample = sample;
+    *max = size;
+    return 0;
+}
+
+//---------- 样本描述 ----------
+
+static void ps_add(Mp4Demux_Struct *demux, const unsigned char *p, unsigned int len)
+{
+    if(demux->ps_count < MP4_DEMUX_PS_MAX)
+    {
+        demux->ps[demux->ps_count] = p;
+        demux->ps_len[demux->ps_count++] = len;
+    }
+}
+
+//return: 0/success -1/不支持或格式错误
+static int parse_stsd(Mp4Demux_Struct *demux, Mp4Box_Struct *stsd)
+{
+    Mp4Box_Struct entry, cfg;
+    const unsigned char *p, *end;
+    unsigned int i, j, n, count, len;
+
+    p = stsd->body + 8;
+    if(stsd->end - stsd->body < 8 || !box_next(&p, stsd->end, &entry) || entry.end - entry.body < 78)
+        return -1;
+    if(!memcmp(entry.type, "avc1", 4) || !memcmp(entry.type, "avc3", 4))
+        demux->codec = 1;
+    else if(!memcmp(entry.type, "hvc1", 4) || !memcmp(entry.type, "hev1", 4))
+        demux->codec = 2;
+    else
+        return -1;
+    //VisualSampleEntry 固定部分之后是 avcC/hvcC
+    if(!demux->width)
+    {
+        demux->width = rd16(entry.body + 24);
+        demux->height = rd16(entry.body + 26);
+    }
+    if(!box_find(entry.body + 78, entry.end, demux->codec == 2 ? "hvcC" : "avcC", &cfg))
+        return -1;
+    p = cfg.body;
+    end = cfg.end;
+
+    if(demux->codec == 1)
+    {
+        if(end - p < 7)
+            return -1;
+        demux->length_size = (p[4] & 3) + 1;
+        p += 5;
+        //SPS 组, 然后 PPS 组
+        for(j = 0; j < 2; j++)
+        {
+            if(p >= end)
+                return -1;
+            n = j == 0 ? *p & 0x1F : *p;
+            p += 1;
+            for(i = 0; i < n; i++)
+            {
+                if(end - p < 2 || (len = rd16(p)) > (unsigned int)(end - p - 2))
+                    return -1;
+                ps_add(demux, p + 2, len);
+                p += 2 + len;
+            }
+        }
+    }
+    else
+    {
+        if(end - p < 23)
+            return -1;
+        demux->length_size = (p[21] & 3) + 1;
+        count = p[22];
+        p += 23;
+        for(j = 0; j < count; j++)
+        {
+            if(end - p < 3)
+                return -1;
+            n = rd16(p + 1);
+            p += 3;
+            for(i = 0; i < n; i++)
+            {
+                if(end - p < 2 || (len = rd16(p)) > (unsigned int)(end - p - 2))
+                    return -1;
+                ps_add(demux, p + 2, len);
+                p += 2 + len;
+            }
+        }
+    }
+    return demux->length_size == 3 ? -1 : 0;
+}
+
+//---------- 普通 mp4: stbl ----------
+
+static int parse_stbl(Mp4Demux_Struct *demux, Mp4Tables_Struct *t)
+{
+    unsigned int count, sizeAll = 0, chunkCount, chunk, k, n, i = 0, max = 0;
+    unsigned int sttsLeft = 0, sttsDelta = 0, cttsLeft = 0, stscNext, perChunk = 0, stscIndex = 0, stscCount;
+    const unsigned char *stts = t->stts, *ctts = t->ctts;
+    unsigned long long dts = 0, offset;
+    int cto = 0;
+
+    //分片文件的样本表可以整个省略
+    if(!t->stsz)
+        return 0;
+    if(!t->stsc || (!t->stco && !t->co64))
+        return -1;
+    sizeAll = rd32(t->stsz - 8);
+    count = rd32(t->stsz - 4);
+    if(!sizeAll && (unsigned long long)count * 4 > (unsigned long long)(t->stsz_end - t->stsz))
+        return -1;
+    if(count == 0)
+        return 0;
+    if(sample_grow(demux, &max, count) < 0)
+        return -1;
+
+    chunkCount = t->stco ? rd32(t->stco - 4) : rd32(t->co64 - 4);
+    stscCount = rd32(t->stsc - 4);
+    stscNext = stscCount ? rd32(t->stsc) : 0xFFFFFFFF;
+    for(chunk = 1; chunk <= chunkCount && i < count; chunk++)
+    {
+        //stsc: 每段 first_chunk 起每块的样本数
+        while(stscIndex < stscCount && chunk >= stscNext)
+        {
+            perChunk = rd32(t->stsc + stscIndex * 12 + 4);
+            stscIndex += 1;
+            stscNext = stscIndex < stscCount ? rd32(t->stsc + stscIndex * 12) : 0xFFFFFFFF;
+        }
+        offset = t->stco ? rd32(t->stco + (chunk - 1) * 4) : rd64(t->co64 + (chunk - 1) * 8);
+        for(k = 0; k < perChunk && i < count; k++, i++)
+        {
+            Mp4DemuxSample_Struct *s = &demux->sample[i];
+            s->size = sizeAll ? sizeAll : rd32(t->stsz + i * 4);
+            s->offset = offset;
+            offset += s->size;
+            //stts/ctts 是游程编码
+            while(!sttsLeft && stts && stts + 8 <= t->stts_end)
+            {
+                sttsLeft = rd32(stts);
+                sttsDelta = rd32(stts + 4);
+                stts += 8;
+            }
+            while(!cttsLeft && ctts && ctts + 8 <= t->ctts_end)
+            {
+                cttsLeft = rd32(ctts);
+                cto = t->ctts_version ? (int)rd32(ctts + 4) : (int)(rd32(ctts + 4) & 0x7FFFFFFF);
+                ctts += 8;
+            }
+            s->dts = dts;
+            s->cto = cttsLeft ? cto : 0;
+            s->sync = t->stss ? 0 : 1;
+            dts += sttsDelta;
+            if(sttsLeft)
+                sttsLeft -= 1;
+            if(cttsLeft)
+                cttsLeft -= 1;
+        }
+    }
+    demux->sample_count = i;
+    //stss: 关键帧序号, 从1开始
+    if(t->stss)
+    {
+        n = rd32(t->stss - 4);
+        for(k = 0; k < n; k++)
+        {
+            i = rd32(t->stss + k * 4);
+            if(i >= 1 && i <= demux->sample_count)
+                demux->sample[i - 1].sync = 1;
+        }
+    }
+    return 0;
+}
+
+//---------- 分片 mp4: moof ----------
+
+static int parse_traf(Mp4Demux_Struct *demux, Mp4Tables_Struct *t, Mp4Box_Struct *moof, Mp4Box_Struct *traf,
+    unsigned int *max, unsigned long long *dts)
+{
+    Mp4Box_Struct box;
+    const unsigned char *p, *q;
+    unsigned int flags, trunFlags, count, duration, size, sflags, i;
+    unsigned long long base = moof->start - demux->map, dataOffset;
+
+    if(!box_find(traf->body, traf->end, "tfhd", &box) || box.end - box.body < 8)
+        return 0;
+    flags = rd32(box.body) & 0xFFFFFF;
+    if(rd32(box.body + 4) != demux->track_id)
+        return 0;
+    duration = t->trex_duration;
+    size = t->trex_size;
+    sflags = t->trex_flags;
+    q = box.body + 8;
+    if(flags & 0x01)
+    {
+        if(box.end - q < 8)
+            return -1;
+        base = rd64(q);
+        q += 8;
+    }
+    if(flags & 0x02)
+        q += 4;
+    if((flags & 0x08) && box.end - q >= 4)
+    {
+        duration = rd32(q);
+        q += 4;
+    }
+    if((flags & 0x10) && box.end - q >= 4)
+    {
+        size = rd32(q);
+        q += 4;
+    }
+    if((flags & 0x20) && box.end - q >= 4)
+        sflags = rd32(q);
+
+    if(box_find(traf->body, traf->end, "tfdt", &box) && box.end - box.body >= 8)
+        *dts = box.body[0] == 1 && box.end - box.body >= 12 ? rd64(box.body + 4) : rd32(box.body + 4);
+
+    dataOffset = base;
+    p = traf->body;
+    while(box_next(&p, traf->end, &box))
+    {
+        unsigned int firstFlags = 0, entry;
+        int version, first = 1;
+        if(memcmp(box.type, "trun", 4) != 0 || box.end - box.body < 8)
+            continue;
+        version = box.body[0];
+        trunFlags = rd32(box.body) & 0xFFFFFF;
+        count = rd32(box.body + 4);
+        q = box.body + 8;
+        //可选字段读之前先确认还在 box 里, 短的 trun 不能读到后面去
+        if(trunFlags & 0x01)
+        {
+            if(box.end - q < 4)
+                return -1;
+            dataOffset = base + (int)rd32(q);
+            q += 4;
+        }
+        if(trunFlags & 0x04)
+        {
+            if(box.end - q < 4)
+                return -1;
+            firstFlags = rd32(q);
+            q += 4;
+        }
+        entry = ((trunFlags & 0x100) ? 4 : 0) + ((trunFlags & 0x200) ? 4 : 0) +
+            ((trunFlags & 0x400) ? 4 : 0) + ((trunFlags & 0x800) ? 4 : 0);
+        if((unsigned long long)count * entry > (unsigned long long)(box.end - q))
+            return -1;
+        if(sample_grow(demux, max, demux->sample_count + count) < 0)
+            return -1;
+        for(i = 0; i < count; i++)
+        {
+            Mp4DemuxSample_Struct *s = &demux->sample[demux->sample_count++];
+            unsigned int d = duration, f = sflags;
+            s->size = size;
+            s->cto = 0;
+            if(trunFlags & 0x100)
+            {
+                d = rd32(q);
+                q += 4;
+            }
+            if(trunFlags & 0x200)
+            {
+                s->size = rd32(q);
+                q += 4;
+            }
+            if(trunFlags & 0x400)
+            {
+                f = rd32(q);
+                q += 4;
+            }
+            else if(first && (trunFlags & 0x04))
+                f = firstFlags;
+            if(trunFlags & 0x800)
+            {
+                s->cto = version ? (int)rd32(q) : (int)(rd32(q) & 0x7FFFFFFF);
+                q += 4;
+            }
+            first = 0;
+            s->offset = dataOffset;
+            s->dts = *dts;
+            //sample_is_non_sync_sample
+            s->sync = !(f & 0x10000);
+            dataOffset += s->size;
+            *dts += d;
+        }
+    }
+    return 0;
+}
+
+//---------- 轨道 ----------
+
+//return: 1/是 h264/h265 视频轨 0/不是 -1/出错
+static int parse_trak(Mp4Demux_Struct *demux, Mp4Box_Struct *trak, Mp4Tables_Struct *t)
+{
+    Mp4Box_Struct mdia, box, minf, stbl;
+    const unsigned char *p;
+    int n;
+
+    if(!box_find(trak->body, trak->end, "mdia", &mdia))
+        return 0;
+    if(!box_find(mdia.body, mdia.end, "hdlr", &box) || box.end - box.body < 12 || memcmp(box.body + 8, "vide", 4))
+        return 0;
+    if(!box_find(mdia.body, mdia.end, "mdhd", &box) || box.end - box.body < 24)
+        return -1;
+    demux->timescale = box.body[0] == 1 ? rd32(box.body + 20) : rd32(box.body + 12);
+    if(!demux->timescale)
+        return -1;
+    if(box_find(trak->body, trak->end, "tkhd", &box) && box.end - box.body >= 84)
+    {
+        demux->track_id = box.body[0] == 1 ? rd32(box.body + 20) : rd32(box.body + 12);
+        //16.16 定点数, 取整数部分
+        demux->width = rd32(box.end - 8) >> 16;
+        demux->height = rd32(box.end - 4) >> 16;
+    }
+    if(!box_find(mdia.body, mdia.end, "minf", &minf) || !box_find(minf.body, minf.end, "stbl", &stbl))
+        return -1;
+    if(!box_find(stbl.body, stbl.end, "stsd", &box) || parse_stsd(demux, &box) < 0)
+        return 0;
+
+    memset(t, 0, sizeof(Mp4Tables_Struct));
+    p = stbl.body;
+    while(box_next(&p, stbl.end, &box))
+    {
+        if(!memcmp(box.type, "stts", 4))
+            n = table_init(&box, 8, 0, &t->stts, &t->stts_end);
+        else if(!memcmp(box.type, "ctts", 4))
+        {
+            n = table_init(&box, 8, 0, &t->ctts, &t->ctts_end);
+            t->ctts_version = box.body[0];
+        }
+        else if(!memcmp(box.type, "stsc", 4))
+            n = table_init(&box, 12, 0, &t->stsc, &t->stsc_end);
+        else if(!memcmp(box.type, "stsz", 4))
+            n = table_init(&box, 0, 4, &t->stsz, &t->stsz_end);
+        else if(!memcmp(box.type, "stco", 4))
+            n = table_init(&box, 4, 0, &t->stco, &t->stco_end);
+        else if(!memcmp(box.type, "co64", 4))
+            n = table_init(&box, 8, 0, &t->co64, &t->co64_end);
+        else if(!memcmp(box.type, "stss", 4))
+            n = table_init(&box, 4, 0, &t->stss, &t->stss_end);
+        else
+            continue;
+        if(n < 0)
+            return -1;
+    }
+    return 1;
+}
+
+static int build_sync(Mp4Demux_Struct *demux)
+{
+    unsigned int i;
+
+    //文件在映射范围外的样本(没录完)丢掉
+    for(i = 0; i < demux->sample_count; i++)
+    {
+        if(demux->sample[i].offset + demux->sample[i].size > demux->map_size)
+            break;
+    }
+    demux->truncated = demux->sample_count - i;
+    demux->sample_count = i;
+    demux->sync = (unsigned int *)malloc((size_t)(demux->sample_count + 1) * sizeof(unsigned int));
+    if(!demux->sync)
+        return -1;
+    for(i = 0; i < demux->sample_count; i++)
+    {
+        if(demux->sample[i].sync)
+            demux->sync[demux->sync_count++] = i;
+    }
+    return 0;
+}
+
+Mp4Demux_Struct *mp4_demux_open(const char *filePath)
+{
+    Mp4Demux_Struct *demux;
+    Mp4Tables_Struct t;
+    Mp4Box_Struct top, box, mvex;
+    const unsigned char *p, *q, *end;
+    unsigned long long dts = 0;
+    unsigned int max = 0;
+    struct stat st;
+    int fd, found = 0, ret;
+
+    if((fd = open(filePath, O_RDONLY)) < 0)
+    {
+        fprintf(stderr, "mp4_demux_open: open %s err !\n", filePath);
+        return NULL;
+    }
+    demux = (Mp4Demux_Struct *)calloc(1, sizeof(Mp4Demux_Struct));
+    if(!demux || fstat(fd, &st) < 0 || st.st_size < 8)
+        goto err;
+    demux->map_size = st.st_size;
+    demux->map = (unsigned char *)mmap(NULL, demux->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(demux->map == MAP_FAILED)
+    {
+        demux->map = NULL;
+        goto err;
+    }
+    //映射之后不再需要fd
+    close(fd);
+    fd = -1;
+    madvise(demux->map, demux->map_size, MADV_WILLNEED);
+
+    end = demux->map + demux->map_size;
+    if(!box_find(demux->map, end, "moov", &top))
+    {
+        fprintf(stderr, "mp4_demux_open: %s no moov\n", filePath);
+        goto err;
+    }
+    p = top.body;
+    while(!found && box_next(&p, top.end, &box))
+    {
+        if(memcmp(box.type, "trak", 4) == 0 && (ret = parse_trak(demux, &box, &t)) != 0)
+        {
+            if(ret < 0)
+                goto err;
+            found = 1;
+        }
+    }
+    if(!found)
+    {
+        fprintf(stderr, "mp4_demux_open: %s no h264/h265 track\n", filePath);
+        goto err;
+    }
+    if(parse_stbl(demux, &t) < 0)
+        goto err;
+    max = demux->sample_count;
+
+    //分片: trex 给默认值, 样本在 moov 之后的各个 moof 里
+    if(box_find(top.body, top.end, "mvex", &mvex))
+    {
+        q = mvex.body;
+        while(box_next(&q, mvex.end, &box))
+        {
+            if(memcmp(box.type, "trex", 4) == 0 && box.end - box.body >= 24 && rd32(box.body + 4) == demux->track_id)
+            {
+                t.trex_duration = rd32(box.body + 12);
+                t.trex_size = rd32(box.body + 16);
+                t.trex_flags = rd32(box.body + 20);
+            }
+        }
+        p = demux->map;
+        while(box_next(&p, end, &top))
+        {
+            if(memcmp(top.type, "moof", 4) != 0)
+                continue;
+            q = top.body;
+            while(box_next(&q, top.end, &box))
+            {
+                if(memcmp(box.type, "traf", 4) == 0 && parse_traf(demux, &t, &top, &box, &max, &dts) < 0)
+                    goto err;
+            }
+        }
+    }
+    if(build_sync(demux) < 0)
+        goto err;
+    return demux;
+err:
+    if(fd >= 0)
+        close(fd);
+    mp4_demux_close(demux);
+    return NULL;
+}
+
+void mp4_demux_close(Mp4Demux_Struct *demux)
+{
+    if(!demux)
+        return;
+    if(demux->map)
+        munmap(demux->map, demux->map_size);
+    free(demux->sample);
+    free(demux->sync);
+    free(demux);
+}
+
+int mp4_demux_sample(Mp4Demux_Struct *demux, unsigned int index, Mp4Sample_Struct *sample)
+{
+    Mp4DemuxSample_Struct *s;
+    long long pts;
+
+    if(index >= demux->sample_count)
+        return -1;
+    s = &demux->sample[index];
+    pts = (long long)s->dts + s->cto;
+    sample->data = demux->map + s->offset;
+    sample->size = s->size;
+    sample->index = index;
+    sample->dts_us = s->dts * 1000000 / demux->timescale;
+    sample->pts_us = pts > 0 ? (unsigned long long)pts * 1000000 / demux->timescale : 0;
+    sample->sync = s->sync;
+    return 0;
+}
+
+int mp4_demux_seek(Mp4Demux_Struct *demux, unsigned long long timeUs, int keyframe)
+{
+    unsigned long long dts = timeUs * demux->timescale / 1000000;
+    unsigned int lo = 0, hi, k;
+
+    if(demux->sample_count == 0)
+        return -1;
+    //二分: 第一个解码时间大于目标的样本
+    if(keyframe && demux->sync_count)
+    {
+        hi = demux->sync_count;
+        while(lo < hi)
+        {
+            k = (lo + hi) / 2;
+            if(demux->sample[demux->sync[k]].dts <= dts)
+                lo = k + 1;
+            else
+                hi = k;
+        }
+        return demux->sync[lo ? lo - 1 : 0];
+    }
+    hi = demux->sample_count;
+    while(lo < hi)
+    {
+        k = (lo + hi) / 2;
+        if(demux->sample[k].dts <= dts)
+            lo = k + 1;
+        else
+            hi = k;
+    }
+    return lo ? lo - 1 : 0;
+}
+
+int mp4_demux_nal_next(Mp4Demux_Struct *demux, const Mp4Sample_Struct *sample, unsigned int *pos,
+    const unsigned char **nal, unsigned int *len)
+{
+    unsigned int n = demux->length_size, i, size = 0;
+
+    if(*pos >= sample->size)
+        return 0;
+    if(sample->size - *pos < n)
+        return -1;
+    for(i = 0; i < n; i++)
+        size = (size << 8) | sample->data[*pos + i];
+    if(size > sample->size - *pos - n)
+        return -1;
+    *nal = sample->data + *pos + n;
+    *len = size;
+    *pos += n + size;
+    return 1;
+}
@@ -0,0 +1,60 @@
+
+#ifndef _MP4_DEMUX_H_
+#define _MP4_DEMUX_H_
+
+#define MP4_DEMUX_PS_MAX 16 //avcC/hvcC 中最多取的参数集个数
+
+//样本表中的一项, 时间单位为轨道 timescale
+typedef struct{
+    unsigned long long offset; //在文件中的位置
+    unsigned long long dts;
+    unsigned int size;
+    int cto; //显示时间 - 解码时间
+    int sync; //1/关键帧
+}Mp4DemuxSample_Struct;
+
+//取样本得到的视图, data 指向映射的文件, 在 mp4_demux_close() 之前有效
+typedef struct{
+    const unsigned char *data; //长度前缀格式的NAL, 用 mp4_demux_nal_next() 拆
+    unsigned int size;
+    unsigned int index;
+    unsigned long long dts_us;
+    unsigned long long pts_us;
+    int sync;
+}Mp4Sample_Struct;
+
+//mp4 解复用: 整个文件 mmap, 打开时把第一个视频轨的样本表(stts/ctts/stsc/stsz/stco/co64/stss)
+//  或分片(moof/traf/trun)一次解析成数组, 之后按序号/时间取样本不再有系统调用, 也不拷贝
+//  每个文件一个对象, 没有全局状态, 可以同时打开多个
+typedef struct{
+    unsigned char *map;
+    unsigned long long map_size;
+    int codec; //1/h264 2/h265
+    unsigned int track_id;
+    unsigned int timescale;
+    int width;
+    int height;
+    unsigned int length_size; //NAL长度前缀字节数 1/2/4
+    const unsigned char *ps[MP4_DEMUX_PS_MAX]; //avcC/hvcC 中的 VPS/SPS/PPS, 指向映射的文件
+    unsigned int ps_len[MP4_DEMUX_PS_MAX];
+    unsigned int ps_count;
+    Mp4DemuxSample_Struct *sample;
+    unsigned int sample_count;
+    unsigned int *sync; //关键帧的样本序号, 递增
+    unsigned int sync_count;
+    unsigned int truncated; //数据超出文件末尾(没录完)而丢掉的样本数
+}Mp4Demux_Struct;
+
+//return: NULL/打开失败或没有 h264/h265 视频轨
+Mp4Demux_Struct *mp4_demux_open(const char *filePath);
+void mp4_demux_close(Mp4Demux_Struct *demux);
+//return: 0/success -1/序号越界
+int mp4_demux_sample(Mp4Demux_Struct *demux, unsigned int index, Mp4Sample_Struct *sample);
+//按解码时间查找: 不晚于 timeUs 的最后一个样本, keyframe=1 时找不晚于它的最后一个关键帧
+//  早于第一个样本时返回第一个, return: 样本序号 -1/没有样本
+int mp4_demux_seek(Mp4Demux_Struct *demux, unsigned long long timeUs, int keyframe);
+//遍历样本中的NAL, pos 从0开始, return: 1/取到 0/结束 -1/长度前缀出错
+int mp4_demux_nal_next(Mp4Demux_Struct *demux, const Mp4Sample_Struct *sample, unsigned int *pos,
+    const unsigned char **nal, unsigned int *len);
+
+#endif
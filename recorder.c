@@ -0,0 +1,531 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "recorder.h"
+#include "h26x_sps_dec.h"
+#include "fmp4_mux.h"
+#include "key_index.h"
+
+static unsigned char start_code[4] = {0x00, 0x00, 0x00, 0x01};
+
+static unsigned long long wall_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int recorder_segmented(Recorder_Struct *rec)
+{
+    return rec->cfg.seg_time || rec->cfg.seg_size || rec->cfg.pre_time;
+}
+
+//---------- 预录环 ----------
+
+static int pre_init(PreBuffer_Struct *pre, unsigned int size)
+{
+    pre->size = size;
+    pre->data = (unsigned char *)malloc(size);
+    pre->frame = (PreFrame_Struct *)calloc(RECORDER_PRE_FRAMES, sizeof(PreFrame_Struct));
+    if(!pre->data || !pre->frame)
+    {
+        free(pre->data);
+        free(pre->frame);
+        pre->data = NULL;
+        pre->frame = NULL;
+        return -1;
+    }
+    //先碰一遍, 收流时不再缺页
+    memset(pre->data, 0, size);
+    pre->last_irap = -1;
+    return 0;
+}
+
+static void pre_reset(PreBuffer_Struct *pre)
+{
+    pre->first = 0;
+    pre->count = 0;
+    pre->tail = 0;
+    pre->last_irap = -1;
+    pre->bytes = 0;
+}
+
+//淘汰最旧的一组GOP, 没有下一组时清空
+static void pre_pop_gop(PreBuffer_Struct *pre)
+{
+    int next = pre->frame[pre->first].next_irap;
+    if(next < 0)
+    {
+        pre_reset(pre);
+        return;
+    }
+    while(pre->first != (unsigned int)next)
+    {
+        pre->bytes -= pre->frame[pre->first].len;
+        pre->first = (pre->first + 1) % RECORDER_PRE_FRAMES;
+        pre->count -= 1;
+    }
+}
+
+//return: 可写入 len 字节的位置 -1/空间不够
+static int pre_space(PreBuffer_Struct *pre, unsigned int len)
+{
+    unsigned int head;
+    if(pre->count == 0)
+        return 0;
+    head = pre->frame[pre->first].offset;
+    if(pre->tail > head)
+    {
+        if(pre->size - pre->tail >= len)
+            return pre->tail;
+        if(head >= len)
+            return 0;
+    }
+    else if(pre->tail < head && head - pre->tail >= len)
+        return pre->tail;
+    return -1;
+}
+
+static void pre_push(PreBuffer_Struct *pre, const unsigned char *nal, unsigned int len, int irap,
+    unsigned long long pts, unsigned long long now, unsigned long long keepMs)
+{
+    PreFrame_Struct *f;
+    unsigned int idx;
+    int offset;
+
+    //下一组的开头已经早于预录窗口, 最旧的一组就用不上了
+    while(pre->count && pre->frame[pre->first].next_irap >= 0 &&
+        pre->frame[pre->frame[pre->first].next_irap].time + keepMs <= now)
+        pre_pop_gop(pre);
+    //开头必须是关键帧
+    if(pre->count == 0 && !irap)
+        return;
+    if(len > pre->size)
+    {
+        pre->dropped += 1;
+        pre_reset(pre);
+        return;
+    }
+    if(pre->count == RECORDER_PRE_FRAMES)
+        pre_pop_gop(pre);
+    while((offset = pre_space(pre, len)) < 0)
+        pre_pop_gop(pre);
+    //整组被淘汰后剩下的不是关键帧开头
+    if(pre->count == 0 && !irap)
+        return;
+
+    idx = (pre->first + pre->count) % RECORDER_PRE_FRAMES;
+    f = &pre->frame[idx];
+    f->offset = offset;
+    f->len = len;
+    f->time = now;
+    f->pts = pts;
+    f->next_irap = -1;
+    f->irap = irap;
+    memcpy(pre->data + offset, nal, len);
+    pre->tail = offset + len;
+    pre->bytes += len;
+    pre->count += 1;
+    if(irap)
+    {
+        if(pre->last_irap >= 0)
+            pre->frame[pre->last_irap].next_irap = idx;
+        pre->last_irap = idx;
+    }
+}
+
+//复用器的输出直接进写入器
+static void recorder_mux_output(void *priv, const unsigned char *data, unsigned int len)
+{
+    Recorder_Struct *rec = (Recorder_Struct *)priv;
+    if(file_writer_write(rec->fw, data, len) < 0)
+        rec->mux_errors += 1;
+}
+
+//return: NAL类型, psIndex: 0~2/VPS/SPS/PPS -1/不是参数集
+static int recorder_nal_type(Recorder_Struct *rec, const unsigned char *nal, int *irap, int *psIndex)
+{
+    int type;
+    *psIndex = -1;
+    if(rec->codec == 2)
+    {
+        type = (nal[0] & 0x7E) >> 1;
+        *irap = type >= 16 && type <= 21;
+        if(type >= 32 && type <= 34)
+            *psIndex = type - 32;
+    }
+    else
+    {
+        type = nal[0] & 0x1F;
+        *irap = type == 5;
+        if(type == 7 || type == 8)
+            *psIndex = type - 6;
+    }
+    return type;
+}
+
+//关键帧/参数集记入索引, len 含起始码, 在写入文件之前调用
+//  此时只知道它在 fw->pos 里的序号, 等所在的块交出去写时(recorder_block)才换算成文件位置
+static void recorder_index(Recorder_Struct *rec, const unsigned char *nal, unsigned int len, unsigned long long pts)
+{
+    PendingIndex_Struct *p;
+    int irap, psIndex;
+    int type = recorder_nal_type(rec, nal, &irap, &psIndex);
+
+    if(!rec->idx || (!irap && psIndex < 0))
+        return;
+    if(rec->pending_count == rec->pending_size)
+    {
+        unsigned int size = rec->pending_size ? rec->pending_size * 2 : 16;
+        p = (PendingIndex_Struct *)realloc(rec->pending, size * sizeof(PendingIndex_Struct));
+        if(!p)
+            return;
+        rec->pending = p;
+        rec->pending_size = size;
+    }
+    p = &rec->pending[rec->pending_count++];
+    memset(p, 0, sizeof(PendingIndex_Struct));
+    p->pos = rec->fw->pos;
+    p->pts = pts;
+    p->len = len;
+    p->type = type;
+    p->irap = irap;
+}
+
+//写入器的一段数据离开缓冲: 完整落在已交出部分的索引项写入索引, 碰到被丢弃部分的作废
+static void recorder_block(void *priv, unsigned long long start, unsigned int len,
+    unsigned long long offset, int written)
+{
+    Recorder_Struct *rec = (Recorder_Struct *)priv;
+    unsigned long long end = start + len;
+    unsigned int i, done = 0;
+
+    for(i = 0; i < rec->pending_count && rec->pending[i].pos < end; i++)
+    {
+        PendingIndex_Struct *p = &rec->pending[i];
+        if(!written)
+            p->broken = 1;
+        else if(p->pos >= start)
+            p->offset = offset + (p->pos - start);
+        //后半截还在缓冲里
+        if(p->pos + p->len > end)
+            break;
+        if(!p->broken)
+            key_index_add(rec->idx, p->offset, p->pts, p->len, p->type, p->irap);
+        done = i + 1;
+    }
+    if(done)
+    {
+        rec->pending_count -= done;
+        memmove(rec->pending, rec->pending + done, rec->pending_count * sizeof(PendingIndex_Struct));
+    }
+}
+
+//写一个NAL(不含起始码): 裸流补起始码, mp4 交给复用器
+static int recorder_emit(Recorder_Struct *rec, const unsigned char *nal, unsigned int len, unsigned long long pts)
+{
+    struct iovec iov[2];
+    if(rec->mux)
+        return fmp4_mux_write(rec->mux, nal, len, pts, recorder_mux_output, rec);
+    recorder_index(rec, nal, 4 + len, pts);
+    iov[0].iov_base = start_code;
+    iov[0].iov_len = 4;
+    iov[1].iov_base = (void *)nal;
+    iov[1].iov_len = len;
+    return file_writer_writev(rec->fw, iov, 2);
+}
+
+//开始新的一段, extraDepth: 异步写队列额外加深的块数
+//return: 0/success -1/打开失败
+static int recorder_new_segment(Recorder_Struct *rec, unsigned int extraDepth)
+{
+    const char *suffix = rec->cfg.mp4 ? ".mp4" : rec->codec == 2 ? ".h265" : ".h264";
+    char idxName[168];
+    int i;
+
+    if(recorder_segmented(rec))
+        snprintf(rec->name, sizeof(rec->name), "%s_%05u%s", rec->base, rec->seg_index, suffix);
+    else
+        snprintf(rec->name, sizeof(rec->name), "%s%s", rec->base, suffix);
+    rec->fw = file_writer_open(rec->name, rec->cfg.buf_size, rec->cfg.flush_ms, rec->cfg.direct);
+    if(!rec->fw)
+        return -1;
+    rec->pending_count = 0;
+    if(rec->cfg.aio)
+        rec->aio_mode = file_writer_async(rec->fw, rec->cfg.aio + extraDepth);
+    //moof/mdat 的偏移都是算好的, 丢掉一块后面的片段全都错位, 宁可让收流等磁盘
+    if(rec->cfg.mp4)
+        file_writer_nodrop(rec->fw, 1);
+    //每段都是独立的 mp4, 缓存的参数集先交给复用器, 不产生输出
+    if(rec->cfg.mp4)
+    {
+        rec->mux = fmp4_mux_create(rec->codec);
+        for(i = 0; rec->mux && i < 3; i++)
+        {
+            if(rec->ps_len[i])
+                fmp4_mux_write(rec->mux, rec->ps[i], rec->ps_len[i], 0, recorder_mux_output, rec);
+        }
+    }
+    //裸流旁边写关键帧索引, 打开失败不影响录像
+    else
+    {
+        snprintf(idxName, sizeof(idxName), "%s.idx", rec->name);
+        rec->idx = key_index_create(idxName, rec->codec);
+        if(rec->idx)
+            file_writer_on_block(rec->fw, recorder_block, rec);
+    }
+    rec->seg_start = wall_ms();
+    rec->seg_frames = 0;
+    return 0;
+}
+
+//结束当前段: 数据交出去写, 记入索引, 文件等写完再关
+static void recorder_end_segment(Recorder_Struct *rec)
+{
+    FileWriter_Struct *fw = rec->fw;
+    unsigned int i;
+
+    if(!fw)
+        return;
+    if(rec->mux)
+    {
+        fmp4_mux_flush(rec->mux, recorder_mux_output, rec);
+        rec->samples += rec->mux->samples;
+        fmp4_mux_destroy(rec->mux);
+        rec->mux = NULL;
+    }
+    rec->fw = NULL;
+    //段尾交出去写时不能丢, 丢了这段文件就缺了结尾
+    file_writer_sync(fw);
+    //O_DIRECT 不足一块的尾巴关闭时才写, 接着当前文件位置, 里面的索引项现在就能定下来
+    for(i = 0; i < rec->pending_count && rec->idx; i++)
+    {
+        PendingIndex_Struct *p = &rec->pending[i];
+        if(p->pos >= fw->handed)
+            p->offset = fw->offset + (p->pos - fw->handed);
+        if(!p->broken)
+            key_index_add(rec->idx, p->offset, p->pts, p->len, p->type, p->irap);
+    }
+    rec->pending_count = 0;
+    file_writer_on_block(fw, NULL, NULL);
+    key_index_close(rec->idx);
+    rec->idx = NULL;
+    if(rec->list)
+    {
+        fprintf(rec->list, "%s %llu %llu %llu %u\n", rec->name, rec->seg_start,
+            wall_ms() - rec->seg_start, fw->pos, rec->seg_frames);
+        fflush(rec->list);
+    }
+    rec->stalls_closed += fw->stalls;
+    rec->dropped_closed += fw->dropped;
+    if(fw->inflight_max > rec->inflight_max)
+        rec->inflight_max = fw->inflight_max;
+    //上一段还没写完就又切了, 只能等它
+    if(rec->closing)
+        file_writer_close(rec->closing);
+    rec->closing = fw;
+    if(!file_writer_busy(fw))
+    {
+        file_writer_close(fw);
+        rec->closing = NULL;
+    }
+    rec->seg_index += 1;
+}
+
+Recorder_Struct *recorder_open(char *base, int codec, RecorderConfig_Struct *cfg)
+{
+    Recorder_Struct *rec = (Recorder_Struct *)calloc(1, sizeof(Recorder_Struct));
+    char listName[160];
+
+    if(!rec)
+        return NULL;
+    rec->cfg = *cfg;
+    rec->codec = codec;
+    strncpy(rec->base, base, sizeof(rec->base) - 1);
+    if(recorder_segmented(rec))
+    {
+        snprintf(listName, sizeof(listName), "%s.seg", rec->base);
+        rec->list = fopen(listName, "a");
+        if(rec->list)
+            fprintf(rec->list, "# file start_ms duration_ms bytes frames\n");
+    }
+    //事件录像平时不开文件
+    if(rec->cfg.pre_time)
+    {
+        if(pre_init(&rec->pre, (rec->cfg.pre_size ? rec->cfg.pre_size : RECORDER_PRE_SIZE) * 1024 * 1024) < 0)
+        {
+            fprintf(stderr, "recorder: pre-event buffer %u MB err !\n", rec->cfg.pre_size);
+            goto err;
+        }
+        strcpy(rec->name, "(pre-event buffer)");
+    }
+    else if(recorder_new_segment(rec, 0) < 0)
+    {
+        fprintf(stderr, "recorder: open %s err !\n", rec->name);
+        goto err;
+    }
+    return rec;
+err:
+    if(rec->list)
+        fclose(rec->list);
+    free(rec);
+    return NULL;
+}
+
+int recorder_write(Recorder_Struct *rec, const unsigned char *frame, unsigned int len, unsigned long long ptsUs)
+{
+    struct iovec iov[2];
+    const unsigned char *nal;
+    int scLen, psIndex, irap, iovcnt = 0, i;
+    unsigned long long now;
+
+    scLen = h26x_start_code_len(frame, len);
+    if(len <= (unsigned int)scLen)
+        return 0;
+    nal = frame + scLen;
+    recorder_nal_type(rec, nal, &irap, &psIndex);
+
+    //缓存最新的参数集, 切段时补在新段开头
+    if(psIndex >= 0 && len - scLen <= RECORDER_PS_MAX)
+    {
+        memcpy(rec->ps[psIndex], nal, len - scLen);
+        rec->ps_len[psIndex] = len - scLen;
+    }
+
+    //事件录像: 没在录或已过了结束时间, 帧只进预录环
+    if(rec->cfg.pre_time)
+    {
+        now = wall_ms();
+        if(rec->recording && now >= rec->event_end)
+        {
+            recorder_end_segment(rec);
+            rec->recording = 0;
+        }
+        if(!rec->recording)
+        {
+            pre_push(&rec->pre, nal, len - scLen, irap, ptsUs, now, rec->cfg.pre_time * 1000ULL);
+            return 0;
+        }
+    }
+
+    if(irap && rec->fw && recorder_segmented(rec) && rec->seg_frames &&
+        ((rec->cfg.seg_time && wall_ms() - rec->seg_start >= rec->cfg.seg_time * 1000ULL) ||
+        (rec->cfg.seg_size && rec->fw->pos >= rec->cfg.seg_size * 1024ULL * 1024)))
+    {
+        recorder_end_segment(rec);
+        if(recorder_new_segment(rec, 0) < 0)
+        {
+            fprintf(stderr, "recorder: open %s err !\n", rec->name);
+            return -1;
+        }
+        for(i = 0; i < 3 && !rec->mux; i++)
+        {
+            if(rec->ps_len[i])
+                recorder_emit(rec, rec->ps[i], rec->ps_len[i], ptsUs);
+        }
+    }
+    //上次打开失败, 等下一个关键帧再试
+    if(!rec->fw)
+    {
+        if(!irap || recorder_new_segment(rec, 0) < 0)
+            return -1;
+    }
+
+    rec->seg_frames += 1;
+    if(rec->mux)
+        return recorder_emit(rec, nal, len - scLen, ptsUs);
+    recorder_index(rec, nal, scLen ? len : 4 + len, ptsUs);
+    if(scLen == 0)
+    {
+        iov[iovcnt].iov_base = start_code;
+        iov[iovcnt++].iov_len = 4;
+    }
+    iov[iovcnt].iov_base = (void *)frame;
+    iov[iovcnt++].iov_len = len;
+    return file_writer_writev(rec->fw, iov, iovcnt);
+}
+
+//先写参数集再写预录环里的帧, 写完清空
+static void recorder_write_pre(Recorder_Struct *rec)
+{
+    PreBuffer_Struct *pre = &rec->pre;
+    PreFrame_Struct *f;
+    unsigned int i;
+
+    //mp4 的参数集在开段时已交给复用器, 裸流的参数集用第一帧的时间记入索引
+    for(i = 0; i < 3 && !rec->mux; i++)
+    {
+        if(rec->ps_len[i])
+            recorder_emit(rec, rec->ps[i], rec->ps_len[i], pre->count ? pre->frame[pre->first].pts : 0);
+    }
+    for(i = 0; i < pre->count; i++)
+    {
+        f = &pre->frame[(pre->first + i) % RECORDER_PRE_FRAMES];
+        recorder_emit(rec, pre->data + f->offset, f->len, f->pts);
+    }
+    rec->seg_frames += pre->count;
+    pre_reset(pre);
+}
+
+int recorder_trigger(Recorder_Struct *rec)
+{
+    unsigned int bufSize = rec->cfg.buf_size ? rec->cfg.buf_size : FILE_WRITER_BUF_SIZE;
+
+    if(!rec->cfg.pre_time)
+        return -1;
+    rec->event_end = wall_ms() + rec->cfg.post_time * 1000ULL;
+    rec->events += 1;
+    if(rec->recording)
+        return 0;
+    //预录数据一次性交给异步写, 队列按数据量加深, 不会因为反压丢掉
+    if(recorder_new_segment(rec, rec->pre.bytes / bufSize + 2) < 0)
+    {
+        fprintf(stderr, "recorder: open %s err !\n", rec->name);
+        return -1;
+    }
+    recorder_write_pre(rec);
+    rec->recording = 1;
+    return 1;
+}
+
+void recorder_poll(Recorder_Struct *rec)
+{
+    if(rec->closing && !file_writer_busy(rec->closing))
+    {
+        file_writer_close(rec->closing);
+        rec->closing = NULL;
+    }
+    if(rec->recording && wall_ms() >= rec->event_end)
+    {
+        recorder_end_segment(rec);
+        rec->recording = 0;
+    }
+    rec->stalls = rec->stalls_closed;
+    rec->dropped = rec->dropped_closed;
+    if(!rec->fw)
+        return;
+    file_writer_poll(rec->fw);
+    key_index_flush(rec->idx);
+    rec->stalls += rec->fw->stalls;
+    rec->dropped += rec->fw->dropped;
+    if(rec->fw->inflight_max > rec->inflight_max)
+        rec->inflight_max = rec->fw->inflight_max;
+}
+
+void recorder_close(Recorder_Struct *rec)
+{
+    if(!rec)
+        return;
+    recorder_end_segment(rec);
+    if(rec->closing)
+        file_writer_close(rec->closing);
+    if(rec->list)
+        fclose(rec->list);
+    free(rec->pre.data);
+    free(rec->pre.frame);
+    free(rec->pending);
+    free(rec);
+}
@@ -0,0 +1,115 @@
+
+#ifndef _RECORDER_H_
+#define _RECORDER_H_
+
+#include <stdio.h>
+
+#include "file_writer.h"
+#include "fmp4_mux.h"
+#include "key_index.h"
+
+#define RECORDER_PS_MAX 512 //缓存的单个参数集最大长度
+#define RECORDER_PRE_SIZE 16 //预录缓冲默认大小 MB
+#define RECORDER_PRE_FRAMES 8192 //预录缓冲最多的帧数
+
+//录像参数, 由命令行填写
+typedef struct{
+    unsigned int buf_size; //写入器聚合缓冲
+    unsigned int flush_ms; //最长落盘间隔
+    unsigned int aio; //异步写队列深度, 0/同步写
+    int direct; //1/O_DIRECT
+    unsigned int seg_time; //分段时长 秒, 0/不按时间切
+    unsigned int seg_size; //分段大小 MB, 0/不按大小切
+    unsigned int pre_time; //事件录像: 预录秒数, 0/一直写文件
+    unsigned int pre_size; //事件录像: 预录缓冲 MB
+    unsigned int post_time; //事件录像: 最后一次触发后继续录的秒数
+    int mp4; //1/写分片mp4(fMP4), 0/写裸流
+}RecorderConfig_Struct;
+
+typedef struct{
+    unsigned int offset; //在 data 中的位置
+    unsigned int len; //NAL长度, 不含起始码
+    unsigned long long time; //收到的时间 ms
+    unsigned long long pts; //显示时间 us
+    int next_irap; //下一个关键帧的序号, -1/还没有
+    int irap;
+}PreFrame_Struct;
+
+//记下了但数据还在写入缓冲里的索引项: 块交出去写时才知道文件位置, 块被反压丢掉时作废
+typedef struct{
+    unsigned long long pos; //起始码在 fw->pos 计数里的序号
+    unsigned long long offset; //第一个字节所在块交出去时算出的文件位置
+    unsigned long long pts;
+    unsigned int len; //含起始码
+    unsigned char type;
+    unsigned char irap;
+    unsigned char broken; //有一部分被丢弃
+    unsigned char resv;
+}PendingIndex_Struct;
+
+//预录环: 预先分配, 帧数据连续存放(放不下时回到开头), 开头总是关键帧
+//  超过 pre_time 或空间不够时整组GOP淘汰
+typedef struct{
+    unsigned char *data;
+    unsigned int size;
+    unsigned int tail; //下一帧写入位置
+    PreFrame_Struct *frame; //帧描述环
+    unsigned int first; //最旧的帧
+    unsigned int count;
+    int last_irap; //最新关键帧的序号, -1/没有
+    unsigned long long bytes; //环内数据量
+    unsigned long long dropped; //太大放不下而丢的帧
+}PreBuffer_Struct;
+
+//录像: 裸流或分片mp4写文件, 可按时间/大小切成多段
+//  只在 IDR(h264 type 5)/IRAP(h265 type 16~21) 前切换, 新段开头补上缓存的 VPS/SPS/PPS, 每段都能单独解码
+//  分段时文件名为 base_00000.h264, 每段写完后在 base.seg 追加一行: 文件名 开始时间ms 时长ms 字节数 帧数
+//  裸流每段旁边有关键帧索引 base_00000.h264.idx (见 key_index.h)
+//  事件录像(pre_time>0)时平时只写内存预录环, recorder_trigger() 后新开一段, 先写预录的数据再接着录,
+//  最后一次触发 post_time 秒后结束该段, 回到预录
+typedef struct{
+    RecorderConfig_Struct cfg;
+    char base[128]; //不带后缀的文件名
+    int codec; //1/h264 2/h265
+    char name[160]; //当前写的文件
+    FileWriter_Struct *fw;
+    FileWriter_Struct *closing; //上一段, 等异步写完再关, 不阻塞事件循环
+    Fmp4Mux_Struct *mux; //mp4 模式下当前段的复用器
+    KeyIndex_Struct *idx; //裸流模式下当前段的关键帧索引 xxx.h264.idx
+    PendingIndex_Struct *pending; //还在写入缓冲里的索引项, 按 pos 递增
+    unsigned int pending_count;
+    unsigned int pending_size;
+    unsigned long long samples; //mp4: 已关闭分段写出的样本数
+    unsigned long long mux_errors;
+    int aio_mode; //file_writer_async() 的返回值
+    unsigned int seg_index;
+    unsigned long long seg_start; //本段开始时间 ms
+    unsigned int seg_frames;
+    FILE *list; //分段索引
+    unsigned char ps[3][RECORDER_PS_MAX]; //VPS/SPS/PPS, h264 不用 ps[0], 不含起始码
+    unsigned int ps_len[3];
+    PreBuffer_Struct pre;
+    int recording; //事件录像: 1/正在写文件
+    unsigned long long event_end; //事件录像: 结束时间 ms
+    unsigned int events;
+    //反压统计, 含已关闭的分段
+    unsigned long long stalls;
+    unsigned long long dropped;
+    unsigned int inflight_max;
+    unsigned long long stalls_closed;
+    unsigned long long dropped_closed;
+}Recorder_Struct;
+
+//return: NULL/打开文件失败
+Recorder_Struct *recorder_open(char *base, int codec, RecorderConfig_Struct *cfg);
+//写入一帧(一个NAL, 可带3/4字节起始码), ptsUs: 显示时间 微秒, 只有 mp4 用
+//  必要时先切段, return: 0/success -1/写文件出错
+int recorder_write(Recorder_Struct *rec, const unsigned char *frame, unsigned int len, unsigned long long ptsUs);
+//定时调用: 落盘超时的数据, 关闭已写完的上一段, 更新反压统计
+void recorder_poll(Recorder_Struct *rec);
+//事件触发, 只对事件录像有效, 录像中再触发则顺延结束时间
+//return: 1/开始录像 0/顺延 -1/不是事件录像或打开文件失败
+int recorder_trigger(Recorder_Struct *rec);
+void recorder_close(Recorder_Struct *rec);
+
+#endif
@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "rtsp_restream.h"
+
+//---------- 帧源: 从 Restream_Pro 的队列取NAL ----------
+
+class LiveFrameSource: public FramedSource {
+public:
+  static LiveFrameSource* createNew(UsageEnvironment& env, Restream_Pro* rs) {
+    return new LiveFrameSource(env, rs);
+  }
+  //队列里有NAL且下游在等时交出一个, return: true/交出
+  bool deliver(bool fromGetNextFrame);
+
+protected:
+  LiveFrameSource(UsageEnvironment& env, Restream_Pro* rs);
+  virtual ~LiveFrameSource();
+
+private:
+  virtual void doGetNextFrame();
+  static void afterDeliver(void* clientData);
+
+private:
+  Restream_Pro* fRs;
+  bool fPending;//已填好一帧, 等下一轮事件循环回调
+};
+
+LiveFrameSource::LiveFrameSource(UsageEnvironment& env, Restream_Pro* rs)
+  : FramedSource(env), fRs(rs), fPending(false)
+{
+  //新客户端从关键帧开始
+  pthread_mutex_lock(&fRs->lock);
+  fRs->source = this;
+  fRs->wait_key = true;
+  fRs->head = 0;
+  fRs->count = 0;
+  pthread_mutex_unlock(&fRs->lock);
+}
+
+LiveFrameSource::~LiveFrameSource()
+{
+  pthread_mutex_lock(&fRs->lock);
+  if(fRs->source == this)
+    fRs->source = NULL;
+  pthread_mutex_unlock(&fRs->lock);
+}
+
+void LiveFrameSource::doGetNextFrame()
+{
+  //没有数据时等 restream_push() 推进来
+  deliver(true);
+}
+
+bool LiveFrameSource::deliver(bool fromGetNextFrame)
+{
+  if(!isCurrentlyAwaitingData() || fPending)
+    return false;
+  pthread_mutex_lock(&fRs->lock);
+  if(fRs->count == 0)
+  {
+    pthread_mutex_unlock(&fRs->lock);
+    return false;
+  }
+  RestreamNal_Pro* nal = &fRs->queue[fRs->head];
+  if(nal->len > fMaxSize)
+  {
+    fFrameSize = fMaxSize;
+    fNumTruncatedBytes = nal->len - fMaxSize;
+  }
+  else
+  {
+    fFrameSize = nal->len;
+    fNumTruncatedBytes = 0;
+  }
+  memcpy(fTo, nal->data, fFrameSize);
+  fPresentationTime = nal->pts;
+  fDurationInMicroseconds = 0;
+  fRs->head = (fRs->head + 1) % RESTREAM_QUEUE;
+  fRs->count -= 1;
+  fRs->frames += 1;
+  //afterGetting() 会同步走到下一次 doGetNextFrame(), 不能拿着锁
+  pthread_mutex_unlock(&fRs->lock);
+  //在 doGetNextFrame() 里直接回调会递归, 放到下一轮事件循环
+  if(fromGetNextFrame)
+  {
+    fPending = true;
+    nextTask() = envir().taskScheduler().scheduleDelayedTask(0, afterDeliver, this);
+  }
+  else
+    FramedSource::afterGetting(this);
+  return true;
+}
+
+void LiveFrameSource::afterDeliver(void* clientData)
+{
+  LiveFrameSource* source = (LiveFrameSource*)clientData;
+  source->fPending = false;
+  FramedSource::afterGetting(source);
+}
+
+//---------- 子会话: 所有客户端共享一个源 ----------
+
+class LiveServerMediaSubsession: public OnDemandServerMediaSubsession {
+public:
+  static LiveServerMediaSubsession* createNew(UsageEnvironment& env, Restream_Pro* rs) {
+    return new LiveServerMediaSubsession(env, rs);
+  }
+
+protected:
+  LiveServerMediaSubsession(UsageEnvironment& env, Restream_Pro* rs)
+    : OnDemandServerMediaSubsession(env, True/*reuseFirstSource*/), fRs(rs) {}
+  virtual ~LiveServerMediaSubsession();
+
+  virtual FramedSource* createNewStreamSource(unsigned clientSessionId, unsigned& estBitrate);
+  virtual RTPSink* createNewRTPSink(Groupsock* rtpGroupsock, unsigned char rtpPayloadTypeIfDynamic,
+    FramedSource* inputSource);
+
+private:
+  Restream_Pro* fRs;//由本对象释放
+};
+
+static void restream_free(Restream_Pro *rs)
+{
+  unsigned int i;
+  for(i = 0; i < RESTREAM_QUEUE; i++)
+    free(rs->queue[i].data);
+  pthread_mutex_destroy(&rs->lock);
+  free(rs);
+}
+
+LiveServerMediaSubsession::~LiveServerMediaSubsession()
+{
+  restream_free(fRs);
+}
+
+FramedSource* LiveServerMediaSubsession::createNewStreamSource(unsigned /*clientSessionId*/, unsigned& estBitrate)
+{
+  estBitrate = 4000;//kbps, 只影响RTCP带宽估计
+  LiveFrameSource* source = LiveFrameSource::createNew(envir(), fRs);
+  //离散的NAL, 不用再找起始码
+  if(fRs->codec == 2)
+    return H265VideoStreamDiscreteFramer::createNew(envir(), source);
+  return H264VideoStreamDiscreteFramer::createNew(envir(), source);
+}
+
+RTPSink* LiveServerMediaSubsession::createNewRTPSink(Groupsock* rtpGroupsock, unsigned char rtpPayloadTypeIfDynamic,
+  FramedSource* /*inputSource*/)
+{
+  RTPSink* sink;
+  //已知参数集时直接写进SDP(sprop-parameter-sets), 否则客户端从码流里取; 参数集由收流线程更新, 拿着锁读
+  pthread_mutex_lock(&fRs->lock);
+  if(fRs->codec == 2)
+  {
+    if(fRs->ps_len[0] && fRs->ps_len[1] && fRs->ps_len[2])
+      sink = H265VideoRTPSink::createNew(envir(), rtpGroupsock, rtpPayloadTypeIfDynamic,
+        fRs->ps[0], fRs->ps_len[0], fRs->ps[1], fRs->ps_len[1], fRs->ps[2], fRs->ps_len[2]);
+    else
+      sink = H265VideoRTPSink::createNew(envir(), rtpGroupsock, rtpPayloadTypeIfDynamic);
+  }
+  else if(fRs->ps_len[1] && fRs->ps_len[2])
+    sink = H264VideoRTPSink::createNew(envir(), rtpGroupsock, rtpPayloadTypeIfDynamic,
+      fRs->ps[1], fRs->ps_len[1], fRs->ps[2], fRs->ps_len[2]);
+  else
+    sink = H264VideoRTPSink::createNew(envir(), rtpGroupsock, rtpPayloadTypeIfDynamic);
+  pthread_mutex_unlock(&fRs->lock);
+  return sink;
+}
+
+//---------- 服务器线程 ----------
+
+//唤醒服务器线程, 已经唤醒过还没处理时不再写
+static void restream_wake(RestreamServer_Pro *srv)
+{
+  unsigned long long one = 1;
+  if(__atomic_exchange_n(&srv->signaled, 1, __ATOMIC_ACQ_REL) == 0)
+  {
+    if(write(srv->efd, &one, sizeof(one)) < 0)
+      __atomic_store_n(&srv->signaled, 0, __ATOMIC_RELEASE);
+  }
+}
+
+//在服务器的事件循环里: 发布新加的, 删除要求删除的, 有新数据的交给客户端
+static void restream_handler(void *clientData, int /*mask*/)
+{
+  RestreamServer_Pro *srv = (RestreamServer_Pro*)clientData;
+  UsageEnvironment& env = srv->server->envir();
+  Restream_Pro **pp, *rs;
+  unsigned long long val;
+
+  if(read(srv->efd, &val, sizeof(val)) < 0)
+    val = 0;
+  //先清标志再处理, 处理期间推进来的数据会再唤醒一次
+  __atomic_store_n(&srv->signaled, 0, __ATOMIC_RELEASE);
+  pthread_mutex_lock(&srv->lock);
+  pp = &srv->list;
+  while((rs = *pp) != NULL)
+  {
+    if(rs->removed)
+    {
+      *pp = rs->next;
+      //子会话析构时释放 rs
+      if(rs->sms)
+        srv->server->deleteServerMediaSession(rs->sms);
+      else
+        restream_free(rs);
+      continue;
+    }
+    if(rs->sms == NULL)
+    {
+      rs->sms = ServerMediaSession::createNew(env, rs->name, rs->name, "rtspToH264 live");
+      rs->sms->addSubsession(LiveServerMediaSubsession::createNew(env, rs));
+      srv->server->addServerMediaSession(rs->sms);
+      char *url = srv->server->rtspURL(rs->sms);
+      env << "rtsp server: " << rs->name << " -> " << url << "\n";
+      delete[] url;
+    }
+    //source 只在本线程创建/删除
+    if(rs->source)
+      rs->source->deliver(false);
+    pp = &rs->next;
+  }
+  pthread_mutex_unlock(&srv->lock);
+}
+
+//---------- 接口 ----------
+
+RestreamServer_Pro *restream_server_create(UsageEnvironment& env, int port)
+{
+  RestreamServer_Pro *srv;
+  //一个IDR要整个放进RTPSink的输出缓冲再分片
+  OutPacketBuffer::increaseMaxSizeTo(RESTREAM_PACKET_MAX);
+  RTSPServer *server = RTSPServer::createNew(env, port);
+  if(server == NULL)
+  {
+    env << "rtsp server: port " << port << " err: " << env.getResultMsg() << "\n";
+    return NULL;
+  }
+  srv = (RestreamServer_Pro*)calloc(1, sizeof(RestreamServer_Pro));
+  if(srv == NULL || (srv->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+  {
+    env << "rtsp server: eventfd err\n";
+    free(srv);
+    Medium::close(server);
+    return NULL;
+  }
+  srv->server = server;
+  pthread_mutex_init(&srv->lock, NULL);
+  env.taskScheduler().turnOnBackgroundReadHandling(srv->efd, restream_handler, srv);
+  return srv;
+}
+
+Restream_Pro *restream_add(RestreamServer_Pro *srv, const char *name, int codec)
+{
+  if(srv == NULL)
+    return NULL;
+  Restream_Pro *rs = (Restream_Pro*)calloc(1, sizeof(Restream_Pro));
+  if(rs == NULL)
+    return NULL;
+  rs->codec = codec;
+  snprintf(rs->name, sizeof(rs->name), "%s", name);
+  pthread_mutex_init(&rs->lock, NULL);
+  rs->srv = srv;
+  pthread_mutex_lock(&srv->lock);
+  rs->next = srv->list;
+  srv->list = rs;
+  pthread_mutex_unlock(&srv->lock);
+  restream_wake(srv);
+  return rs;
+}
+
+static void restream_enqueue(Restream_Pro *rs, const unsigned char *nal, unsigned int len, struct timeval pts)
+{
+  RestreamNal_Pro *q;
+  //客户端太慢, 丢掉积压的数据, 从下一个关键帧重新开始
+  if(rs->count == RESTREAM_QUEUE)
+  {
+    rs->dropped += rs->count;
+    rs->head = 0;
+    rs->count = 0;
+    rs->wait_key = true;
+    return;
+  }
+  q = &rs->queue[(rs->head + rs->count) % RESTREAM_QUEUE];
+  if(q->size < len)
+  {
+    unsigned char *data = (unsigned char*)realloc(q->data, len);
+    if(data == NULL)
+      return;
+    q->data = data;
+    q->size = len;
+  }
+  memcpy(q->data, nal, len);
+  q->len = len;
+  q->pts = pts;
+  rs->count += 1;
+}
+
+void restream_push(Restream_Pro *rs, const unsigned char *nal, unsigned int len, struct timeval pts)
+{
+  int type, irap, psIndex = -1, i;
+
+  if(rs == NULL || len < 2)
+    return;
+  if(rs->codec == 2)
+  {
+    type = (nal[0] & 0x7E) >> 1;
+    irap = type >= 16 && type <= 21;
+    if(type >= 32 && type <= 34)
+      psIndex = type - 32;
+  }
+  else
+  {
+    type = nal[0] & 0x1F;
+    irap = type == 5;
+    if(type == 7 || type == 8)
+      psIndex = type - 6;
+  }
+  pthread_mutex_lock(&rs->lock);
+  //参数集一直缓存, 给SDP和新客户端用
+  if(psIndex >= 0 && len <= RESTREAM_PS_MAX)
+  {
+    memcpy(rs->ps[psIndex], nal, len);
+    rs->ps_len[psIndex] = len;
+  }
+  if(rs->source == NULL || (rs->wait_key && !irap))
+  {
+    pthread_mutex_unlock(&rs->lock);
+    return;
+  }
+  if(rs->wait_key)
+  {
+    //参数集在关键帧前统一补上
+    rs->wait_key = false;
+    for(i = 0; i < 3; i++)
+    {
+      if(rs->ps_len[i])
+        restream_enqueue(rs, rs->ps[i], rs->ps_len[i], pts);
+    }
+  }
+  restream_enqueue(rs, nal, len, pts);
+  pthread_mutex_unlock(&rs->lock);
+  //交给客户端在服务器线程里做
+  restream_wake(rs->srv);
+}
+
+void restream_remove(RestreamServer_Pro *srv, Restream_Pro *rs)
+{
+  if(srv == NULL || rs == NULL)
+    return;
+  pthread_mutex_lock(&srv->lock);
+  rs->removed = true;
+  pthread_mutex_unlock(&srv->lock);
+  restream_wake(srv);
+}
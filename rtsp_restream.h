@@ -0,0 +1,69 @@
+
+#ifndef _RTSP_RESTREAM_H_
+#define _RTSP_RESTREAM_H_
+
+#include <pthread.h>
+
+#include "liveMedia.hh"
+
+#define RESTREAM_PS_MAX 512
+#define RESTREAM_QUEUE 128 //客户端来不及取时缓存的NAL数, 满了清空并等下一个关键帧
+#define RESTREAM_PACKET_MAX (2*1024*1024) //RTPSink 输出缓冲, 要装得下最大的IDR
+
+class LiveFrameSource;
+class LiveServerMediaSubsession;
+
+typedef struct{
+  unsigned char *data;
+  unsigned int len;
+  unsigned int size;
+  struct timeval pts;
+}RestreamNal_Pro;
+
+struct RestreamServer;
+
+//一路转发: 收流的 DummySink 把NAL推进来, 有客户端时交给共享的 LiveFrameSource
+//  所有客户端共用一个源和一个RTPSink(reuseFirstSource), 不再向摄像机多开会话
+//  新的源从下一个关键帧开始, 前面补上缓存的参数集
+//  收流可以在任意事件循环线程, 队列由 lock 保护, live555 对象只在服务器所在的线程里操作
+typedef struct Restream{
+  int codec;//1/h264 2/h265
+  char name[32];
+  unsigned char ps[3][RESTREAM_PS_MAX];//VPS/SPS/PPS, h264 不用 ps[0]
+  unsigned int ps_len[3];
+  LiveFrameSource *source;//NULL/没有客户端
+  bool wait_key;
+  RestreamNal_Pro queue[RESTREAM_QUEUE];
+  unsigned int head;
+  unsigned int count;
+  unsigned long long frames;//已交给源的NAL数
+  unsigned long long dropped;//队列溢出丢掉的NAL数
+  pthread_mutex_t lock;
+
+  //以下由 RestreamServer_Pro 的 lock 保护
+  ServerMediaSession *sms;//NULL/还没在服务器线程里发布
+  bool removed;//已要求删除, 服务器线程里释放
+  struct Restream *next;
+  struct RestreamServer *srv;
+}Restream_Pro;
+
+//所有线程的流共用一个 RTSPServer, 挂在创建它的事件循环上
+//  其它线程的请求(发布/删除/新数据)通过 eventfd 唤醒该循环处理, triggerEvent 不会打断 select
+typedef struct RestreamServer{
+  RTSPServer *server;
+  int efd;
+  int signaled;//已写过 eventfd 还没处理, 合并唤醒
+  pthread_mutex_t lock;
+  Restream_Pro *list;
+}RestreamServer_Pro;
+
+//在 env 所在的线程(事件循环)里创建, port: 监听端口, return: NULL/端口被占用等
+RestreamServer_Pro *restream_server_create(UsageEnvironment& env, int port);
+//在 srv 上发布一路, name 为路径, 可在任意线程调用, 实际发布在服务器线程里完成并打印url, return: NULL/失败
+Restream_Pro *restream_add(RestreamServer_Pro *srv, const char *name, int codec);
+//推入一个NAL(不含起始码), pts: 收到的显示时间, 可在任意线程调用
+void restream_push(Restream_Pro *rs, const unsigned char *nal, unsigned int len, struct timeval pts);
+//断开该路所有客户端并删除, 可在任意线程调用, 之后不能再用 rs
+void restream_remove(RestreamServer_Pro *srv, Restream_Pro *rs);
+
+#endif
@@ -0,0 +1,248 @@
+
+/*
+ *  rtspToH264 的监管进程: 每路流一个子进程(真实pid), pidfd 等待退出, 异常退出按退避时间只重启那一路
+ *      配置文件每行是一路流传给 rtspToH264 的参数, # 开头为注释, 如:
+ *          rtsp://192.168.1.2/test1 -shm -shm_flag a
+ *          rtsp://192.168.1.3/test2 -shm -shm_flag b -f /data/test2
+ *      SIGHUP  : 重读配置, 只关掉删除的行、拉起新增的行, 没变的行不受影响
+ *      SIGUSR2 : 打印每路的 pid/重启次数/运行时间
+ *      SIGINT/SIGTERM : 关闭所有子进程后退出
+ *  单独重启某一路: kill -USR1 <该路pid>, 生产者落盘收尾后以 128+10 退出, 按退避时间拉起
+ *      不要用 kill <pid>(SIGTERM), 生产者不处理它, O_DIRECT 的尾巴和没写完的 mp4 分段会丢
+ *      只重连不重启进程: 给它的共享内存写 ctrl 1
+ *  子进程 exit 0 (共享内存 ctrl 2, 或者所有流都结束了) 视为正常结束, 不再拉起
+ *
+ *  用法: rtsp_supervisor -c streams.conf [-bin ./demo]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "supervisor.h"
+
+#define LINE_MAX_LEN 1024
+
+//配置中的一行和它对应的子进程
+typedef struct{
+    char line[LINE_MAX_LEN];
+    int id;
+}SupStream_Struct;
+
+static volatile int running = 1;
+static volatile int reload = 0;
+static volatile int status = 0;
+
+static char *binPath = (char *)"./demo";
+static char *confPath = NULL;
+static SupStream_Struct stream[SUPERVISOR_MAX];
+static int streamCount = 0;
+
+static void on_signal(int sig)
+{
+    if(sig == SIGHUP)
+        reload = 1;
+    else if(sig == SIGUSR2)
+        status = 1;
+    else
+        running = 0;
+}
+
+static void on_exit_callback(void *priv, int id, pid_t pid, int st, int delayMs)
+{
+    char reason[64];
+    if(st < 0)
+        snprintf(reason, sizeof(reason), "reaped elsewhere");
+    else if(WIFSIGNALED(st))
+        snprintf(reason, sizeof(reason), "signal %d", WTERMSIG(st));
+    else
+        snprintf(reason, sizeof(reason), "exit %d", WEXITSTATUS(st));
+    if(delayMs < 0)
+        printf("rtsp_supervisor: [%d] pid %d stopped (%s)\n", id, pid, reason);
+    else
+        printf("rtsp_supervisor: [%d] pid %d %s, restart in %d ms\n", id, pid, reason, delayMs);
+    fflush(stdout);
+}
+
+//去掉首尾空白, 空行和注释返回0
+static int conf_line(char *line)
+{
+    char *p = line, *end;
+    while(*p == ' ' || *p == '\t')
+        p++;
+    end = p + strlen(p);
+    while(end > p && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t'))
+        *--end = 0;
+    memmove(line, p, end - p + 1);
+    return line[0] && line[0] != '#';
+}
+
+static int stream_start(SupStream_Struct *s, Supervisor_Struct *sup)
+{
+    char buf[LINE_MAX_LEN], *argv[SUPERVISOR_ARGS + 1], *save = NULL, *tok;
+    int argc = 0;
+
+    memcpy(buf, s->line, sizeof(buf));
+    argv[argc++] = binPath;
+    for(tok = strtok_r(buf, " \t", &save); tok && argc < SUPERVISOR_ARGS; tok = strtok_r(NULL, " \t", &save))
+        argv[argc++] = tok;
+    argv[argc] = NULL;
+    s->id = supervisor_start(sup, argv);
+    if(s->id < 0)
+        printf("rtsp_supervisor: start '%s' err\n", s->line);
+    else
+        printf("rtsp_supervisor: [%d] pid %d %s\n", s->id, supervisor_pid(sup, s->id), s->line);
+    return s->id;
+}
+
+//按行比较新旧配置, 没变的行保留原来的子进程
+static int conf_load(Supervisor_Struct *sup)
+{
+    static SupStream_Struct next[SUPERVISOR_MAX];
+    char line[LINE_MAX_LEN];
+    int nextCount = 0, kept[SUPERVISOR_MAX] = {0}, i, j;
+    FILE *fp = fopen(confPath, "r");
+
+    if(fp == NULL)
+    {
+        printf("rtsp_supervisor: open %s err !\n", confPath);
+        return -1;
+    }
+    while(fgets(line, sizeof(line), fp) && nextCount < SUPERVISOR_MAX)
+    {
+        if(!conf_line(line))
+            continue;
+        snprintf(next[nextCount].line, LINE_MAX_LEN, "%s", line);
+        next[nextCount].id = -1;
+        for(j = 0; j < streamCount; j++)
+        {
+            //exit 0 结束的已被监管器释放, id 可能给了别人, 按新增处理
+            if(!kept[j] && stream[j].id >= 0 && supervisor_pid(sup, stream[j].id) >= 0 && strcmp(stream[j].line, line) == 0)
+            {
+                kept[j] = 1;
+                next[nextCount].id = stream[j].id;
+                break;
+            }
+        }
+        nextCount += 1;
+    }
+    fclose(fp);
+
+    //先关删掉的, 腾出 shm flag 等资源再拉新的
+    for(j = 0; j < streamCount; j++)
+    {
+        if(!kept[j] && stream[j].id >= 0 && supervisor_pid(sup, stream[j].id) >= 0)
+        {
+            printf("rtsp_supervisor: [%d] removed %s\n", stream[j].id, stream[j].line);
+            supervisor_stop(sup, stream[j].id);
+        }
+    }
+    for(i = 0; i < nextCount; i++)
+    {
+        if(next[i].id < 0)
+            stream_start(&next[i], sup);
+    }
+    memcpy(stream, next, nextCount * sizeof(SupStream_Struct));
+    streamCount = nextCount;
+    fflush(stdout);
+    return 0;
+}
+
+static void print_status(Supervisor_Struct *sup)
+{
+    unsigned long long now;
+    struct timespec ts;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    printf("  %-4s %8s %8s %10s  %s\n", "id", "pid", "restarts", "uptime_s", "args");
+    pthread_mutex_lock(&sup->lock);
+    for(i = 0; i < streamCount; i++)
+    {
+        SupWorker_Struct *w;
+        if(stream[i].id < 0)
+            continue;
+        w = &sup->worker[stream[i].id];
+        if(!w->used)
+        {
+            printf("  %-4d %8s %8s %10s  %s\n", stream[i].id, "-", "-", "exited", stream[i].line);
+            continue;
+        }
+        printf("  %-4d %8d %8u %10llu  %s\n", stream[i].id, w->pid, w->restarts,
+            w->pid ? (now - w->start_ms) / 1000 : 0, stream[i].line);
+    }
+    pthread_mutex_unlock(&sup->lock);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    Supervisor_Struct *sup;
+    struct sigaction sa;
+    sigset_t set, old;
+    int i;
+
+    for(i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            confPath = argv[++i];
+        else if(strcmp(argv[i], "-bin") == 0 && i + 1 < argc)
+            binPath = argv[++i];
+        else
+            break;
+    }
+    if(confPath == NULL || i < argc)
+    {
+        printf("Usage: %s -c streams.conf [-bin ./demo]\n", argv[0]);
+        printf("  one stream per line, the rest of the line is passed to the bin, e.g.\n");
+        printf("    rtsp://192.168.1.2/test1 -shm -shm_flag a\n");
+        printf("  SIGHUP reload (only changed lines are stopped/started), SIGUSR2 print status\n");
+        return 0;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+    //平时屏蔽, 只在 sigsuspend 里接收, 检查标志和睡下之间不会漏掉信号
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &set, &old);
+
+    sup = supervisor_create(on_exit_callback, NULL);
+    if(sup == NULL)
+        return 1;
+    if(conf_load(sup) < 0)
+    {
+        supervisor_destroy(sup);
+        return 1;
+    }
+    while(running)
+    {
+        sigsuspend(&old);
+        if(reload)
+        {
+            reload = 0;
+            printf("rtsp_supervisor: reload %s\n", confPath);
+            conf_load(sup);
+        }
+        if(status)
+        {
+            status = 0;
+            print_status(sup);
+        }
+    }
+    printf("rtsp_supervisor: stopping %d streams\n", streamCount);
+    fflush(stdout);
+    supervisor_destroy(sup);
+    return 0;
+}
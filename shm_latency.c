@@ -0,0 +1,247 @@
+
+/*
+ *  共享内存环形队列的端到端延迟统计: 挂成一个读者, 按槽头的时间信息分段统计
+ *      camera->recv  : 摄像机显示时间(RTCP同步后的墙上时钟)到生产者收到, 含编码/网络/组帧, 要求两边时钟都已对时
+ *      recv->publish : 生产者内部处理(分类/截断检查/拷进槽)
+ *      publish->read : 发布到本读者取到
+ *      camera->read  : 合计
+ *
+ *  样本放在固定大小的对数分桶里(每个2倍区间 LAT_SUB 格), 一直跑内存也不涨, 分位数误差 < 1/LAT_SUB, max/avg 是精确值
+ *
+ *  用法: shm_latency [-shm_path /tmp] [-shm_flag s] [-t 秒, 每隔多久输出一次] [-n 秒, 0/一直跑]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "shmem.h"
+
+#define LAT_STAGES 4
+#define LAT_SUB_BITS 5
+#define LAT_SUB (1 << LAT_SUB_BITS) //每个2倍区间的格数, 小于它的值一格一个数
+#define LAT_BUCKETS ((64 - LAT_SUB_BITS) * LAT_SUB)
+
+static const char *stage_name[LAT_STAGES] = {"camera->recv", "recv->publish", "publish->read", "camera->read"};
+
+//一组样本的直方图, 单位 us, 可能为负(两台机器时钟没对准), 负数按绝对值放在 neg
+typedef struct{
+    unsigned long long pos[LAT_BUCKETS];
+    unsigned long long neg[LAT_BUCKETS];
+    unsigned long long count;
+    long long sum, min, max;
+}LatSet_Struct;
+
+static volatile int running = 1;
+
+static void on_signal(int sig)
+{
+    running = 0;
+}
+
+static unsigned long long mono_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned long long real_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static unsigned int lat_bucket(unsigned long long v)
+{
+    int k;
+    if(v < LAT_SUB)
+        return (unsigned int)v;
+    k = 63 - __builtin_clzll(v);
+    return (k - LAT_SUB_BITS + 1) * LAT_SUB + (unsigned int)(v >> (k - LAT_SUB_BITS)) - LAT_SUB;
+}
+
+//该格的中间值
+static unsigned long long lat_value(unsigned int idx)
+{
+    int k;
+    if(idx < LAT_SUB)
+        return idx;
+    k = idx / LAT_SUB + LAT_SUB_BITS - 1;
+    return ((unsigned long long)(idx % LAT_SUB + LAT_SUB) << (k - LAT_SUB_BITS)) + (1ULL << (k - LAT_SUB_BITS)) / 2;
+}
+
+static void lat_add(LatSet_Struct *set, long long us)
+{
+    if(us < 0)
+        set->neg[lat_bucket(-(unsigned long long)us)] += 1;
+    else
+        set->pos[lat_bucket(us)] += 1;
+    if(set->count == 0 || us < set->min)
+        set->min = us;
+    if(set->count == 0 || us > set->max)
+        set->max = us;
+    set->sum += us;
+    set->count += 1;
+}
+
+//从最小(最负)的开始数: 先是 neg 从大到小, 再是 pos 从小到大, ms
+static double lat_pct(LatSet_Struct *set, int pct)
+{
+    unsigned long long rank = (set->count - 1) * pct / 100, n = 0;
+    long long v = set->max;
+    int i;
+
+    for(i = 0; i < 2 * LAT_BUCKETS && pct < 100; i++)
+    {
+        n += i < LAT_BUCKETS ? set->neg[LAT_BUCKETS - 1 - i] : set->pos[i - LAT_BUCKETS];
+        if(n > rank)
+        {
+            v = i < LAT_BUCKETS ? -(long long)lat_value(LAT_BUCKETS - 1 - i) : (long long)lat_value(i - LAT_BUCKETS);
+            break;
+        }
+    }
+    //格的中间值不超出实际的最小/最大值
+    if(v < set->min)
+        v = set->min;
+    if(v > set->max)
+        v = set->max;
+    return v / 1000.0;
+}
+
+static void lat_report(const char *title, LatSet_Struct *set, unsigned long long frames,
+    unsigned long long unsynced, unsigned long long drops)
+{
+    int i;
+
+    printf("%s: frames %llu drops %llu", title, frames, drops);
+    if(unsynced)
+        printf(" (%llu not RTCP synced, no camera time)", unsynced);
+    printf("\n");
+    printf("  %-14s %8s %8s %8s %8s %8s   ms\n", "stage", "p50", "p90", "p99", "max", "avg");
+    for(i = 0; i < LAT_STAGES; i++)
+    {
+        if(set[i].count == 0)
+        {
+            printf("  %-14s %8s\n", stage_name[i], "-");
+            continue;
+        }
+        printf("  %-14s %8.3f %8.3f %8.3f %8.3f %8.3f\n", stage_name[i],
+            lat_pct(&set[i], 50), lat_pct(&set[i], 90), lat_pct(&set[i], 99), lat_pct(&set[i], 100),
+            (double)set[i].sum / set[i].count / 1000);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    char shmPath[64] = "/tmp";
+    int shmFlag = 's', interval = 5, duration = 0, reader, len, i;
+    static LatSet_Struct win[LAT_STAGES], all[LAT_STAGES];
+    unsigned long long winFrames = 0, winUnsynced = 0, allFrames = 0, allUnsynced = 0, drops0, dropsLast;
+    unsigned long long start, last, now, real;
+    ShmFrameTime_Struct ft;
+    ShmRing_Struct *ring;
+    unsigned char *buf;
+
+    for(i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "-shm_path") == 0 && i + 1 < argc)
+            snprintf(shmPath, sizeof(shmPath), "%s", argv[++i]);
+        else if(strcmp(argv[i], "-shm_flag") == 0 && i + 1 < argc)
+            shmFlag = argv[++i][0];
+        else if(strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            interval = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            duration = atoi(argv[++i]);
+        else
+        {
+            printf("Usage: %s [-shm_path /tmp] [-shm_flag s] [-t report_s] [-n run_s]\n", argv[0]);
+            return 0;
+        }
+    }
+    if(interval < 1)
+        interval = 1;
+
+    ring = shm_ring_attach(shmPath, shmFlag, NULL);
+    if(ring == NULL)
+    {
+        fprintf(stderr, "shm_latency: no ring at %s '%c' (producer not running or older layout)\n", shmPath, shmFlag);
+        return 1;
+    }
+    reader = shm_ring_reader_open(ring);
+    if(reader < 0)
+    {
+        fprintf(stderr, "shm_latency: readers full\n");
+        return 1;
+    }
+    buf = (unsigned char *)malloc(ring->slot_size);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    printf("shm_latency: %s '%c' %s\n", shmPath, shmFlag, ring->url);
+
+    start = last = mono_us();
+    drops0 = dropsLast = ring->reader[reader].drops;
+    while(running)
+    {
+        if(shm_ring_wait(ring, reader, 200))
+        {
+            while((len = shm_ring_read_ts(ring, reader, buf, ring->slot_size, &ft)) != 0)
+            {
+                if(len < 0)
+                    continue;
+                //读到的时刻, 两个时钟连着取
+                now = mono_us();
+                real = real_us();
+                long long stage[LAT_STAGES] = {0};
+                stage[1] = (long long)(ft.publish_us - ft.recv_us);
+                stage[2] = (long long)(now - ft.publish_us);
+                winFrames += 1;
+                allFrames += 1;
+                if(ft.flags & SHM_FRAME_SYNCED)
+                {
+                    stage[3] = (long long)(real - ft.pts_us);
+                    stage[0] = stage[3] - (long long)(now - ft.recv_us);
+                }
+                else
+                {
+                    winUnsynced += 1;
+                    allUnsynced += 1;
+                }
+                for(i = 0; i < LAT_STAGES; i++)
+                {
+                    if((i == 0 || i == 3) && !(ft.flags & SHM_FRAME_SYNCED))
+                        continue;
+                    lat_add(&win[i], stage[i]);
+                    lat_add(&all[i], stage[i]);
+                }
+            }
+        }
+        now = mono_us();
+        if(now - last >= (unsigned long long)interval * 1000000)
+        {
+            lat_report("last", win, winFrames, winUnsynced, ring->reader[reader].drops - dropsLast);
+            dropsLast = ring->reader[reader].drops;
+            memset(win, 0, sizeof(win));
+            winFrames = winUnsynced = 0;
+            last = now;
+        }
+        if(duration > 0 && now - start >= (unsigned long long)duration * 1000000)
+            break;
+        if(!shm_ring_alive(ring))
+        {
+            fprintf(stderr, "shm_latency: producer exited\n");
+            break;
+        }
+    }
+    lat_report("total", all, allFrames, allUnsynced, ring->reader[reader].drops - drops0);
+
+    shm_ring_reader_close(ring, reader);
+    shm_ring_detach(ring);
+    free(buf);
+    return 0;
+}
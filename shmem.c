@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <signal.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
@@ -11,8 +13,14 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "shmem.h"
+#include "supervisor.h"
 
 int shm_create(char *path, int flag, int size, void **mem)
 {
@@ -45,33 +53,571 @@ int shm_destroy(int id)
 	return shmctl(id,IPC_RMID,NULL);
 }
 
+#define SHM_RING_ALIGN(x) (((x) + 63) & ~63UL)
+
+static unsigned long shm_ring_data_offset(unsigned int slot_count)
+{
+    return SHM_RING_ALIGN(sizeof(ShmRing_Struct) + slot_count * sizeof(ShmSlot_Struct));
+}
+
+static unsigned long shm_ring_size(unsigned int slot_count, unsigned int slot_size)
+{
+    return shm_ring_data_offset(slot_count) + (unsigned long)slot_count * slot_size;
+}
+
+static ShmSlot_Struct *shm_ring_slot(ShmRing_Struct *ring, unsigned long long seq)
+{
+    return (ShmSlot_Struct *)(ring + 1) + (seq & (ring->slot_count - 1));
+}
+
+static unsigned char *shm_ring_data(ShmRing_Struct *ring, unsigned long long seq)
+{
+    return (unsigned char *)ring + shm_ring_data_offset(ring->slot_count) +
+        (seq & (ring->slot_count - 1)) * ring->slot_size;
+}
+
+ShmRing_Struct *shm_ring_create(char *path, int flag, unsigned int slot_count, unsigned int slot_size, int *id)
+{
+    struct shmid_ds ds;
+    ShmRing_Struct *ring;
+    unsigned int count = 1;
+    unsigned long size;
+    int shmid, i;
+    key_t key = ftok(path, flag);
+    if(key < 0)
+    {
+        fprintf(stderr, "shm_ring_create: get key error\n");
+        return NULL;
+    }
+
+    //上限也是2的幂, 取整不会溢出
+    if(slot_count > SHM_RING_SLOTS_MAX)
+        slot_count = SHM_RING_SLOTS_MAX;
+    while(count < slot_count)
+        count <<= 1;
+    slot_size = SHM_RING_ALIGN(slot_size);
+    size = shm_ring_size(count, slot_size);
+
+    //已存在但尺寸不符(旧版单帧结构或不同配置),删掉重建
+    shmid = shmget(key, 0, 0666);
+    if(shmid >= 0 && shmctl(shmid, IPC_STAT, &ds) == 0 && ds.shm_segsz != size)
+    {
+        shm_destroy(shmid);
+        shmid = -1;
+    }
+    if(shmid < 0)
+        shmid = shmget(key, size, IPC_CREAT|0666);
+    if(shmid < 0)
+    {
+        fprintf(stderr, "shm_ring_create: get id error\n");
+        return NULL;
+    }
+
+    ring = (ShmRing_Struct *)shmat(shmid, NULL, 0);
+    if(ring == (ShmRing_Struct *)-1)
+    {
+        fprintf(stderr, "shm_ring_create: shmat error\n");
+        return NULL;
+    }
+
+    //复用同尺寸的旧段时保留已挂载的读者, 帧序号从0重新开始
+    memset(ring, 0, offsetof(ShmRing_Struct, reader));
+    memset(ring + 1, 0, count * sizeof(ShmSlot_Struct));
+    for(i = 0; i < SHM_RING_READERS; i++)
+        ring->reader[i].cursor = 0;
+    ring->slot_count = count;
+    ring->slot_size = slot_size;
+    ring->slot_hdr = sizeof(ShmSlot_Struct);
+    ring->producer = getpid();
+    __atomic_store_n(&ring->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+
+    if(id)
+        *id = shmid;
+    return ring;
+}
+
+ShmRing_Struct *shm_ring_attach(char *path, int flag, int *id)
+{
+    ShmRing_Struct *ring;
+    int shmid;
+    key_t key = ftok(path, flag);
+    if(key < 0)
+        return NULL;
+    if((shmid = shmget(key, 0, 0666)) < 0)
+        return NULL;
+
+    ring = (ShmRing_Struct *)shmat(shmid, NULL, 0);
+    if(ring == (ShmRing_Struct *)-1)
+        return NULL;
+    //旧版生产者的槽头没有时间信息, 布局不同
+    if(__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != SHM_RING_MAGIC ||
+        ring->slot_hdr != sizeof(ShmSlot_Struct))
+    {
+        shmdt(ring);
+        return NULL;
+    }
+
+    if(id)
+        *id = shmid;
+    return ring;
+}
+
+void shm_ring_detach(ShmRing_Struct *ring)
+{
+    if(ring)
+        shmdt(ring);
+}
+
+//共享内存跨进程使用, 不能用 FUTEX_PRIVATE_FLAG
+static int futex_wait(unsigned int *addr, unsigned int val, int timeoutMs)
+{
+    struct timespec ts;
+    if(timeoutMs < 0)
+        return syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+    ts.tv_sec = timeoutMs / 1000;
+    ts.tv_nsec = (timeoutMs % 1000) * 1000000;
+    return syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void futex_wake(unsigned int *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static int pid_alive(int pid)
+{
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+int shm_ring_alive(ShmRing_Struct *ring)
+{
+    return ring && pid_alive(ring->producer);
+}
+
+unsigned char *shm_ring_reserve(ShmRing_Struct *ring, unsigned int *maxLen)
+{
+    unsigned long long head = ring->head;
+    ShmSlot_Struct *slot = shm_ring_slot(ring, head);
+
+    //不等读者, 直接占用最旧的槽; 写入期间标记 WRITING, 读者据此发现被覆盖
+    __atomic_store_n(&slot->seq, head | SHM_RING_WRITING, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if(maxLen)
+        *maxLen = ring->slot_size;
+    return shm_ring_data(ring, head);
+}
+
+static unsigned long long shm_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void shm_ring_publish(ShmRing_Struct *ring, unsigned int len)
+{
+    shm_ring_publish_ts(ring, len, NULL);
+}
+
+void shm_ring_publish_ts(ShmRing_Struct *ring, unsigned int len, const ShmFrameTime_Struct *time)
+{
+    unsigned long long head = ring->head;
+    ShmSlot_Struct *slot = shm_ring_slot(ring, head);
+
+    //时间信息和长度一样在 WRITING 期间写, 读者按 seq 核对
+    if(time)
+        slot->time = *time;
+    else
+        memset(&slot->time, 0, sizeof(slot->time));
+    slot->time.publish_us = shm_now_us();
+    slot->len = len;
+    __atomic_store_n(&slot->seq, head, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&ring->notify, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&ring->waiters, __ATOMIC_SEQ_CST))
+        futex_wake(&ring->notify);
+}
+
+int shm_ring_write(ShmRing_Struct *ring, unsigned char *data, unsigned int len)
+{
+    return shm_ring_write_ts(ring, data, len, NULL);
+}
+
+int shm_ring_write_ts(ShmRing_Struct *ring, unsigned char *data, unsigned int len, const ShmFrameTime_Struct *time)
+{
+    if(len > ring->slot_size)
+    {
+        __atomic_add_fetch(&ring->oversize, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    memcpy(shm_ring_reserve(ring, NULL), data, len);
+    shm_ring_publish_ts(ring, len, time);
+    return 0;
+}
+
+int shm_ring_reader_open(ShmRing_Struct *ring)
+{
+    ShmReader_Struct *rd;
+    int i, pid;
+
+    for(i = 0; i < SHM_RING_READERS; i++)
+    {
+        rd = &ring->reader[i];
+        pid = __atomic_load_n(&rd->pid, __ATOMIC_ACQUIRE);
+        //空闲或原进程已退出的位置都可以占用
+        if(pid && pid_alive(pid))
+            continue;
+        if(!__atomic_compare_exchange_n(&rd->pid, &pid, (int)getpid(), 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            continue;
+        rd->frames = rd->drops = 0;
+        rd->lag = rd->lag_max = 0;
+        __atomic_store_n(&rd->cursor, __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+        return i;
+    }
+    return -1;
+}
+
+void shm_ring_reader_close(ShmRing_Struct *ring, int reader)
+{
+    if(reader >= 0 && reader < SHM_RING_READERS)
+        __atomic_store_n(&ring->reader[reader].pid, 0, __ATOMIC_RELEASE);
+}
+
+//统一处理游标越界: 生产者重启(cursor > head)或落后超过一圈
+static unsigned long long shm_ring_resync(ShmRing_Struct *ring, ShmReader_Struct *rd,
+    unsigned long long cursor, unsigned long long head)
+{
+    if(cursor > head)
+        return head;
+    //head 所在槽可能正被写, 最旧的可读帧是 head - slot_count + 1
+    if(head - cursor >= ring->slot_count)
+    {
+        rd->drops += head - cursor - (ring->slot_count - 1);
+        cursor = head - (ring->slot_count - 1);
+    }
+    return cursor;
+}
+
+static void shm_ring_lag(ShmReader_Struct *rd, unsigned long long lag)
+{
+    rd->lag = lag;
+    if(lag > rd->lag_max)
+        rd->lag_max = lag;
+}
+
+int shm_ring_read(ShmRing_Struct *ring, int reader, unsigned char *data, unsigned int dataMaxLen)
+{
+    return shm_ring_read_ts(ring, reader, data, dataMaxLen, NULL);
+}
+
+int shm_ring_read_ts(ShmRing_Struct *ring, int reader, unsigned char *data, unsigned int dataMaxLen,
+    ShmFrameTime_Struct *time)
+{
+    ShmReader_Struct *rd = &ring->reader[reader];
+    unsigned long long cursor = rd->cursor, head;
+    ShmSlot_Struct *slot;
+    unsigned int len;
+    int ret;
+
+    while(1)
+    {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        cursor = shm_ring_resync(ring, rd, cursor, head);
+        if(cursor == head)
+        {
+            ret = 0;
+            break;
+        }
+
+        slot = shm_ring_slot(ring, cursor);
+        if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != cursor)
+        {
+            rd->drops += 1;
+            cursor += 1;
+            continue;
+        }
+        len = slot->len;
+        if(len <= dataMaxLen)
+            memcpy(data, shm_ring_data(ring, cursor), len);
+        if(time)
+            *time = slot->time;
+        //拷贝完再核对一次, 期间被覆盖则丢掉这帧
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != cursor)
+        {
+            rd->drops += 1;
+            cursor += 1;
+            continue;
+        }
+
+        shm_ring_lag(rd, head - cursor);
+        cursor += 1;
+        if(len > dataMaxLen)
+            ret = -1;
+        else
+        {
+            rd->frames += 1;
+            ret = len;
+        }
+        break;
+    }
+    __atomic_store_n(&rd->cursor, cursor, __ATOMIC_RELEASE);
+    return ret;
+}
+
+unsigned int shm_ring_drain(ShmRing_Struct *ring, int reader, ShmRing_Callback callback, void *priv, unsigned int max)
+{
+    ShmReader_Struct *rd = &ring->reader[reader];
+    unsigned long long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long long cursor = shm_ring_resync(ring, rd, rd->cursor, head);
+    ShmSlot_Struct *slot;
+    unsigned int count = 0;
+
+    shm_ring_lag(rd, head - cursor);
+    if(max && head - cursor > max)
+        head = cursor + max;
+    for(; cursor < head; cursor++)
+    {
+        slot = shm_ring_slot(ring, cursor);
+        if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != cursor)
+        {
+            rd->drops += 1;
+            continue;
+        }
+        callback(priv, shm_ring_data(ring, cursor), slot->len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != cursor)
+        {
+            rd->drops += 1;
+            continue;
+        }
+        rd->frames += 1;
+        count += 1;
+    }
+    __atomic_store_n(&rd->cursor, cursor, __ATOMIC_RELEASE);
+    return count;
+}
+
+int shm_ring_wait(ShmRing_Struct *ring, int reader, int timeoutMs)
+{
+    unsigned long long cursor = __atomic_load_n(&ring->reader[reader].cursor, __ATOMIC_RELAXED);
+    unsigned int val = __atomic_load_n(&ring->notify, __ATOMIC_SEQ_CST);
+    int ret = 1;
+
+    if(__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != cursor)
+        return ret;
+    //先登记再复查 head, 保证与生产者的 notify/waiters 不会错过彼此
+    __atomic_add_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == cursor)
+    {
+        while(futex_wait(&ring->notify, val, timeoutMs) < 0 && errno == EINTR)
+            ;
+        ret = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != cursor;
+    }
+    __atomic_sub_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+    return ret;
+}
+
+void shm_ring_ctrl(ShmRing_Struct *ring, unsigned int ctrl)
+{
+    __atomic_store_n(&ring->ctrl, ctrl, __ATOMIC_SEQ_CST);
+    futex_wake(&ring->ctrl);
+}
+
+unsigned int shm_ring_ctrl_wait(ShmRing_Struct *ring, int timeoutMs)
+{
+    unsigned int ctrl = __atomic_load_n(&ring->ctrl, __ATOMIC_ACQUIRE);
+    if(ctrl == 0)
+    {
+        futex_wait(&ring->ctrl, 0, timeoutMs);
+        ctrl = __atomic_load_n(&ring->ctrl, __ATOMIC_ACQUIRE);
+    }
+    return ctrl;
+}
+
+#define PRODUCER_PATH "/tmp"
+//每路流一个 ftok(PRODUCER_PATH, flag), 's' 放最前面, 只拉一路时与旧的消费者兼容
+#define PRODUCER_FLAGS "sabcdefghijklmnopqrtuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"
+
+//本进程拉起的生产者: 第一次的pid(调用者手里的)和它用的 flag
+typedef struct{
+    pid_t pid;
+    int flag;
+    char url[256];
+}ProducerMap_Struct;
+
+//本进程拉起的生产者都挂在这个监管器上, 异常退出后按退避重新拉起
+static Supervisor_Struct *producer_sup = NULL;
+static ProducerMap_Struct producer_map[SUPERVISOR_MAX];
+static pthread_mutex_t producer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void producer_exit_callback(void *priv, int id, pid_t pid, int status, int delayMs)
+{
+    if(delayMs >= 0)
+        fprintf(stderr, "rtspToH264: pid %d exit status 0x%x, restart in %d ms\n", pid, status, delayMs);
+}
+
+//按url找已在跑的生产者(*running 为它的pid), 没有时分配一个没人用的 flag
+//  别的程序占着的段(如统计页)和本进程刚拉起还没建好队列的 flag 都不算空闲
+//return: flag 0/没有空闲的
+static int producer_flag(char *url, pid_t *running)
+{
+    const char *p;
+    int freeFlag = 0, used, i;
+
+    *running = 0;
+    for(p = PRODUCER_FLAGS; *p; p++)
+    {
+        ShmRing_Struct *ring = shm_ring_attach((char *)PRODUCER_PATH, *p, NULL);
+        used = 0;
+        if(ring)
+        {
+            used = shm_ring_alive(ring);
+            if(used && strcmp(ring->url, url) == 0)
+                *running = ring->producer;
+            shm_ring_detach(ring);
+        }
+        else
+        {
+            key_t key = ftok(PRODUCER_PATH, *p);
+            used = key >= 0 && shmget(key, 0, 0666) >= 0;
+        }
+        for(i = 0; i < SUPERVISOR_MAX && !*running; i++)
+        {
+            if(producer_map[i].pid && producer_map[i].flag == *p)
+            {
+                used = 1;
+                if(strcmp(producer_map[i].url, url) == 0)
+                    *running = producer_map[i].pid;
+            }
+        }
+        if(*running)
+            return *p;
+        if(!used && !freeFlag)
+            freeFlag = *p;
+    }
+    return freeFlag;
+}
+
 pid_t process_rtspToH264(char *filePath, char *url)
 {
-    // pid_t pid;
-    // if(!filePath || !url)
-    //     return 0;
-    // pid = fork();
-    // if(pid < 0)
-    //     return 0;
-    // else if(pid == 0) //child process
-    // {
-    //     execl(filePath, "rtspToH264", url, 
-    //         "-shm", (char *)0);
-    //     _exit(127);
-    // }
-    // return pid;
-
-    pid_t pid = 10086;
-    char cmd[128] = {0};
-    snprintf(cmd, 128, "%s %s -shm &", filePath, url);
-    system(cmd);
+    char flag[2] = {0};
+    char *argv[] = {filePath, url, (char *)"-shm", (char *)"-shm_path", (char *)PRODUCER_PATH,
+        (char *)"-shm_flag", flag, NULL};
+    pid_t pid = 0;
+    int id, i;
+
+    if(!filePath || !url)
+        return 0;
+
+    pthread_mutex_lock(&producer_lock);
+    //同一路流已有生产者在跑, 直接复用, 消费者各自 shm_ring_reader_open 挂载
+    flag[0] = producer_flag(url, &pid);
+    if(pid || !flag[0])
+    {
+        if(!flag[0])
+            fprintf(stderr, "process_rtspToH264: no free shm flag for %s\n", url);
+        pthread_mutex_unlock(&producer_lock);
+        return pid;
+    }
+    if(producer_sup == NULL)
+        producer_sup = supervisor_create(producer_exit_callback, NULL);
+    if((id = supervisor_start(producer_sup, argv)) >= 0)
+    {
+        pid = supervisor_pid(producer_sup, id);
+        for(i = 0; i < SUPERVISOR_MAX; i++)
+        {
+            if(producer_map[i].pid == 0)
+            {
+                producer_map[i].pid = pid;
+                producer_map[i].flag = flag[0];
+                snprintf(producer_map[i].url, sizeof(producer_map[i].url), "%s", url);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&producer_lock);
     return pid;
 }
 
+//pid 对应的队列: 本进程拉起的按记下的 flag, 复用别人的按队列里的生产者pid, 要持有 producer_lock
+//return: flag 0/没找到, *map 为 producer_map 下标 -1/不是本进程拉起的
+static int producer_find(pid_t pid, int *map)
+{
+    const char *p;
+    int i;
+
+    *map = -1;
+    for(i = 0; i < SUPERVISOR_MAX; i++)
+    {
+        if(producer_map[i].pid == pid)
+        {
+            *map = i;
+            return producer_map[i].flag;
+        }
+    }
+    for(p = PRODUCER_FLAGS; *p; p++)
+    {
+        ShmRing_Struct *ring = shm_ring_attach((char *)PRODUCER_PATH, *p, NULL);
+        int found = ring && ring->producer == pid;
+        shm_ring_detach(ring);
+        if(found)
+            return *p;
+    }
+    return 0;
+}
+
+int process_rtspToH264_flag(pid_t pid)
+{
+    int flag, map;
+    if(pid <= 0)
+        return 0;
+    pthread_mutex_lock(&producer_lock);
+    flag = producer_find(pid, &map);
+    pthread_mutex_unlock(&producer_lock);
+    return flag;
+}
+
 void process_rtspToH264_close(pid_t pid)
 {
-    if(pid)
-        system("killall -10 rtspToH264");
+    ShmRing_Struct *ring = NULL;
+    int flag, map, id, i;
+
+    if(pid <= 0)
+        return;
+
+    pthread_mutex_lock(&producer_lock);
+    flag = producer_find(pid, &map);
+    if(flag)
+        ring = shm_ring_attach((char *)PRODUCER_PATH, flag, NULL);
+
+    //还有其它读者挂载时不关闭生产者
+    if(ring)
+    {
+        int readers = 0;
+        for(i = 0; i < SHM_RING_READERS; i++)
+        {
+            int rpid = ring->reader[i].pid;
+            if(rpid && rpid != getpid() && pid_alive(rpid))
+                readers += 1;
+        }
+        shm_ring_detach(ring);
+        if(readers)
+        {
+            pthread_mutex_unlock(&producer_lock);
+            return;
+        }
+    }
+
+    //只关这一个pid: 本进程拉起的交给监管器(不再重启), 复用别人的就直接发信号
+    if(map >= 0)
+        memset(&producer_map[map], 0, sizeof(ProducerMap_Struct));
+    pthread_mutex_unlock(&producer_lock);
+    if((id = supervisor_find(producer_sup, pid)) >= 0)
+        supervisor_stop(producer_sup, id);
+    else
+        kill(pid, SIGUSR1);
 }
 
 pid_t process_open(char *cmd)
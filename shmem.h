@@ -4,22 +4,125 @@
 
 #include <sys/types.h>
 
+#define SHM_RING_MAGIC 0x474E4952 //"RING"
+#define SHM_RING_SLOTS 8 //默认槽数,必须是2的幂
+#define SHM_RING_SLOTS_MAX 4096 //槽数上限, 超过时按上限创建
+#define SHM_RING_SLOT_SIZE 524288 //默认每槽数据容量 512*1024
+#define SHM_RING_READERS 16 //最多同时挂载的读者数
+#define SHM_RING_WRITING (1ULL << 63) //seq最高位: 生产者正在写该槽
+
+#define SHM_FRAME_SYNCED 0x1 //pts_us 已经过RTCP同步, 与摄像机的墙上时钟一致
+
+//帧的时间信息, 随帧一起发布, 用来分段统计从摄像机到读者的延迟
+typedef struct{
+    unsigned int rtp_ts; //RTP时间戳
+    unsigned int flags; //SHM_FRAME_SYNCED
+    unsigned long long pts_us; //显示时间, 墙上时钟(gettimeofday) us, 未同步时是收到第一个包时的本地时间推算的
+    unsigned long long recv_us; //生产者收到该帧 CLOCK_MONOTONIC us
+    unsigned long long publish_us; //发布 CLOCK_MONOTONIC us, 由 shm_ring_publish 填
+}ShmFrameTime_Struct;
+
+//每个槽的头信息,数据区紧跟在槽表之后
+typedef struct{
+    unsigned long long seq; //本槽当前承载的帧序号, 写入期间带 SHM_RING_WRITING
+    unsigned int len; //帧长度
+    unsigned int resv;
+    ShmFrameTime_Struct time;
+}ShmSlot_Struct;
+
+//读者: 各自的读游标和统计, pid 为0表示空闲
+typedef struct{
+    int pid;
+    unsigned int resv;
+    unsigned long long cursor; //下一个要读的帧序号
+    unsigned long long frames; //已读帧数
+    unsigned long long drops; //落后太多被覆盖而丢掉的帧数
+    unsigned long long lag; //最近一次读取时落后的帧数
+    unsigned long long lag_max;
+}__attribute__((aligned(64))) ShmReader_Struct;
+
+//共享内存环形队列(单生产者/多读者)
+//  内存布局: [ShmRing_Struct][ShmSlot_Struct * slot_count][data: slot_size * slot_count]
+//  head 由生产者写, 每个读者持有独立游标, head - cursor 即该读者落后的帧数
+//  生产者从不等待读者, 落后超过 slot_count 的读者会跳到最旧的有效帧并累加 drops
 typedef struct{
-    unsigned char ctrl;
-    unsigned char type;
-    unsigned char width[2];
-    unsigned char height[2];
+    unsigned int magic;
+    unsigned int slot_count;
+    unsigned int slot_size;
+    unsigned int ctrl; //0/free 1/restart 2/exit 3/event(事件录像触发)
+    unsigned char type; //0/unknow 1/h264 2/h265
     unsigned char fps;
-    unsigned char ready;
-    unsigned char order;
-    unsigned char len[4];
-    unsigned char data[524275];
-}ShmData_Struct;
+    unsigned short width;
+    unsigned short height;
+    unsigned short slot_hdr; //sizeof(ShmSlot_Struct), 与读者不一致时拒绝挂载
+    int producer; //生产者pid
+    char url[256]; //生产者拉取的地址, 用于多个消费者复用同一路流
+    unsigned int fps_milli; //精确帧率*1000, 如 29970
+    unsigned char profile; //profile_idc
+    unsigned char level; //level_idc
+    unsigned char chroma_format; //chroma_format_idc
+    unsigned char bit_depth; //亮度位深
+    unsigned char num_reorder; //解码输出最多延后的帧数
+    unsigned char max_dpb; //解码需要缓存的帧数
+    unsigned short resv2;
+    unsigned long long head __attribute__((aligned(64))); //已发布的帧数
+    unsigned long long oversize; //超过slot_size丢弃的帧数
+    unsigned int notify; //futex: 每发布一帧加1
+    unsigned int waiters; //阻塞在 notify 上的读者数, 为0时生产者不做唤醒系统调用
+    unsigned long long truncated; //超过生产者接收缓冲(或零拷贝时的槽)被截断的帧数, 截断帧和之后到关键帧的帧都不发布
+    ShmReader_Struct reader[SHM_RING_READERS];
+}ShmRing_Struct;
+
+//ctrl 同样是 futex 字, 用 shm_ring_ctrl() 写入可立即唤醒生产者
+
+//批量取帧回调: data 直接指向共享内存, 不拷贝
+typedef void (*ShmRing_Callback)(void *priv, unsigned char *data, unsigned int len);
 
 int shm_create(char *path, int flag, int size, void **mem);
 int shm_destroy(int id);
 
+//生产者: 创建(或按新尺寸重建)环形队列, slot_count 会向上取整为2的幂
+ShmRing_Struct *shm_ring_create(char *path, int flag, unsigned int slot_count, unsigned int slot_size, int *id);
+//消费者: 挂载已存在的环形队列
+ShmRing_Struct *shm_ring_attach(char *path, int flag, int *id);
+void shm_ring_detach(ShmRing_Struct *ring);
+//return: 1/生产者进程仍在运行
+int shm_ring_alive(ShmRing_Struct *ring);
+
+//return: 0/success -1/帧过长(已计入oversize)
+int shm_ring_write(ShmRing_Struct *ring, unsigned char *data, unsigned int len);
+//带时间信息写入, time 为NULL时只填发布时间
+int shm_ring_write_ts(ShmRing_Struct *ring, unsigned char *data, unsigned int len, const ShmFrameTime_Struct *time);
+//零拷贝写: 先取下一个槽的数据区直接填充, 填完再发布, 两次调用之间不能再写其它帧
+unsigned char *shm_ring_reserve(ShmRing_Struct *ring, unsigned int *maxLen);
+void shm_ring_publish(ShmRing_Struct *ring, unsigned int len);
+void shm_ring_publish_ts(ShmRing_Struct *ring, unsigned int len, const ShmFrameTime_Struct *time);
+
+//注册读者, 从当前最新帧开始读, return: 读者序号 -1/读者已满
+int shm_ring_reader_open(ShmRing_Struct *ring);
+void shm_ring_reader_close(ShmRing_Struct *ring, int reader);
+//拷贝取帧, 读取期间被覆盖的帧会被丢弃重试
+//return: >0 帧长度 0/无新帧 -1/dataMaxLen不足(该帧被跳过)
+int shm_ring_read(ShmRing_Struct *ring, int reader, unsigned char *data, unsigned int dataMaxLen);
+//同上, 同时取出该帧的时间信息
+int shm_ring_read_ts(ShmRing_Struct *ring, int reader, unsigned char *data, unsigned int dataMaxLen,
+    ShmFrameTime_Struct *time);
+//一次取走最多 max 帧(max为0时不限), return: 处理的帧数
+//  回调期间若生产者追上并覆盖该槽, 返回后计入 drops, 要求数据绝对完整时用 shm_ring_read
+unsigned int shm_ring_drain(ShmRing_Struct *ring, int reader, ShmRing_Callback callback, void *priv, unsigned int max);
+//阻塞直到该读者有新帧, timeoutMs<0 时一直等, return: 1/有新帧 0/超时
+int shm_ring_wait(ShmRing_Struct *ring, int reader, int timeoutMs);
+
+//消费者: 发送控制命令并唤醒生产者
+void shm_ring_ctrl(ShmRing_Struct *ring, unsigned int ctrl);
+//生产者: 阻塞等待控制命令, return: 命令值 0/超时
+unsigned int shm_ring_ctrl_wait(ShmRing_Struct *ring, int timeoutMs);
+
+//拉起(或复用已在跑的)生产者, 每路url用自己的 ftok("/tmp", flag), return: pid 0/失败
 pid_t process_rtspToH264(char *filePath, char *url);
+//该生产者的队列用的 flag, 消费者用 shm_ring_attach("/tmp", flag) 挂载, return: 0/没找到
+int process_rtspToH264_flag(pid_t pid);
+//没有其它读者时只关闭这一个生产者
 void process_rtspToH264_close(pid_t pid);
 pid_t process_open(char *cmd);
 void process_close(pid_t *pid);
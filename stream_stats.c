@@ -0,0 +1,389 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/shm.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "shmem.h"
+#include "stream_stats.h"
+
+unsigned long long stats_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+StatsPage_Struct *stats_page_create(char *path, int flag, unsigned int count, int *id)
+{
+    StatsPage_Struct *page = NULL;
+    unsigned int size = sizeof(StatsPage_Struct) + count * sizeof(StreamStats_Struct);
+
+    *id = -1;
+    if(path && path[0])
+    {
+        void *mem = NULL;
+        *id = shm_create(path, flag, size, &mem);
+        if(*id < 0 || mem == (void *)-1)
+            return NULL;
+        //旧的统计页比现在小时重建
+        struct shmid_ds ds;
+        if(shmctl(*id, IPC_STAT, &ds) == 0 && ds.shm_segsz < size)
+        {
+            shmdt(mem);
+            shm_destroy(*id);
+            *id = shm_create(path, flag, size, &mem);
+            if(*id < 0 || mem == (void *)-1)
+                return NULL;
+        }
+        page = (StatsPage_Struct *)mem;
+    }
+    else
+    {
+        page = (StatsPage_Struct *)malloc(size);
+        if(page == NULL)
+            return NULL;
+    }
+    memset(page, 0, size);
+    page->magic = STREAM_STATS_MAGIC;
+    page->version = STREAM_STATS_VERSION;
+    page->size = sizeof(StreamStats_Struct);
+    page->count = count;
+    page->producer = getpid();
+    return page;
+}
+
+void stats_page_close(StatsPage_Struct *page, int id)
+{
+    if(page == NULL)
+        return;
+    if(id < 0)
+        free(page);
+    else
+    {
+        //与环形队列一样随生产者退出删除, 已挂载的读者仍能看到最后的值
+        page->producer = 0;
+        shmdt(page);
+        shm_destroy(id);
+    }
+}
+
+void stream_stats_init(StreamStats_Struct *st, unsigned int index, const char *url)
+{
+    const char *p = strstr(url, "://"), *at, *slash;
+    unsigned int i = 0;
+
+    st->index = index;
+    //标签里不能带用户名密码, 也不能有引号和反斜杠
+    if(p)
+    {
+        p += 3;
+        at = strchr(p, '@');
+        slash = strchr(p, '/');
+        if(at && (slash == NULL || at < slash))
+        {
+            i = p - url < (long)sizeof(st->url) - 1 ? p - url : 0;
+            memcpy(st->url, url, i);
+            url = at + 1;
+        }
+    }
+    for(; *url && i < sizeof(st->url) - 1; url++)
+    {
+        if(*url != '"' && *url != '\\')
+            st->url[i++] = *url;
+    }
+    st->url[i] = 0;
+}
+
+void stream_stats_nal(StreamStats_Struct *st, unsigned int len, int kind, unsigned long long ptsUs, unsigned long long nowUs)
+{
+    if(st->start_us == 0)
+        st->start_us = st->win_start_us = nowUs;
+    st->nals += 1;
+    st->bytes += len;
+    st->win_bytes += len;
+    if(kind == 0)
+        return;
+    //一帧可能分成多个slice, 显示时间变了才算新的一帧
+    if(st->frames == 0 || ptsUs != st->last_pts)
+    {
+        st->frames += 1;
+        st->win_frames += 1;
+        st->last_pts = ptsUs;
+        if(kind == 2)
+        {
+            st->keyframes += 1;
+            if(st->gop_frames)
+            {
+                st->gop = st->gop_frames;
+                if(st->gop > st->gop_max)
+                    st->gop_max = st->gop;
+            }
+            st->gop_frames = 0;
+        }
+        st->gop_frames += 1;
+    }
+}
+
+void stream_stats_output(StreamStats_Struct *st, unsigned int len, int written, unsigned long long latencyUs)
+{
+    int i = 0;
+
+    if(!written)
+    {
+        st->dropped += 1;
+        return;
+    }
+    st->written += 1;
+    st->written_bytes += len;
+    st->lat_count += 1;
+    st->lat_sum_us += latencyUs;
+    if(latencyUs > st->lat_max_us)
+        st->lat_max_us = latencyUs;
+    while(i < STREAM_STATS_LAT_BUCKETS - 1 && latencyUs >= (1ULL << i))
+        i += 1;
+    st->lat_bucket[i] += 1;
+}
+
+void stream_stats_rtp(StreamStats_Struct *st, unsigned int expected, unsigned int received, unsigned int jitterUs)
+{
+    unsigned int dExpected, dReceived;
+
+    //累计值变小说明换了新会话, 当前值整个都是增量
+    if(expected < st->rtp_expected_last || received < st->rtp_received_last)
+        st->rtp_expected_last = st->rtp_received_last = 0;
+    dExpected = expected - st->rtp_expected_last;
+    dReceived = received - st->rtp_received_last;
+    st->rtp_expected_last = expected;
+    st->rtp_received_last = received;
+    st->rtp_packets += dReceived;
+    //重复包会让实收多于应收
+    if(dExpected > dReceived)
+        st->rtp_lost += dExpected - dReceived;
+    st->jitter_us = jitterUs;
+}
+
+void stream_stats_tick(StreamStats_Struct *st, unsigned long long nowUs)
+{
+    unsigned long long span;
+
+    if(st->start_us == 0)
+        return;
+    span = nowUs - st->win_start_us;
+    if(span < STREAM_STATS_WINDOW_US)
+        return;
+    st->fps_milli = (unsigned int)(st->win_frames * 1000000000ULL / span);
+    st->bitrate = (unsigned int)(st->win_bytes * 8000000ULL / span);
+    if(nowUs > st->start_us)
+        st->bitrate_avg = (unsigned int)(st->bytes * 8000000ULL / (nowUs - st->start_us));
+    st->win_start_us = nowUs;
+    st->win_frames = 0;
+    st->win_bytes = 0;
+}
+
+//---------- Prometheus ----------
+
+typedef struct{
+    char *buf;
+    unsigned int size;
+    unsigned int len;
+    unsigned int need; //放得下全部内容需要的长度
+}StatsOut_Struct;
+
+//放不下的那一行整行不写, 之后也不再写, 只累计 need
+static void stats_printf(StatsOut_Struct *out, const char *fmt, ...)
+{
+    unsigned int room = out->len + 1 < out->size ? out->size - out->len : 0;
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(room ? out->buf + out->len : NULL, room, fmt, ap);
+    va_end(ap);
+    if(n < 0)
+        return;
+    out->need += n;
+    if(room == 0)
+        return;
+    if((unsigned int)n >= room)
+    {
+        out->buf[out->len] = 0;
+        out->len = out->size;
+    }
+    else
+        out->len += n;
+}
+
+static void stats_metric(StatsOut_Struct *out, StatsPage_Struct *page, const char *name, const char *type,
+    const char *help, unsigned int offset, int size, double scale)
+{
+    unsigned int i;
+
+    stats_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    for(i = 0; i < page->count; i++)
+    {
+        StreamStats_Struct *st = &page->stream[i];
+        const char *p = (const char *)st + offset;
+        double v = size == 8 ? (double)*(const unsigned long long *)p : (double)*(const unsigned int *)p;
+        stats_printf(out, "%s{stream=\"%u\",url=\"%s\"} %.15g\n", name, st->index, st->url, v * scale);
+    }
+}
+
+#define STATS_FIELD(f) offsetof(StreamStats_Struct, f), (int)sizeof(((StreamStats_Struct *)0)->f)
+
+int stats_format_prom(StatsPage_Struct *page, char *buf, unsigned int size)
+{
+    StatsOut_Struct out = {buf, size, 0, 0};
+    unsigned int i;
+    int b;
+
+    if(size == 0)
+        return 0;
+    buf[0] = 0;
+    stats_metric(&out, page, "rtsp_nals_total", "counter", "NAL units received", STATS_FIELD(nals), 1);
+    stats_metric(&out, page, "rtsp_received_bytes_total", "counter", "Bytes received", STATS_FIELD(bytes), 1);
+    stats_metric(&out, page, "rtsp_frames_total", "counter", "Pictures received", STATS_FIELD(frames), 1);
+    stats_metric(&out, page, "rtsp_keyframes_total", "counter", "IDR/IRAP pictures received", STATS_FIELD(keyframes), 1);
+    stats_metric(&out, page, "rtsp_written_nals_total", "counter", "NAL units handed to the outputs", STATS_FIELD(written), 1);
+    stats_metric(&out, page, "rtsp_written_bytes_total", "counter", "Bytes handed to the outputs", STATS_FIELD(written_bytes), 1);
+    stats_metric(&out, page, "rtsp_dropped_nals_total", "counter", "NAL units dropped (truncated or waiting for a keyframe)", STATS_FIELD(dropped), 1);
+    stats_metric(&out, page, "rtsp_reconnects_total", "counter", "RTSP session restarts", STATS_FIELD(reconnects), 1);
+    stats_metric(&out, page, "rtsp_fps", "gauge", "Measured frame rate", STATS_FIELD(fps_milli), 0.001);
+    stats_metric(&out, page, "rtsp_bitrate_bps", "gauge", "Bitrate over the last window", STATS_FIELD(bitrate), 1);
+    stats_metric(&out, page, "rtsp_bitrate_avg_bps", "gauge", "Average bitrate since start", STATS_FIELD(bitrate_avg), 1);
+    stats_metric(&out, page, "rtsp_gop_frames", "gauge", "Length of the last complete GOP", STATS_FIELD(gop), 1);
+    stats_metric(&out, page, "rtsp_gop_max_frames", "gauge", "Longest GOP seen", STATS_FIELD(gop_max), 1);
+    stats_metric(&out, page, "rtsp_rtp_packets_total", "counter", "RTP packets received", STATS_FIELD(rtp_packets), 1);
+    stats_metric(&out, page, "rtsp_rtp_lost_total", "counter", "RTP packets missing from the sequence", STATS_FIELD(rtp_lost), 1);
+    stats_metric(&out, page, "rtsp_rtp_jitter_seconds", "gauge", "RTP interarrival jitter", STATS_FIELD(jitter_us), 0.000001);
+
+    stats_printf(&out, "# HELP rtsp_publish_latency_seconds Time from receiving a NAL to handing it to all outputs\n"
+        "# TYPE rtsp_publish_latency_seconds histogram\n");
+    for(i = 0; i < page->count; i++)
+    {
+        StreamStats_Struct *st = &page->stream[i];
+        unsigned long long count = 0;
+        for(b = 0; b < STREAM_STATS_LAT_BUCKETS - 1; b++)
+        {
+            count += st->lat_bucket[b];
+            stats_printf(&out, "rtsp_publish_latency_seconds_bucket{stream=\"%u\",url=\"%s\",le=\"%g\"} %llu\n",
+                st->index, st->url, (double)(1ULL << b) / 1000000, count);
+        }
+        stats_printf(&out, "rtsp_publish_latency_seconds_bucket{stream=\"%u\",url=\"%s\",le=\"+Inf\"} %llu\n",
+            st->index, st->url, st->lat_count);
+        stats_printf(&out, "rtsp_publish_latency_seconds_sum{stream=\"%u\",url=\"%s\"} %.6f\n",
+            st->index, st->url, (double)st->lat_sum_us / 1000000);
+        stats_printf(&out, "rtsp_publish_latency_seconds_count{stream=\"%u\",url=\"%s\"} %llu\n",
+            st->index, st->url, st->lat_count);
+    }
+    return out.need;
+}
+
+//---------- HTTP ----------
+
+#define STATS_HTTP_RETRY_MS 100 //accept 持续出错(如 EMFILE)时的重试间隔
+
+static void *stats_http_thread(void *argv)
+{
+    StatsHttp_Struct *http = (StatsHttp_Struct *)argv;
+    unsigned int size = 16384 + http->page->count * 8192;
+    char *body = (char *)malloc(size), *p;
+    char head[128], req[1024];
+    struct pollfd pfd;
+    int fd, len, n;
+
+    while(body && !http->quit)
+    {
+        fd = accept(http->fd, NULL, NULL);
+        if(fd < 0)
+        {
+            //fd 用完等错误不会自己消失, 不能原地空转
+            if(errno != EINTR && errno != ECONNABORTED && !http->quit)
+                poll(NULL, 0, STATS_HTTP_RETRY_MS);
+            continue;
+        }
+        //读掉请求头, 不管路径都回指标; 慢客户端最多等1秒
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if(poll(&pfd, 1, 1000) > 0)
+            n = recv(fd, req, sizeof(req), 0);
+        //url 标签每行都重复, 长url时初始的估计不够, 按实际需要加大后重来, 截断的内容 Prometheus 解析不了
+        while((len = stats_format_prom(http->page, body, size)) >= (int)size)
+        {
+            p = (char *)realloc(body, len + len / 4 + 1);
+            if(p == NULL)
+                break;
+            body = p;
+            size = len + len / 4 + 1;
+        }
+        if(len >= (int)size)
+        {
+            close(fd);
+            continue;
+        }
+        n = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %d\r\nConnection: close\r\n\r\n", len);
+        if(send(fd, head, n, MSG_NOSIGNAL) == n)
+            send(fd, body, len, MSG_NOSIGNAL);
+        close(fd);
+    }
+    free(body);
+    return NULL;
+}
+
+StatsHttp_Struct *stats_http_start(StatsPage_Struct *page, int port)
+{
+    StatsHttp_Struct *http;
+    struct sockaddr_in addr;
+    int fd, on = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        return NULL;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    http = (StatsHttp_Struct *)calloc(1, sizeof(StatsHttp_Struct));
+    if(http == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    http->page = page;
+    http->fd = fd;
+    if(pthread_create(&http->th, NULL, stats_http_thread, http) != 0)
+    {
+        close(fd);
+        free(http);
+        return NULL;
+    }
+    return http;
+}
+
+void stats_http_stop(StatsHttp_Struct *http)
+{
+    if(http == NULL)
+        return;
+    http->quit = 1;
+    //阻塞在 accept 里的线程由 shutdown 唤醒
+    shutdown(http->fd, SHUT_RDWR);
+    pthread_join(http->th, NULL);
+    close(http->fd);
+    free(http);
+}
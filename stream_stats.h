@@ -0,0 +1,105 @@
+
+#ifndef _STREAM_STATS_H_
+#define _STREAM_STATS_H_
+
+#include <pthread.h>
+
+#define STREAM_STATS_MAGIC 0x54415453 //"STAT"
+#define STREAM_STATS_VERSION 1
+#define STREAM_STATS_LAT_BUCKETS 24 //延迟直方图: 第i格为 < 2^i us, 最后一格放不下的都算进去
+#define STREAM_STATS_WINDOW_US 1000000 //fps/码率的统计窗口
+
+//一路流的指标: 由所属的事件循环线程写, 读者(统计页/HTTP)只读, 单个字段不撕裂, 字段之间不保证一致
+typedef struct{
+    char url[256]; //去掉了用户名密码
+    unsigned int index;
+    unsigned char codec; //0/unknow 1/h264 2/h265
+    unsigned char transport; //0/udp 1/tcp 2/http
+    unsigned short resv;
+    unsigned long long start_us; //第一个NAL的时间(CLOCK_MONOTONIC)
+
+    //从启动开始累计, 重连不清零
+    unsigned long long nals; //收到的NAL数
+    unsigned long long bytes;
+    unsigned long long frames; //收到的图像数, 按VCL NAL的显示时间区分
+    unsigned long long keyframes;
+    unsigned long long written; //交给输出的NAL数
+    unsigned long long written_bytes;
+    unsigned long long dropped; //截断及等关键帧期间丢掉的NAL数
+    unsigned long long reconnects;
+
+    //每个窗口更新
+    unsigned int fps_milli; //实测帧率*1000
+    unsigned int bitrate; //最近窗口 bit/s
+    unsigned int bitrate_avg; //自开始 bit/s
+    unsigned int gop; //上一个完整GOP的帧数
+    unsigned int gop_max;
+
+    //RTP接收统计(RTCP接收报告里的应收/实收/抖动), 重连后接着累计
+    unsigned long long rtp_packets;
+    unsigned long long rtp_lost; //按序号缺口算出的丢包
+    unsigned int jitter_us;
+
+    //收到一个NAL到所有输出写完的耗时
+    unsigned long long lat_count;
+    unsigned long long lat_sum_us;
+    unsigned long long lat_max_us;
+    unsigned long long lat_bucket[STREAM_STATS_LAT_BUCKETS];
+
+    //内部状态
+    unsigned long long last_pts; //上一个VCL的显示时间 us
+    unsigned int gop_frames; //当前GOP已收的帧数
+    unsigned int rtp_expected_last; //当前会话上次看到的累计值
+    unsigned int rtp_received_last;
+    unsigned long long win_start_us;
+    unsigned long long win_frames;
+    unsigned long long win_bytes;
+}StreamStats_Struct;
+
+//统计页: 所有流的指标放在一块(可选共享内存), 外部工具挂上直接读
+typedef struct{
+    unsigned int magic;
+    unsigned short version;
+    unsigned short size; //sizeof(StreamStats_Struct), 以后加字段时旧的读取端按它跳
+    unsigned int count;
+    int producer; //生产者pid
+    unsigned long long update; //每个窗口加1
+    StreamStats_Struct stream[0];
+}StatsPage_Struct;
+
+//path 为空时只在本进程内分配, 否则放在 ftok(path, flag) 的共享内存里, id 给 stats_page_close()
+//return: NULL/失败
+StatsPage_Struct *stats_page_create(char *path, int flag, unsigned int count, int *id);
+//共享内存的统计页同时删除
+void stats_page_close(StatsPage_Struct *page, int id);
+
+//url 去掉 user:password@ 后作为标签
+void stream_stats_init(StreamStats_Struct *st, unsigned int index, const char *url);
+//收到一个NAL, kind: 0/非VCL 1/VCL 2/关键帧, ptsUs: 显示时间, nowUs: CLOCK_MONOTONIC
+void stream_stats_nal(StreamStats_Struct *st, unsigned int len, int kind, unsigned long long ptsUs, unsigned long long nowUs);
+//该NAL交给了输出(written=1)或被丢掉, latencyUs: 从收到到写完
+void stream_stats_output(StreamStats_Struct *st, unsigned int len, int written, unsigned long long latencyUs);
+//RTP累计值, 会话重建(重连)后累计值从0开始
+void stream_stats_rtp(StreamStats_Struct *st, unsigned int expected, unsigned int received, unsigned int jitterUs);
+//窗口到期时算 fps/码率, 由定时器调用
+void stream_stats_tick(StreamStats_Struct *st, unsigned long long nowUs);
+
+//Prometheus 文本格式, return: 全部内容的长度(不含结尾0), >= size 时 buf 里只有放得下的整行, 加大 buf 重来
+int stats_format_prom(StatsPage_Struct *page, char *buf, unsigned int size);
+typedef struct{
+    StatsPage_Struct *page;
+    int fd;
+    volatile int quit;
+    pthread_t th;
+}StatsHttp_Struct;
+
+//在 127.0.0.1:port 起一个线程, 任意 HTTP 请求都回 stats_format_prom() 的内容
+//return: NULL/端口被占用等
+StatsHttp_Struct *stats_http_start(StatsPage_Struct *page, int port);
+//等线程退出后关端口, 之后才能 stats_page_close()
+void stats_http_stop(StatsHttp_Struct *http);
+
+//CLOCK_MONOTONIC us
+unsigned long long stats_now_us(void);
+
+#endif
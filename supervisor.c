@@ -0,0 +1,397 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#include "supervisor.h"
+
+#define SUPERVISOR_POLL_MS 200 //没有 pidfd 时 waitpid 轮询的间隔
+
+static unsigned long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//glibc 2.36 之前没有 pidfd_open() 的封装, 直接走系统调用, 内核 5.3 之前返回 -1
+static int sup_pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static void sup_wake(Supervisor_Struct *sup)
+{
+    unsigned long long one = 1;
+    if(write(sup->evfd, &one, sizeof(one)) < 0)
+        ;
+}
+
+static void worker_free(Supervisor_Struct *sup, SupWorker_Struct *w)
+{
+    int i;
+    for(i = 0; w->argv[i]; i++)
+        free(w->argv[i]);
+    memset(w, 0, sizeof(SupWorker_Struct));
+    w->pidfd = -1;
+    sup->count -= 1;
+}
+
+//fork/exec, 失败时按退避时间稍后再试
+static void worker_spawn(Supervisor_Struct *sup, SupWorker_Struct *w, int id)
+{
+    struct epoll_event ev;
+    sigset_t set;
+    pid_t pid;
+
+    w->next_ms = 0;
+    w->start_ms = now_ms();
+    if((pid = fork()) < 0)
+    {
+        fprintf(stderr, "supervisor: fork %s err %d\n", w->argv[0], errno);
+        w->next_ms = w->start_ms + SUPERVISOR_BACKOFF_MAX_MS;
+        return;
+    }
+    else if(pid == 0) //child process
+    {
+        //监管线程屏蔽了所有信号, 子进程要恢复
+        sigemptyset(&set);
+        sigprocmask(SIG_SETMASK, &set, NULL);
+        execv(w->argv[0], w->argv);
+        _exit(127);
+    }
+    w->pid = pid;
+    if(w->pid0 == 0)
+        w->pid0 = pid;
+    w->pidfd = sup_pidfd_open(pid);
+    if(w->pidfd >= 0)
+    {
+        fcntl(w->pidfd, F_SETFD, FD_CLOEXEC);
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = id;
+        epoll_ctl(sup->epfd, EPOLL_CTL_ADD, w->pidfd, &ev);
+    }
+}
+
+//子进程已回收: 要求关闭的和正常退出(exit 0)的释放, 异常退出的按退避时间重新拉起
+static void worker_exited(Supervisor_Struct *sup, SupWorker_Struct *w, int id, int status)
+{
+    unsigned long long now = now_ms();
+    pid_t pid = w->pid;
+    int delay, shift;
+
+    if(w->pidfd >= 0)
+        close(w->pidfd); //close 时自动从 epoll 中移除
+    w->pidfd = -1;
+    w->pid = 0;
+    w->kill_ms = 0;
+    w->status = status;
+    //exit 0 是生产者自己收尾退出(如 shm ctrl 2, 所有流都结束), 不再拉起; 要求重启的除外
+    if(w->stopping || (!w->restarting && status >= 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0))
+    {
+        if(sup->callback)
+            sup->callback(sup->priv, id, pid, status, -1);
+        worker_free(sup, w);
+        return;
+    }
+    if(w->restarting)
+    {
+        w->restarting = 0;
+        delay = 0;
+    }
+    else
+    {
+        if(now - w->start_ms >= SUPERVISOR_STABLE_MS)
+            w->fails = 0;
+        shift = w->fails < 16 ? w->fails : 16;
+        delay = SUPERVISOR_BACKOFF_MIN_MS << shift;
+        if(delay > SUPERVISOR_BACKOFF_MAX_MS)
+            delay = SUPERVISOR_BACKOFF_MAX_MS;
+        w->fails += 1;
+    }
+    w->restarts += 1;
+    w->next_ms = now + delay;
+    if(sup->callback)
+        sup->callback(sup->priv, id, pid, status, delay);
+}
+
+//不用 pidfd 时, 或者 pidfd 可读后, 非阻塞回收
+static void worker_reap(Supervisor_Struct *sup, SupWorker_Struct *w, int id)
+{
+    int status = 0;
+    pid_t ret = waitpid(w->pid, &status, WNOHANG);
+    if(ret == w->pid)
+        worker_exited(sup, w, id, status);
+    else if(ret < 0 && errno == ECHILD) //被别处的 waitpid(-1) 回收了
+        worker_exited(sup, w, id, -1);
+}
+
+static void worker_signal(SupWorker_Struct *w, unsigned long long now)
+{
+    //与 process_close() 一样用 SIGUSR1, 生产者收到后关闭输出文件和共享内存再退出
+    kill(w->pid, SIGUSR1);
+    if(w->kill_ms == 0)
+        w->kill_ms = now + SUPERVISOR_KILL_MS;
+}
+
+static void worker_stop(Supervisor_Struct *sup, SupWorker_Struct *w)
+{
+    if(w->stopping)
+        return;
+    w->stopping = 1;
+    if(w->pid)
+        worker_signal(w, now_ms());
+    else
+        worker_free(sup, w);
+}
+
+static void *supervisor_thread(void *arg)
+{
+    Supervisor_Struct *sup = (Supervisor_Struct *)arg;
+    struct epoll_event ev[16];
+    unsigned long long now, val;
+    long long wait;
+    int timeout, n, i;
+
+    pthread_mutex_lock(&sup->lock);
+    while(sup->running || sup->count > 0)
+    {
+        //到期的重启/强杀, 同时算出下一次要醒来的时间
+        now = now_ms();
+        timeout = -1;
+        for(i = 0; i < SUPERVISOR_MAX; i++)
+        {
+            SupWorker_Struct *w = &sup->worker[i];
+            if(!w->used)
+                continue;
+            if(w->pid && w->pidfd < 0)
+                worker_reap(sup, w, i);
+            if(!w->used)
+                continue;
+            if(w->pid == 0 && w->next_ms && now >= w->next_ms)
+                worker_spawn(sup, w, i);
+            if(w->pid && w->kill_ms && now >= w->kill_ms)
+            {
+                kill(w->pid, SIGKILL);
+                w->kill_ms = 0;
+            }
+            wait = -1;
+            if(w->pid == 0 && w->next_ms)
+                wait = w->next_ms - now;
+            else if(w->pid && w->kill_ms)
+                wait = w->kill_ms - now;
+            if(w->pid && w->pidfd < 0 && (wait < 0 || wait > SUPERVISOR_POLL_MS))
+                wait = SUPERVISOR_POLL_MS;
+            if(wait >= 0 && (timeout < 0 || wait < timeout))
+                timeout = (int)wait;
+        }
+        pthread_mutex_unlock(&sup->lock);
+
+        n = epoll_wait(sup->epfd, ev, 16, timeout);
+
+        pthread_mutex_lock(&sup->lock);
+        for(i = 0; i < n; i++)
+        {
+            unsigned int id = ev[i].data.u32;
+            if(id == SUPERVISOR_MAX)
+            {
+                if(read(sup->evfd, &val, sizeof(val)) < 0)
+                    ;
+            }
+            else if(sup->worker[id].used && sup->worker[id].pid)
+                worker_reap(sup, &sup->worker[id], id);
+        }
+    }
+    pthread_mutex_unlock(&sup->lock);
+    return NULL;
+}
+
+Supervisor_Struct *supervisor_create(Supervisor_Callback callback, void *priv)
+{
+    Supervisor_Struct *sup = (Supervisor_Struct *)calloc(1, sizeof(Supervisor_Struct));
+    struct epoll_event ev;
+    sigset_t set, old;
+    int i, ret;
+
+    if(sup == NULL)
+        return NULL;
+    for(i = 0; i < SUPERVISOR_MAX; i++)
+        sup->worker[i].pidfd = -1;
+    sup->callback = callback;
+    sup->priv = priv;
+    sup->running = 1;
+    pthread_mutex_init(&sup->lock, NULL);
+    sup->epfd = epoll_create1(EPOLL_CLOEXEC);
+    sup->evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(sup->epfd < 0 || sup->evfd < 0)
+    {
+        fprintf(stderr, "supervisor: epoll/eventfd err %d\n", errno);
+        goto err;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = SUPERVISOR_MAX;
+    epoll_ctl(sup->epfd, EPOLL_CTL_ADD, sup->evfd, &ev);
+
+    //信号留给调用者的线程处理
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &old);
+    ret = pthread_create(&sup->thread, NULL, supervisor_thread, sup);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(ret != 0)
+    {
+        fprintf(stderr, "supervisor: pthread_create err %d\n", ret);
+        goto err;
+    }
+    return sup;
+
+err:
+    if(sup->epfd >= 0)
+        close(sup->epfd);
+    if(sup->evfd >= 0)
+        close(sup->evfd);
+    pthread_mutex_destroy(&sup->lock);
+    free(sup);
+    return NULL;
+}
+
+void supervisor_destroy(Supervisor_Struct *sup)
+{
+    int i;
+    if(sup == NULL)
+        return;
+    pthread_mutex_lock(&sup->lock);
+    sup->running = 0;
+    for(i = 0; i < SUPERVISOR_MAX; i++)
+    {
+        if(sup->worker[i].used)
+            worker_stop(sup, &sup->worker[i]);
+    }
+    pthread_mutex_unlock(&sup->lock);
+    sup_wake(sup);
+    //子进程都退出(最多等 SUPERVISOR_KILL_MS 后强杀)线程才返回
+    pthread_join(sup->thread, NULL);
+    close(sup->epfd);
+    close(sup->evfd);
+    pthread_mutex_destroy(&sup->lock);
+    free(sup);
+}
+
+int supervisor_start(Supervisor_Struct *sup, char *const argv[])
+{
+    SupWorker_Struct *w = NULL;
+    int id, i;
+
+    if(sup == NULL || argv == NULL || argv[0] == NULL)
+        return -1;
+    pthread_mutex_lock(&sup->lock);
+    for(id = 0; id < SUPERVISOR_MAX; id++)
+    {
+        if(!sup->worker[id].used)
+        {
+            w = &sup->worker[id];
+            break;
+        }
+    }
+    if(w == NULL || !sup->running)
+    {
+        pthread_mutex_unlock(&sup->lock);
+        return -1;
+    }
+    w->used = 1;
+    sup->count += 1;
+    for(i = 0; i < SUPERVISOR_ARGS && argv[i]; i++)
+        w->argv[i] = strdup(argv[i]);
+    w->argv[i] = NULL;
+    //在调用者线程里 fork, 返回时 pid 已经有效
+    worker_spawn(sup, w, id);
+    pthread_mutex_unlock(&sup->lock);
+    sup_wake(sup);
+    return id;
+}
+
+int supervisor_stop(Supervisor_Struct *sup, int id)
+{
+    if(sup == NULL || id < 0 || id >= SUPERVISOR_MAX)
+        return -1;
+    pthread_mutex_lock(&sup->lock);
+    if(!sup->worker[id].used)
+    {
+        pthread_mutex_unlock(&sup->lock);
+        return -1;
+    }
+    worker_stop(sup, &sup->worker[id]);
+    pthread_mutex_unlock(&sup->lock);
+    sup_wake(sup);
+    return 0;
+}
+
+int supervisor_restart(Supervisor_Struct *sup, int id)
+{
+    SupWorker_Struct *w;
+    if(sup == NULL || id < 0 || id >= SUPERVISOR_MAX)
+        return -1;
+    pthread_mutex_lock(&sup->lock);
+    w = &sup->worker[id];
+    if(!w->used || w->stopping)
+    {
+        pthread_mutex_unlock(&sup->lock);
+        return -1;
+    }
+    if(w->pid)
+    {
+        w->restarting = 1;
+        worker_signal(w, now_ms());
+    }
+    else
+        w->next_ms = now_ms();
+    pthread_mutex_unlock(&sup->lock);
+    sup_wake(sup);
+    return 0;
+}
+
+pid_t supervisor_pid(Supervisor_Struct *sup, int id)
+{
+    pid_t pid = -1;
+    if(sup == NULL || id < 0 || id >= SUPERVISOR_MAX)
+        return -1;
+    pthread_mutex_lock(&sup->lock);
+    if(sup->worker[id].used)
+        pid = sup->worker[id].pid;
+    pthread_mutex_unlock(&sup->lock);
+    return pid;
+}
+
+int supervisor_find(Supervisor_Struct *sup, pid_t pid)
+{
+    int id, ret = -1;
+    if(sup == NULL || pid <= 0)
+        return -1;
+    pthread_mutex_lock(&sup->lock);
+    for(id = 0; id < SUPERVISOR_MAX; id++)
+    {
+        if(sup->worker[id].used && (sup->worker[id].pid == pid || sup->worker[id].pid0 == pid))
+        {
+            ret = id;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sup->lock);
+    return ret;
+}
@@ -0,0 +1,63 @@
+
+#ifndef _SUPERVISOR_H_
+#define _SUPERVISOR_H_
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#define SUPERVISOR_MAX 256 //最多管理的子进程数
+#define SUPERVISOR_ARGS 32 //每个子进程最多的参数个数(含 argv[0])
+#define SUPERVISOR_BACKOFF_MIN_MS 500 //异常退出后第一次拉起前等待
+#define SUPERVISOR_BACKOFF_MAX_MS 30000 //连续异常退出时等待翻倍, 最多到这里
+#define SUPERVISOR_STABLE_MS 10000 //运行超过这么久再退出, 退避从头算
+#define SUPERVISOR_KILL_MS 3000 //SIGUSR1 后超过这么久没退出就 SIGKILL
+
+//一个子进程, 由监管线程 fork/exec 并用 pidfd 等待退出, 异常退出(非0或被信号杀掉)后按退避时间重新拉起, exit 0 不再拉起
+typedef struct{
+    int used;
+    char *argv[SUPERVISOR_ARGS + 1]; //argv[0] 为可执行文件路径
+    pid_t pid; //0/还没起来(等待重启)
+    pid_t pid0; //第一次启动的pid, 重启后调用者手里的还是它
+    int pidfd; //-1/内核不支持 pidfd, 靠定时 waitpid
+    int stopping; //已要求关闭, 退出后释放
+    int restarting; //已要求重启, 退出后立即拉起
+    unsigned int restarts; //累计重启次数
+    unsigned int fails; //连续短命退出的次数, 决定退避时间
+    int status; //上次退出的 waitpid 状态
+    unsigned long long start_ms; //本次启动时间 CLOCK_MONOTONIC ms
+    unsigned long long next_ms; //非0时到该时刻拉起
+    unsigned long long kill_ms; //非0时到该时刻仍未退出则 SIGKILL
+}SupWorker_Struct;
+
+//子进程退出回调, 在监管线程里调用(持有锁, 不要再调 supervisor_xxx), delayMs<0 表示不再拉起
+typedef void (*Supervisor_Callback)(void *priv, int id, pid_t pid, int status, int delayMs);
+
+typedef struct{
+    int epfd;
+    int evfd; //eventfd, 接口调用后唤醒监管线程
+    int running;
+    int count; //在用的子进程数
+    pthread_t thread;
+    pthread_mutex_t lock;
+    Supervisor_Callback callback;
+    void *priv;
+    SupWorker_Struct worker[SUPERVISOR_MAX];
+}Supervisor_Struct;
+
+//起一个监管线程, callback 可为NULL, return: NULL/失败
+Supervisor_Struct *supervisor_create(Supervisor_Callback callback, void *priv);
+//关闭所有子进程, 等它们退出后释放
+void supervisor_destroy(Supervisor_Struct *sup);
+
+//启动一个子进程并一直保持运行, argv 以NULL结尾, 会被拷贝, return: id -1/失败
+int supervisor_start(Supervisor_Struct *sup, char *const argv[]);
+//只关闭这一个: SIGUSR1, 超时后 SIGKILL, 不等待退出, return: 0/success -1/id无效
+int supervisor_stop(Supervisor_Struct *sup, int id);
+//只重启这一个, 不计入退避, return: 0/success -1/id无效
+int supervisor_restart(Supervisor_Struct *sup, int id);
+//return: 当前pid 0/正在等待重启 -1/id无效
+pid_t supervisor_pid(Supervisor_Struct *sup, int id);
+//按pid(当前的或第一次启动的)找id, return: -1/不是本监管器的子进程
+int supervisor_find(Supervisor_Struct *sup, pid_t pid);
+
+#endif